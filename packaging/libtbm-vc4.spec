@@ -11,11 +11,21 @@ BuildRequires:  pkgconfig(libdrm_vc4)
 BuildRequires:  pkgconfig(libtbm)
 BuildRequires:  pkgconfig(dlog)
 BuildRequires:  pkgconfig(libudev)
+# the copy kernels of the wc mappings are neon ones, the x86 ones only
+# serve the tests on a build host
 ExclusiveArch:  %{arm} aarch64
 
 %description
 descriptionion: Tizen Buffer manager backend module for vc4
 
+%package devel
+Summary:        Tizen Buffer Manager - vc4 backend (devel)
+Group:          Development/Libraries
+Requires:       %{name} = %{version}-%{release}
+
+%description devel
+Header of the vc4 backend extension functions
+
 %if 0%{?TZ_SYS_RO_SHARE:1}
 # TZ_SYS_RO_SHARE is already defined
 %else
@@ -57,3 +67,6 @@ ln -s libtbm-vc4.so %{_libdir}/bufmgr/libtbm_default.so
 %{_libdir}/bufmgr/libtbm-*.so*
 %{TZ_SYS_RO_SHARE}/license/%{name}
 %{_libdir}/udev/rules.d/99-libtbm-vc4.rules
+
+%files devel
+%{_includedir}/tbm_bufmgr_vc4.h
@@ -35,26 +35,58 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <xf86drm.h>
 #include <tbm_bufmgr.h>
 #include <tbm_bufmgr_backend.h>
 #include <vc4_drm.h>
 #include <pthread.h>
+#include <sched.h>
 #include <tbm_surface.h>
 #include <tbm_surface_internal.h>
 #include <tbm_drm_helper.h>
 
 #include <libudev.h>
 
+/* the neon kernels of a 32 bits build without -mfpu=neon get the target
+ * of their own, they are picked at init if the cpu has neon.
+ */
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define VC4_COPY_NEON
+#define VC4_NEON_TARGET
+#elif defined(__arm__) && defined(__ARM_FP) && !defined(__clang__) && __GNUC__ >= 8
+#include <arm_neon.h>
+#define VC4_COPY_NEON
+#define VC4_NEON_TARGET	__attribute__((target("fpu=neon")))
+#endif
+#if defined(VC4_COPY_NEON) && defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+/* the library is only shipped for arm, the x86 kernels are built for the
+ * tests on the build host.
+ */
+#if defined(__SSE2__) && defined(VC4_COPY_X86)
+#include <emmintrin.h>
+#include <smmintrin.h>
+#define VC4_COPY_SSE2
+#endif
+
 #include "tbm_bufmgr_tgl.h"
+#include "tbm_bufmgr_vc4.h"
 
 #define DEBUG
 #define USE_DMAIMPORT
@@ -112,6 +144,8 @@ char *target_name()
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#define TBM_VC4_PAGE_SIZE	4096
+
 #ifdef ALIGN_EIGHT
 #define TBM_SURFACE_ALIGNMENT_PLANE (8)
 #define TBM_SURFACE_ALIGNMENT_PITCH_RGB (8)
@@ -172,6 +206,39 @@ struct dma_buf_fence {
 #define DMABUF_IOCTL_GET_FENCE	DMABUF_IOWR(0x01, struct dma_buf_fence)
 #define DMABUF_IOCTL_PUT_FENCE	DMABUF_IOWR(0x02, struct dma_buf_fence)
 
+/* bo cache */
+#define BO_CACHE_BUCKET_MAX	56
+#define BO_CACHE_MAX_SIZE	(64 * SZ_1M)
+#define BO_CACHE_TIMEOUT	1	/* seconds */
+
+/* life of a bo, an import may take back a cached bo but not a dying one */
+#define BO_STATE_LIVE		0
+#define BO_STATE_CACHED		1
+#define BO_STATE_DYING		2
+
+/* slab of small bos, one bit of used per page */
+#define SLAB_PAGES		64
+#define SLAB_SIZE		(SLAB_PAGES * TBM_VC4_PAGE_SIZE)
+
+/* number of bo privates allocated together */
+#define BO_PRIV_CHUNK		16
+#define TBM_VC4_CACHE_LINE	64
+
+/* bos allocated ahead at init, see TBM_VC4_PREWARM */
+#define PREWARM_MAX		64
+#define PREWARM_HOLD		10	/* seconds kept in the bo cache */
+#define PREWARM_SPEC_MAX	4096
+
+/* memory pressure trigger, a stall of 150ms in 1s */
+#define PRESSURE_FILE		"/proc/pressure/memory"
+#define PRESSURE_TRIGGER	"some 150000 1000000"
+
+/* bo broker of the display server, see TBM_VC4_BROKER */
+#define BROKER_REQ_DRM_FD	1	/* an authenticated drm fd */
+#define BROKER_REQ_DMABUF	2	/* the dmabuf fds of bos by their keys */
+#define BROKER_KEYS_MAX		16
+#define BROKER_TIMEOUT		1	/* seconds */
+
 /* tgl key values */
 #define GLOBAL_KEY   ((unsigned int)(-1))
 /* TBM_CACHE */
@@ -198,22 +265,383 @@ union _tbm_bo_cache_state {
 	} data;
 };
 
+typedef struct _vc4_list {
+	struct _vc4_list *prev;
+	struct _vc4_list *next;
+} vc4_list;
+
+#define vc4_container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline void
+_list_init(vc4_list *head)
+{
+	head->prev = head;
+	head->next = head;
+}
+
+static inline int
+_list_empty(vc4_list *head)
+{
+	return head->next == head;
+}
+
+static inline void
+_list_add_tail(vc4_list *item, vc4_list *head)
+{
+	item->prev = head->prev;
+	item->next = head;
+	head->prev->next = item;
+	head->prev = item;
+}
+
+static inline void
+_list_del(vc4_list *item)
+{
+	item->prev->next = item->next;
+	item->next->prev = item->prev;
+	_list_init(item);
+}
+
+/* open addressing table with linear probing, 0 is not a valid key */
+typedef struct _vc4_table_entry {
+	uint64_t key;
+	void *value;
+} vc4_table_entry;
+
+typedef struct _vc4_table {
+	vc4_table_entry *entries;
+	unsigned int mask;    /* size - 1, the size is a power of 2 */
+	unsigned int count;
+} vc4_table;
+
+#define TABLE_MIN_SIZE	64
+
+static inline unsigned int
+_table_slot(vc4_table *table, uint64_t key)
+{
+	return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & table->mask;
+}
+
+static int
+_table_resize(vc4_table *table, unsigned int size)
+{
+	vc4_table_entry *old = table->entries;
+	unsigned int old_size = old ? table->mask + 1 : 0;
+	unsigned int i;
+
+	table->entries = calloc(size, sizeof(vc4_table_entry));
+	if (!table->entries) {
+		table->entries = old;
+		return 0;
+	}
+	table->mask = size - 1;
+
+	for (i = 0; i < old_size; i++) {
+		unsigned int slot;
+
+		if (!old[i].key)
+			continue;
+
+		slot = _table_slot(table, old[i].key);
+		while (table->entries[slot].key)
+			slot = (slot + 1) & table->mask;
+
+		table->entries[slot] = old[i];
+	}
+
+	free(old);
+
+	return 1;
+}
+
+/* make room for count entries below a load of 3/4 */
+static int
+_table_reserve(vc4_table *table, unsigned int count)
+{
+	unsigned int size = table->entries ? table->mask + 1 : 0;
+	unsigned int new_size = size ? size : TABLE_MIN_SIZE;
+
+	while (count * 4 > new_size * 3)
+		new_size *= 2;
+
+	if (new_size == size)
+		return 1;
+
+	return _table_resize(table, new_size);
+}
+
+static void *
+_table_lookup(vc4_table *table, uint64_t key)
+{
+	unsigned int slot;
+
+	if (!table->entries)
+		return NULL;
+
+	for (slot = _table_slot(table, key); table->entries[slot].key;
+	     slot = (slot + 1) & table->mask) {
+		if (table->entries[slot].key == key)
+			return table->entries[slot].value;
+	}
+
+	return NULL;
+}
+
+/* insert or replace the value of the key */
+static int
+_table_insert(vc4_table *table, uint64_t key, void *value)
+{
+	unsigned int slot;
+
+	if (!_table_reserve(table, table->count + 1))
+		return 0;
+
+	for (slot = _table_slot(table, key); table->entries[slot].key;
+	     slot = (slot + 1) & table->mask) {
+		if (table->entries[slot].key == key) {
+			table->entries[slot].value = value;
+			return 1;
+		}
+	}
+
+	table->entries[slot].key = key;
+	table->entries[slot].value = value;
+	table->count++;
+
+	return 1;
+}
+
+/* delete the key and shift back the entries of its probe sequence */
+static void
+_table_delete(vc4_table *table, uint64_t key)
+{
+	unsigned int slot, next;
+
+	if (!table->entries)
+		return;
+
+	for (slot = _table_slot(table, key); table->entries[slot].key != key;
+	     slot = (slot + 1) & table->mask) {
+		if (!table->entries[slot].key)
+			return;
+	}
+
+	table->entries[slot].key = 0;
+	table->count--;
+
+	for (next = (slot + 1) & table->mask; table->entries[next].key;
+	     next = (next + 1) & table->mask) {
+		unsigned int home = _table_slot(table, table->entries[next].key);
+
+		/* the entry stays if its home is in (slot, next] */
+		if (slot <= next ? (home > slot && home <= next) :
+				   (home > slot || home <= next))
+			continue;
+
+		table->entries[slot] = table->entries[next];
+		table->entries[next].key = 0;
+		slot = next;
+	}
+}
+
+static void
+_table_fini(vc4_table *table)
+{
+	free(table->entries);
+	table->entries = NULL;
+	table->mask = 0;
+	table->count = 0;
+}
+
+#define REGISTRY_SHARDS		16
+
+/* tables split in shards with a lock each, so that the lookups and the
+ * registrations of several threads do not wait for each other.
+ */
+typedef struct _vc4_registry {
+	struct {
+		pthread_rwlock_t lock;
+		vc4_table table;
+	} __attribute__((aligned(TBM_VC4_CACHE_LINE))) shards[REGISTRY_SHARDS];
+} vc4_registry;
+
+static inline unsigned int
+_registry_shard(uint64_t key)
+{
+	/* not the multiplier of _table_slot, the top bits pick the shard */
+	return (unsigned int)((key * 0xc2b2ae3d27d4eb4fULL) >> 60);
+}
+
+static void
+_registry_init(vc4_registry *registry)
+{
+	int i;
+
+	memset(registry, 0, sizeof(vc4_registry));
+	for (i = 0; i < REGISTRY_SHARDS; i++)
+		pthread_rwlock_init(&registry->shards[i].lock, NULL);
+}
+
+static void
+_registry_fini(vc4_registry *registry)
+{
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		_table_fini(&registry->shards[i].table);
+		pthread_rwlock_destroy(&registry->shards[i].lock);
+	}
+}
+
+static void *
+_registry_lookup(vc4_registry *registry, uint64_t key)
+{
+	unsigned int i = _registry_shard(key);
+	void *value;
+
+	pthread_rwlock_rdlock(&registry->shards[i].lock);
+	value = _table_lookup(&registry->shards[i].table, key);
+	pthread_rwlock_unlock(&registry->shards[i].lock);
+
+	return value;
+}
+
+/* look up the key and ref the value under the shard lock, so that it is
+ * not released meanwhile. returns what ref returned if it is above 0, -1
+ * if ref failed and 0 if the key is not there.
+ */
+static int
+_registry_lookup_ref(vc4_registry *registry, uint64_t key,
+		     int (*ref)(void *value), void **value)
+{
+	unsigned int i = _registry_shard(key);
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&registry->shards[i].lock);
+	*value = _table_lookup(&registry->shards[i].table, key);
+	if (*value) {
+		ret = ref(*value);
+		if (ret <= 0)
+			ret = -1;
+	}
+	pthread_rwlock_unlock(&registry->shards[i].lock);
+
+	return ret;
+}
+
+/* insert the value if the key is not there yet. returns the value the key
+ * has after the call, the one of another thread if it came first, NULL on
+ * failure.
+ */
+static void *
+_registry_insert(vc4_registry *registry, uint64_t key, void *value)
+{
+	unsigned int i = _registry_shard(key);
+	void *old;
+
+	pthread_rwlock_wrlock(&registry->shards[i].lock);
+	old = _table_lookup(&registry->shards[i].table, key);
+	if (!old && _table_insert(&registry->shards[i].table, key, value))
+		old = value;
+	pthread_rwlock_unlock(&registry->shards[i].lock);
+
+	return old;
+}
+
+/* delete the key if it still has the value */
+static void
+_registry_delete(vc4_registry *registry, uint64_t key, void *value)
+{
+	unsigned int i = _registry_shard(key);
+
+	pthread_rwlock_wrlock(&registry->shards[i].lock);
+	if (_table_lookup(&registry->shards[i].table, key) == value)
+		_table_delete(&registry->shards[i].table, key);
+	pthread_rwlock_unlock(&registry->shards[i].lock);
+}
+
+/* make room for count more entries spread over the shards */
+static int
+_registry_reserve(vc4_registry *registry, unsigned int count)
+{
+	unsigned int per_shard = count / REGISTRY_SHARDS + 1;
+	int ret = 1;
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS && ret; i++) {
+		vc4_table *table = &registry->shards[i].table;
+
+		pthread_rwlock_wrlock(&registry->shards[i].lock);
+		ret = _table_reserve(table, table->count + per_shard);
+		pthread_rwlock_unlock(&registry->shards[i].lock);
+	}
+
+	return ret;
+}
+
+static unsigned int
+_registry_count(vc4_registry *registry)
+{
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		pthread_rwlock_rdlock(&registry->shards[i].lock);
+		count += registry->shards[i].table.count;
+		pthread_rwlock_unlock(&registry->shards[i].lock);
+	}
+
+	return count;
+}
+
+/* call func on each value until it returns 0. func must not change the
+ * registry.
+ */
+static void
+_registry_foreach(vc4_registry *registry, int (*func)(void *value, void *data),
+		  void *data)
+{
+	int i, ret = 1;
+
+	for (i = 0; i < REGISTRY_SHARDS && ret; i++) {
+		vc4_table *table = &registry->shards[i].table;
+		unsigned int j;
+
+		pthread_rwlock_rdlock(&registry->shards[i].lock);
+		for (j = 0; table->entries && j <= table->mask && ret; j++) {
+			if (table->entries[j].key)
+				ret = func(table->entries[j].value, data);
+		}
+		pthread_rwlock_unlock(&registry->shards[i].lock);
+	}
+}
+
 typedef struct _tbm_bufmgr_vc4 *tbm_bufmgr_vc4;
 typedef struct _tbm_bo_vc4 *tbm_bo_vc4;
 
-typedef struct _vc4_private {
-	int ref_count;
-	struct _tbm_bo_vc4 *bo_priv;
-} PrivGem;
+/* a window of a bo mapped by tbm_vc4_bo_map_range(), in the mapping of
+ * the whole bo.
+ */
+typedef struct _vc4_bo_range {
+	vc4_list link;
+	void *ptr;            /* the address given out */
+} vc4_bo_range;
+
+static unsigned int _bo_get_name(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4);
+static unsigned int _bo_get_dmabuf(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4);
 
-/* tbm buffor object for vc4 */
+/* tbm buffor object for vc4, also the entry of the bo registry.
+ * the fields used by get_handle and map share the first cache line, the
+ * locking and the bookkeeping come after them.
+ */
 struct _tbm_bo_vc4 {
 	int fd;
 
-	unsigned int name;    /* FLINK ID */
-
 	unsigned int gem;     /* GEM Handle */
 
+	unsigned int name;    /* FLINK ID */
+
 	unsigned int dmabuf;  /* fd for dmabuf */
 
 	void *pBase;          /* virtual address */
@@ -222,23 +650,99 @@ struct _tbm_bo_vc4 {
 
 	unsigned int flags_tbm; /*not used now*//*currently no values for the flags,but it may be used in future extension*/
 
-	PrivGem *private;
+	unsigned int map_cnt;
+	int last_map_device;
+
+	struct _vc4_slab *slab; /* slab the bo is carved out of */
+	unsigned int offset;  /* offset of the bo in the slab */
 
-	pthread_mutex_t mutex;
+	int purgeable;        /* marked DONTNEED, the kernel may purge it */
+	int cpu_handle;       /* the cpu address was given out by get_handle */
+	volatile int state;   /* BO_STATE_*, changed with compare and swap */
+
+	pthread_mutex_t mutex __attribute__((aligned(TBM_VC4_CACHE_LINE)));
 	struct dma_buf_fence dma_fence[DMA_FENCE_LIST_MAX];
 	int device;
 	int opt;
 
 	tbm_bo_cache_state cache_state;
-	unsigned int map_cnt;
-	int last_map_device;
+
+	vc4_list dmabuf_link; /* link of the dmabuf lru */
+	int lock_cnt;         /* the dmabuf cannot be closed while locked */
+	int dmabuf_handle;    /* the dmabuf fd was given out by get_handle */
+
+	vc4_list map_link;    /* link of the mapping lru */
+	int map_ref;          /* used since the last pass of the mapping lru */
+	int map_evicted;      /* unmapped to stay in TBM_VC4_MAP_BUDGET */
+	int access;           /* cpu access hint, tbm_vc4_access */
+
+	vc4_list ranges;      /* mappings of tbm_vc4_bo_map_range() */
+	void *win_ptr;        /* window of the only map of the bo, the cache */
+	unsigned int win_size; /* ops are limited to it if win_size is not 0 */
+
+	int is_slab;          /* the bo backs a slab */
+	int imported;         /* accounted as imported, not allocated */
+	int label;            /* usage label, tbm_vc4_label */
+	uint64_t ino;         /* inode of the dmabuf, 0 if unknown */
+	tbm_bo bo;            /* the tbm_bo of the bo, the first one if imported
+			       * several times, NULL while cached.
+			       */
+	volatile int refs;    /* the tbm_bo of the bo and the imports returning it */
+	int has_desc;         /* desc was given by the exporter */
+	tbm_vc4_bo_desc desc; /* layout of the imported bo */
+
+	int reusable;         /* never shared, so it may go to the bo cache */
+	vc4_list cache_link;  /* link of the bo cache bucket */
+	time_t free_time;     /* time the bo was put in the bo cache */
+} __attribute__((aligned(TBM_VC4_CACHE_LINE)));
+
+/* gem object shared by small bos */
+struct _vc4_slab {
+	vc4_list link;
+	struct _tbm_bo_vc4 *bo;
+	uint64_t used;        /* bitmap of the used pages */
+	int count;            /* number of bos in the slab */
+};
+
+/* bo privates allocated together */
+struct _vc4_bo_chunk {
+	struct _vc4_bo_chunk *next;
+	struct _tbm_bo_vc4 bos[];
+};
+
+/* bucket of the bo cache */
+struct _vc4_bo_bucket {
+	vc4_list head;
+	unsigned int size;
 };
 
 /* tbm bufmgr private for vc4 */
 struct _tbm_bufmgr_vc4 {
 	int fd;
 	int isLocal;
-	void *hashBos;
+	int render_node;      /* no flink, the bos are shared by dmabuf only */
+	unsigned int next_name; /* last key made up on a render node */
+	vc4_registry bos;     /* bos keyed by gem handle */
+	vc4_registry names;   /* bos keyed by flink name, filled lazily */
+	vc4_registry inodes;  /* bos keyed by the inode of their dmabuf */
+	int use_inode;        /* > 0 if the dmabufs have an inode each, < 0 if
+			       * not, 0 until known, see _bufmgr_learn_inode */
+	dev_t dmabuf_dev;     /* device of the dmabuf inodes */
+	pthread_mutex_t probe_lock; /* guards the first dmabuf seen */
+	unsigned int probe_gem; /* gem of the first dmabuf seen */
+	ino_t probe_ino;      /* inode of the first dmabuf seen */
+
+	/* the lookups of the imports hold it for reading, the gem handles are
+	 * closed with it held for writing. so a bo found by an import is not
+	 * destroyed under it, and a handle given by the kernel to an import is
+	 * not the one of a bo being destroyed.
+	 */
+	pthread_rwlock_t handle_lock;
+
+	/* recursive, guards the bo cache, the slabs, the bo privates, the
+	 * dmabuf lru and the label statistics. taken before handle_lock.
+	 */
+	pthread_mutex_t lock;
 
 	int use_dma_fence;
 
@@ -246,8 +750,62 @@ struct _tbm_bufmgr_vc4 {
 
 	char *device_name;
 	void *bind_display;
+
+	int use_bo_cache;
+	int use_madvise;
+	int use_label;
+	struct _vc4_bo_bucket cache_bucket[BO_CACHE_BUCKET_MAX];
+	int num_buckets;
+	time_t cache_time;    /* last time the bo cache was aged */
+
+	vc4_list priv_free;   /* free bo privates */
+	struct _vc4_bo_chunk *priv_chunks;
+
+	vc4_list slabs;
+	unsigned int slab_threshold; /* bos smaller than this go to a slab */
+
+	vc4_list dmabuf_lru;  /* bos holding a dmabuf, least recently used first */
+	int dmabuf_max;       /* max number of dmabuf fds to keep, 0 is no limit */
+
+	vc4_list map_lru;     /* bos mapped to the cpu, least recently used first */
+	unsigned long map_budget; /* max bytes mapped, 0 is no limit */
+
+	/* copy kernels to and from the write-combined mappings */
+	void (*copy_to)(void *dst, const void *src, size_t size);
+	void (*copy_from)(void *dst, const void *src, size_t size);
+
+	unsigned long budget_soft; /* the bo cache is dropped above this */
+	unsigned long budget_hard; /* allocations fail above this */
+
+	int pressure_fd;      /* psi trigger of the memory pressure */
+	int pressure_pipe[2]; /* wakes up the monitor at deinit */
+	pthread_t pressure_thread;
+	volatile int pressure; /* set by the monitor, trim on next alloc/free */
+
+	char *broker_path;    /* socket of the bo broker, TBM_VC4_BROKER */
+	int broker_fd;        /* listening socket in the display server */
+	int broker_pipe[2];   /* wakes up the broker at deinit */
+	pthread_t broker_thread;
+	uid_t broker_uid;     /* the only user and group the broker serves */
+	gid_t broker_gid;
+
+	tbm_bo_vc4 *prewarm_bos; /* bos created by the prewarm thread */
+	int prewarm_count;
+	volatile int prewarm_ready; /* bos the prewarm thread is done with */
+	int prewarm_taken;    /* bos moved to the bo cache */
+	volatile int prewarm_stop;
+	pthread_t prewarm_thread;
+
+	tbm_vc4_stats stats;
+	tbm_vc4_label_stats label_stats[TBM_VC4_LABEL_MAX];
 };
 
+/* the statistics are updated by several threads */
+#define VC4_STAT_ADD(bufmgr, field, val) \
+	__sync_fetch_and_add(&(bufmgr)->stats.field, (val))
+#define VC4_STAT_SUB(bufmgr, field, val) \
+	__sync_fetch_and_sub(&(bufmgr)->stats.field, (val))
+
 char *STR_DEVICE[] = {
 	"DEF",
 	"CPU",
@@ -263,6 +821,14 @@ char *STR_OPT[] = {
 	"RDWR"
 };
 
+char *STR_LABEL[] = {
+	"none",
+	"scanout",
+	"video",
+	"texture",
+	"cursor"
+};
+
 
 uint32_t tbm_vc4_color_format_list[TBM_COLOR_FORMAT_COUNT] = {
 										TBM_FORMAT_ARGB8888,
@@ -426,7 +992,11 @@ _vc4_cache_flush(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int flags)
 	int ret;
 
 	/* if bo_vc4 is null, do cache_flush_all */
-	if (bo_vc4) {
+	if (bo_vc4 && bo_vc4->win_size) {
+		cache_op.flags = 0;
+		cache_op.usr_addr = (uint64_t)((uint32_t)bo_vc4->win_ptr);
+		cache_op.size = bo_vc4->win_size;
+	} else if (bo_vc4) {
 		cache_op.flags = 0;
 		cache_op.usr_addr = (uint64_t)((uint32_t)bo_vc4->pBase);
 		cache_op.size = bo_vc4->size;
@@ -475,6 +1045,10 @@ _bo_init_cache_state(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int import)
 	if (bufmgr_vc4->use_dma_fence)
 		return 1;
 
+	/* the tgl key is the flink name */
+	if (!_bo_get_name(bufmgr_vc4, bo_vc4))
+		return 0;
+
 	_tgl_init(bufmgr_vc4->tgl_fd, bo_vc4->name);
 
 	tbm_bo_cache_state cache_state;
@@ -732,8 +1306,11 @@ _tbm_vc4_open_drm()
 	return fd;
 }
 
+/* the render node is used if the backend is built with --enable-render-node
+ * or if TBM_VC4_RENDER_NODE=1.
+ */
 static int
-_check_render_node(void)  //TODO
+_check_render_node(void)
 {
 	struct udev *udev = NULL;
 	struct udev_enumerate *e = NULL;
@@ -741,7 +1318,13 @@ _check_render_node(void)  //TODO
 	struct udev_device *device = NULL, *drm_device = NULL, *device_parent = NULL;
 
 #ifndef USE_RENDER_NODE
-	return 0;
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_RENDER_NODE");
+		if (!env || !atoi(env))
+			return 0;
+	}
 #endif
 
 	udev = udev_new();
@@ -785,7 +1368,7 @@ _check_render_node(void)  //TODO
 }
 
 static int
-_get_render_node(void)//TODO
+_get_render_node(void)
 {
 	struct udev *udev = NULL;
 	struct udev_enumerate *e = NULL;
@@ -873,1195 +1456,4977 @@ _get_name(int fd, unsigned int gem)
 	return (unsigned int)arg.name;
 }
 
-static tbm_bo_handle
-_vc4_bo_handle(tbm_bo_vc4 bo_vc4, int device)
+static void _bo_unregister(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4);
+static int _bo_madvise(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int willneed);
+static void _bo_label_add(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int label);
+static void _bo_label_del(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4);
+
+/* register the bo by its handle, and by its name and inode unless another
+ * bo of the object has them. returns the bo registered for the handle,
+ * which is another one if a concurrent import of the handle came first,
+ * NULL on failure.
+ */
+static tbm_bo_vc4
+_bo_register(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	tbm_bo_handle bo_handle;
+	tbm_bo_vc4 found;
 
-	memset(&bo_handle, 0x0, sizeof(uint64_t));
+	found = _registry_insert(&bufmgr_vc4->bos, bo_vc4->gem, bo_vc4);
+	if (!found) {
+		TBM_VC4_ERROR("Cannot insert bo to Hash(%d)\n", bo_vc4->gem);
+		return NULL;
+	}
 
-	switch (device) {
-	case TBM_DEVICE_DEFAULT:
-	case TBM_DEVICE_2D:
-		bo_handle.u32 = (uint32_t)bo_vc4->gem;
-		break;
-	case TBM_DEVICE_CPU:
-		if (!bo_vc4->pBase) {
-			void *map = NULL;
-			struct drm_vc4_mmap_bo arg = {0, };
-			arg.handle = bo_vc4->gem;
-			if (drmIoctl(bo_vc4->fd, DRM_IOCTL_VC4_MMAP_BO, &arg)){
-				TBM_VC4_ERROR("Cannot map_dumb gem=%d\n", bo_vc4->gem);
-				return (tbm_bo_handle) NULL;
-			}
+	if (found != bo_vc4)
+		return found;
 
-			map = mmap(NULL, bo_vc4->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-				   bo_vc4->fd, arg.offset);
-			if (map == MAP_FAILED) {
-				TBM_VC4_ERROR("Cannot usrptr gem=%d\n", bo_vc4->gem);
-				return (tbm_bo_handle) NULL;
-			}
-			bo_vc4->pBase = map;
-		}
-		bo_handle.ptr = (void *)bo_vc4->pBase;
-		break;
-	case TBM_DEVICE_3D:
-#ifdef USE_DMAIMPORT
-		if (bo_vc4->dmabuf) {
-			bo_handle.u32 = (uint32_t)bo_vc4->dmabuf;
-			break;
-		}
+	if (bo_vc4->name &&
+	    !_registry_insert(&bufmgr_vc4->names, bo_vc4->name, bo_vc4)) {
+		TBM_VC4_ERROR("Cannot insert bo to name Hash(%d)\n", bo_vc4->name);
+		_bo_unregister(bufmgr_vc4, bo_vc4);
+		return NULL;
+	}
 
-		if (!bo_vc4->dmabuf) {
-			struct drm_prime_handle arg = {0, };
+	if (bo_vc4->ino &&
+	    !_registry_insert(&bufmgr_vc4->inodes, bo_vc4->ino, bo_vc4)) {
+		TBM_VC4_ERROR("Cannot insert bo to inode Hash(%llu)\n",
+			       (unsigned long long)bo_vc4->ino);
+		_bo_unregister(bufmgr_vc4, bo_vc4);
+		return NULL;
+	}
 
-			arg.handle = bo_vc4->gem;
-			if (drmIoctl(bo_vc4->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &arg)) {
-				TBM_VC4_ERROR("Cannot dmabuf=%d\n", bo_vc4->gem);
-				return (tbm_bo_handle) NULL;
-			}
-			bo_vc4->dmabuf = arg.fd;
-		}
+	return bo_vc4;
+}
 
-		bo_handle.u32 = (uint32_t)bo_vc4->dmabuf;
-#endif
-		break;
-	case TBM_DEVICE_MM:
-		if (!bo_vc4->dmabuf) {
-			struct drm_prime_handle arg = {0, };
+static void
+_bo_unregister(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	if (_registry_lookup(&bufmgr_vc4->bos, bo_vc4->gem) != bo_vc4) {
+		TBM_VC4_ERROR("Cannot find bo to Hash(%d)\n", bo_vc4->gem);
+		return;
+	}
 
-			arg.handle = bo_vc4->gem;
-			if (drmIoctl(bo_vc4->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &arg)) {
-				TBM_VC4_ERROR("Cannot dmabuf=%d\n", bo_vc4->gem);
-				return (tbm_bo_handle) NULL;
-			}
-			bo_vc4->dmabuf = arg.fd;
-		}
+	_registry_delete(&bufmgr_vc4->bos, bo_vc4->gem, bo_vc4);
 
-		bo_handle.u32 = (uint32_t)bo_vc4->dmabuf;
-		break;
-	default:
-		TBM_VC4_ERROR("Not supported device:%d\n", device);
-		bo_handle.ptr = (void *) NULL;
-		break;
-	}
+	/* the name may have been registered by another bo of the same object */
+	if (bo_vc4->name)
+		_registry_delete(&bufmgr_vc4->names, bo_vc4->name, bo_vc4);
 
-	return bo_handle;
+	if (bo_vc4->ino)
+		_registry_delete(&bufmgr_vc4->inodes, bo_vc4->ino, bo_vc4);
 }
 
+/* ref a live bo. returns 0 if its last ref is gone and it is being cached
+ * or destroyed, or if it is not owned by a tbm_bo.
+ */
 static int
-tbm_vc4_bo_size(tbm_bo bo)
+_bo_ref_live(void *value)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	tbm_bo_vc4 bo_vc4 = (tbm_bo_vc4)value;
+	int refs;
 
-	tbm_bo_vc4 bo_vc4;
-
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+	do {
+		refs = bo_vc4->refs;
+		if (refs <= 0 || bo_vc4->state != BO_STATE_LIVE)
+			return 0;
+	} while (!__sync_bool_compare_and_swap(&bo_vc4->refs, refs, refs + 1));
 
-	return bo_vc4->size;
+	return 1;
 }
 
-static void *
-tbm_vc4_bo_alloc(tbm_bo bo, int size, int flags)
+/* ref a bo found by an import. returns 2 if it is taken back from the bo
+ * cache, 1 if it is live, 0 if its last ref is gone and it is being cached
+ * or destroyed.
+ */
+static int
+_bo_ref_found(void *value)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	tbm_bo_vc4 bo_vc4 = (tbm_bo_vc4)value;
 
-	tbm_bo_vc4 bo_vc4;
-	tbm_bufmgr_vc4 bufmgr_vc4;
+	/* a cached bo has no tbm_bo, the import gets it alone */
+	if (__sync_bool_compare_and_swap(&bo_vc4->state, BO_STATE_CACHED,
+					 BO_STATE_LIVE)) {
+		__sync_lock_test_and_set(&bo_vc4->refs, 1);
+		return 2;
+	}
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+	return _bo_ref_live(value);
+}
 
-	bo_vc4 = calloc(1, sizeof(struct _tbm_bo_vc4));
-	if (!bo_vc4) {
-		TBM_VC4_ERROR("fail to allocate the bo private\n");
-		return 0;
-	}
+/* find the bo of the key for an import and ref it, _bo_lookup_done drops
+ * the ref. a cached bo is taken back from the bo cache for the tbm_bo of
+ * the import. returns 1 if found, 0 if not, -1 if the bo is being cached or
+ * destroyed and the caller has to look again once it is.
+ */
+static int
+_bo_lookup_import(tbm_bufmgr_vc4 bufmgr_vc4, vc4_registry *registry,
+		  uint64_t key, tbm_bo bo, tbm_bo_vc4 *found)
+{
+	tbm_bo_vc4 bo_vc4;
+	int ret;
 
-	struct drm_vc4_create_bo arg = {0, };
-	arg.flags = flags;/*currently no values for the flags,but it may be used in future extension*/
-	arg.size = (__u32)size;
-	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_VC4_CREATE_BO, &arg)){
-		TBM_VC4_ERROR("Cannot create bo(flag:%x, size:%d)\n", arg.flags,
-			       (unsigned int)arg.size);
-		free(bo_vc4);
-		return 0;
-	}
+	*found = NULL;
 
-	bo_vc4->fd = bufmgr_vc4->fd;
-	bo_vc4->gem = (unsigned int)arg.handle;
-	bo_vc4->size = size;
-	bo_vc4->flags_tbm = flags;
-	bo_vc4->name = _get_name(bo_vc4->fd, bo_vc4->gem);
+	ret = _registry_lookup_ref(registry, key, _bo_ref_found, (void **)&bo_vc4);
+	if (ret <= 0)
+		return ret;
 
-	if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 0)) {
-		TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
-		free(bo_vc4);
-		return 0;
+	if (ret == 2) {
+		/* it stays in its bucket until the bo cache sees it is live */
+		bo_vc4->reusable = 0;
+		bo_vc4->bo = bo;
+		if (bo_vc4->purgeable)
+			_bo_madvise(bufmgr_vc4, bo_vc4, 1);
+
+		/* counted again under its label, its free takes it off */
+		_bo_label_add(bufmgr_vc4, bo_vc4, bo_vc4->label);
 	}
 
-	pthread_mutex_init(&bo_vc4->mutex, NULL);
+	*found = bo_vc4;
 
-	if (bufmgr_vc4->use_dma_fence
-	    && !bo_vc4->dmabuf) {
-		struct drm_prime_handle arg = {0, };
+	return 1;
+}
 
-		arg.handle = bo_vc4->gem;
-		if (drmIoctl(bo_vc4->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &arg)) {
-			TBM_VC4_ERROR("Cannot dmabuf=%d\n", bo_vc4->gem);
-			free(bo_vc4);
-			return 0;
-		}
-		bo_vc4->dmabuf = arg.fd;
-	}
+/* drop the ref of _bo_lookup_import once the import is done with the bo.
+ * libtbm gives the bo to the tbm_bo it has for it, or to the tbm_bo of the
+ * import if the former was freed meanwhile, which then takes the bo over.
+ */
+static void
+_bo_lookup_done(tbm_bo_vc4 bo_vc4, tbm_bo bo)
+{
+	if (__sync_sub_and_fetch(&bo_vc4->refs, 1) > 0)
+		return;
 
-	/* add bo to hash */
-	PrivGem *privGem = calloc(1, sizeof(PrivGem));
+	bo_vc4->bo = bo;
+	__sync_lock_test_and_set(&bo_vc4->refs, 1);
+}
 
-	if (!privGem) {
-		TBM_VC4_ERROR("fail to calloc privGem\n");
-		free(bo_vc4);
-		return 0;
+/* the dmabufs of the kernels before 5.3 share the inode of the anon inode
+ * fs, the inode index is only used once the dmabufs of two objects made or
+ * imported here turned out to differ.
+ */
+static void
+_bufmgr_learn_inode(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, struct stat *st)
+{
+	pthread_mutex_lock(&bufmgr_vc4->probe_lock);
+
+	if (bufmgr_vc4->use_inode) {
+		pthread_mutex_unlock(&bufmgr_vc4->probe_lock);
+		return;
 	}
 
-	privGem->ref_count = 1;
-	privGem->bo_priv = bo_vc4;
+	if (!bufmgr_vc4->probe_gem) {
+		bufmgr_vc4->probe_gem = bo_vc4->gem;
+		bufmgr_vc4->probe_ino = st->st_ino;
+		bufmgr_vc4->dmabuf_dev = st->st_dev;
+	} else if (bufmgr_vc4->probe_gem != bo_vc4->gem) {
+		if (st->st_dev == bufmgr_vc4->dmabuf_dev &&
+		    st->st_ino != bufmgr_vc4->probe_ino)
+			__sync_bool_compare_and_swap(&bufmgr_vc4->use_inode, 0, 1);
+		else
+			__sync_bool_compare_and_swap(&bufmgr_vc4->use_inode, 0, -1);
 
-	if (drmHashInsert(bufmgr_vc4->hashBos, bo_vc4->name,
-			  (void *)privGem) < 0) {
-		TBM_VC4_ERROR("Cannot insert bo to Hash(%d)\n", bo_vc4->name);
+		TBM_VC4_DEBUG("inode index %s\n",
+		    bufmgr_vc4->use_inode > 0 ? "on" : "off");
 	}
 
-	TBM_VC4_DEBUG("     bo:%p, gem:%d(%d), flags:%d, size:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    flags,
-	    bo_vc4->size);
-
-	return (void *)bo_vc4;
+	pthread_mutex_unlock(&bufmgr_vc4->probe_lock);
 }
 
+/* index the bo by the inode of its dmabuf, so that the imports of the
+ * dmabuf find it without the kernel.
+ */
 static void
-tbm_vc4_bo_free(tbm_bo bo)
+_bo_set_inode(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, struct stat *st)
 {
-	tbm_bo_vc4 bo_vc4;
-	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 found;
 
-	if (!bo)
+	if (bo_vc4->ino || bo_vc4->slab)
 		return;
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_IF_FAIL(bufmgr_vc4 != NULL);
+	if (!bufmgr_vc4->use_inode)
+		_bufmgr_learn_inode(bufmgr_vc4, bo_vc4, st);
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_IF_FAIL(bo_vc4 != NULL);
+	if (bufmgr_vc4->use_inode <= 0 || st->st_dev != bufmgr_vc4->dmabuf_dev)
+		return;
 
-	TBM_VC4_DEBUG("      bo:%p, gem:%d(%d), fd:%d, size:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    bo_vc4->size);
+	if (_registry_lookup(&bufmgr_vc4->bos, bo_vc4->gem) != bo_vc4)
+		return;
 
-	if (bo_vc4->pBase) {
-		if (munmap(bo_vc4->pBase, bo_vc4->size) == -1) {
-			TBM_VC4_ERROR("bo:%p fail to munmap(%s)\n",
-				       bo, strerror(errno));
-		}
+	found = _registry_insert(&bufmgr_vc4->inodes, st->st_ino, bo_vc4);
+	if (!found) {
+		TBM_VC4_ERROR("Cannot insert bo to inode Hash(%llu)\n",
+			       (unsigned long long)st->st_ino);
+		return;
 	}
 
-	/* close dmabuf */
-	if (bo_vc4->dmabuf) {
-		close(bo_vc4->dmabuf);
-		bo_vc4->dmabuf = 0;
-	}
+	/* another bo of the same object has the inode */
+	if (found != bo_vc4)
+		return;
 
-	/* delete bo from hash */
-	PrivGem *privGem = NULL;
-	int ret;
+	bo_vc4->ino = st->st_ino;
+}
 
-	ret = drmHashLookup(bufmgr_vc4->hashBos, bo_vc4->name,
-			     (void **)&privGem);
-	if (ret == 0) {
-		privGem->ref_count--;
-		if (privGem->ref_count == 0) {
-			drmHashDelete(bufmgr_vc4->hashBos, bo_vc4->name);
-			free(privGem);
-			privGem = NULL;
-		}
+/* take the bo off the inode index when its dmabuf is closed here, the
+ * inode may belong to another file once the last fd of the dmabuf is gone.
+ * an import of a dmabuf still open elsewhere indexes it again.
+ */
+static void
+_bo_drop_inode(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	uint64_t ino = __sync_lock_test_and_set(&bo_vc4->ino, 0);
+
+	if (ino)
+		_registry_delete(&bufmgr_vc4->inodes, ino, bo_vc4);
+}
+
+/* flink the bo on first use and fill the name index */
+static unsigned int
+_bo_get_name(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	if (bo_vc4->name)
+		return bo_vc4->name;
+
+	if (bufmgr_vc4->render_node) {
+		/* GEM_FLINK is not allowed on a render node, the key is made up
+		 * here and only means something in this process.
+		 */
+		do {
+			bo_vc4->name = __sync_add_and_fetch(&bufmgr_vc4->next_name, 1);
+		} while (!bo_vc4->name);
 	} else {
-		TBM_VC4_ERROR("Cannot find bo to Hash(%d), ret=%d\n",
-			bo_vc4->name, ret);
+		bo_vc4->name = _get_name(bo_vc4->fd, bo_vc4->gem);
 	}
 
-	_bo_destroy_cache_state(bufmgr_vc4, bo_vc4);
-
-	/* Free gem handle */
-	struct drm_gem_close arg = {0, };
+	if (!bo_vc4->name)
+		return 0;
 
-	memset(&arg, 0, sizeof(arg));
-	arg.handle = bo_vc4->gem;
-	if (drmIoctl(bo_vc4->fd, DRM_IOCTL_GEM_CLOSE, &arg)) {
-		TBM_VC4_ERROR("bo:%p fail to gem close.(%s)\n",
-			       bo, strerror(errno));
+	if (_registry_lookup(&bufmgr_vc4->bos, bo_vc4->gem) == bo_vc4) {
+		if (!_registry_insert(&bufmgr_vc4->names, bo_vc4->name, bo_vc4)) {
+			TBM_VC4_ERROR("Cannot insert bo to name Hash(%d)\n", bo_vc4->name);
+		}
 	}
 
-	free(bo_vc4);
+	return bo_vc4->name;
 }
 
-
-static void *
-tbm_vc4_bo_import(tbm_bo bo, unsigned int key)
+static void
+_bo_close_dmabuf(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	if (!bo_vc4->dmabuf)
+		return;
 
-	tbm_bufmgr_vc4 bufmgr_vc4;
-	tbm_bo_vc4 bo_vc4;
-	PrivGem *privGem = NULL;
-	int ret;
+	_list_del(&bo_vc4->dmabuf_link);
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+	_bo_drop_inode(bufmgr_vc4, bo_vc4);
 
-	ret = drmHashLookup(bufmgr_vc4->hashBos, key, (void **)&privGem);
-	if (ret == 0)
-		return privGem->bo_priv;
+	close(bo_vc4->dmabuf);
+	bo_vc4->dmabuf = 0;
 
-	struct drm_gem_open arg = {0, };
+	VC4_STAT_SUB(bufmgr_vc4, dmabuf_count, 1);
+}
 
-	arg.name = key;
-	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_OPEN, &arg)) {
-		TBM_VC4_ERROR("Cannot open gem name=%d\n", key);
-		return 0;
-	}
+/* close the least recently used dmabuf fds until there is a free slot.
+ * the fds of the locked or mapped bos and the ones given out by get_handle
+ * are kept.
+ */
+static void
+_bo_trim_dmabuf(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	vc4_list *item, *next;
 
-	bo_vc4 = calloc(1, sizeof(struct _tbm_bo_vc4));
-	if (!bo_vc4) {
-		TBM_VC4_ERROR("fail to allocate the bo private\n");
-		return 0;
-	}
+	for (item = bufmgr_vc4->dmabuf_lru.next;
+	     item != &bufmgr_vc4->dmabuf_lru &&
+	     bufmgr_vc4->stats.dmabuf_count >= bufmgr_vc4->dmabuf_max;
+	     item = next) {
+		tbm_bo_vc4 bo_vc4 = vc4_container_of(item, struct _tbm_bo_vc4, dmabuf_link);
 
-	bo_vc4->fd = bufmgr_vc4->fd;
-	bo_vc4->gem = arg.handle;
-	bo_vc4->size = arg.size;
-	bo_vc4->name = key;
-	bo_vc4->flags_tbm = 0;
+		next = item->next;
 
-	if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 1)) {
-		TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
-		free(bo_vc4);
-		return 0;
+		if (bo_vc4->lock_cnt || bo_vc4->map_cnt || bo_vc4->is_slab ||
+		    bo_vc4->dmabuf_handle)
+			continue;
+
+		_bo_close_dmabuf(bufmgr_vc4, bo_vc4);
+		VC4_STAT_ADD(bufmgr_vc4, dmabuf_evictions, 1);
 	}
+}
 
-	if (!bo_vc4->dmabuf) {
-		struct drm_prime_handle arg = {0, };
+/* called with the bufmgr lock held */
+static unsigned int
+_bo_open_dmabuf(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	struct drm_prime_handle arg = {0, };
 
-		arg.handle = bo_vc4->gem;
-		if (drmIoctl(bo_vc4->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &arg)) {
-			TBM_VC4_ERROR("fail to DRM_IOCTL_PRIME_HANDLE_TO_FD gem=%d\n", bo_vc4->gem);
-			free(bo_vc4);
-			return 0;
-		}
-		bo_vc4->dmabuf = arg.fd;
+	/* a bo of a slab shares the dmabuf of the slab */
+	if (bo_vc4->slab) {
+		bo_vc4->dmabuf = _bo_open_dmabuf(bufmgr_vc4, bo_vc4->slab->bo);
+		return bo_vc4->dmabuf;
 	}
 
-	/* add bo to hash */
-	privGem = NULL;
+	if (bo_vc4->dmabuf) {
+		_list_del(&bo_vc4->dmabuf_link);
+		_list_add_tail(&bo_vc4->dmabuf_link, &bufmgr_vc4->dmabuf_lru);
+		return bo_vc4->dmabuf;
+	}
+
+	if (bufmgr_vc4->dmabuf_max > 0 &&
+	    bufmgr_vc4->stats.dmabuf_count >= bufmgr_vc4->dmabuf_max)
+		_bo_trim_dmabuf(bufmgr_vc4);
 
-	privGem = calloc(1, sizeof(PrivGem));
-	if (!privGem) {
-		TBM_VC4_ERROR("fail to calloc privGem\n");
-		free(bo_vc4);
+	arg.handle = bo_vc4->gem;
+	arg.flags = DRM_CLOEXEC;
+	if (drmIoctl(bo_vc4->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &arg)) {
+		TBM_VC4_ERROR("Cannot dmabuf=%d\n", bo_vc4->gem);
 		return 0;
 	}
+	bo_vc4->dmabuf = arg.fd;
 
-	privGem->ref_count = 1;
-	privGem->bo_priv = bo_vc4;
+	_list_add_tail(&bo_vc4->dmabuf_link, &bufmgr_vc4->dmabuf_lru);
+	VC4_STAT_ADD(bufmgr_vc4, dmabuf_count, 1);
 
-	if (drmHashInsert(bufmgr_vc4->hashBos, bo_vc4->name,
-			   (void *)privGem) < 0) {
-		TBM_VC4_ERROR("Cannot insert bo to Hash(%d)\n", bo_vc4->name);
-	}
+	if (!bo_vc4->ino && bufmgr_vc4->use_inode >= 0) {
+		struct stat st;
 
-	TBM_VC4_DEBUG("    bo:%p, gem:%d(%d), fd:%d, flags:%d, size:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    bo_vc4->flags_tbm,
-	    bo_vc4->size);
+		if (fstat(bo_vc4->dmabuf, &st) == 0)
+			_bo_set_inode(bufmgr_vc4, bo_vc4, &st);
+	}
 
-	return (void *)bo_vc4;
+	return bo_vc4->dmabuf;
 }
 
-static void *
-tbm_vc4_bo_import_fd(tbm_bo bo, tbm_fd key)
+/* export the dmabuf of the bo on first use */
+static unsigned int
+_bo_get_dmabuf(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	unsigned int dmabuf;
 
-	tbm_bufmgr_vc4 bufmgr_vc4;
-	tbm_bo_vc4 bo_vc4;
-	PrivGem *privGem = NULL;
-	unsigned int name;
-	int ret;
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	dmabuf = _bo_open_dmabuf(bufmgr_vc4, bo_vc4);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+	return dmabuf;
+}
 
-	/*getting handle from fd*/
-	unsigned int gem = 0;
-	struct drm_prime_handle arg = {0, };
+/* the cpu mappings of the bos are write-combined: the writes are fast in
+ * full aligned bursts and the reads are not cached. the kernels below
+ * write in aligned 64 bytes bursts and read in large vector loads into a
+ * cached bounce buffer.
+ */
+#define VC4_COPY_BURST	64
+#define VC4_COPY_BOUNCE	4096
 
-	arg.fd = key;
-	arg.flags = 0;
-	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &arg)) {
-		TBM_VC4_ERROR("bo:%p Cannot get gem handle from fd:%d (%s)\n",
-			       bo, arg.fd, strerror(errno));
-		return NULL;
+static void
+_copy_to_wc_scalar(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)d & (sizeof(uint64_t) - 1);
+
+	if (head > size)
+		head = size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= VC4_COPY_BURST; size -= VC4_COPY_BURST) {
+		uint64_t v[8];
+
+		memcpy(v, s, sizeof(v));
+		((uint64_t *)d)[0] = v[0];
+		((uint64_t *)d)[1] = v[1];
+		((uint64_t *)d)[2] = v[2];
+		((uint64_t *)d)[3] = v[3];
+		((uint64_t *)d)[4] = v[4];
+		((uint64_t *)d)[5] = v[5];
+		((uint64_t *)d)[6] = v[6];
+		((uint64_t *)d)[7] = v[7];
+		d += VC4_COPY_BURST;
+		s += VC4_COPY_BURST;
 	}
-	gem = arg.handle;
 
-	name = _get_name(bufmgr_vc4->fd, gem);
-	if (!name) {
-		TBM_VC4_ERROR("bo:%p Cannot get name from gem:%d, fd:%d (%s)\n",
-			       bo, gem, key, strerror(errno));
-		return 0;
-	}
+	memcpy(d, s, size);
+}
 
-	ret = drmHashLookup(bufmgr_vc4->hashBos, name, (void **)&privGem);
-	if (ret == 0) {
-		if (gem == privGem->bo_priv->gem)
-			return privGem->bo_priv;
+static void
+_copy_from_wc_scalar(void *dst, const void *src, size_t size)
+{
+	uint64_t bounce[VC4_COPY_BOUNCE / sizeof(uint64_t)];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)s & (sizeof(uint64_t) - 1);
+
+	if (head > size)
+		head = size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	while (size >= sizeof(uint64_t)) {
+		size_t n = size < VC4_COPY_BOUNCE ? size & ~(sizeof(uint64_t) - 1) : VC4_COPY_BOUNCE;
+		size_t i;
+
+		for (i = 0; i < n / sizeof(uint64_t); i++)
+			bounce[i] = ((const uint64_t *)s)[i];
+		memcpy(d, bounce, n);
+		d += n;
+		s += n;
+		size -= n;
 	}
 
-	unsigned int real_size = -1;
-	//struct drm_vc4_gem_info info = {0, };
-
-	/* Determine size of bo.  The fd-to-handle ioctl really should
-	 * return the size, but it doesn't.  If we have kernel 3.12 or
-	 * later, we can lseek on the prime fd to get the size.  Older
-	 * kernels will just fail, in which case we fall back to the
-	 * provided (estimated or guess size).
-	 */
-	real_size = lseek(key, 0, SEEK_END);
+	memcpy(d, s, size);
+}
 
-	/*info.handle = gem;
-	if (drmCommandWriteRead(bufmgr_vc4->fd,
-				DRM_VC4_GEM_GET,
-				&info,
-				sizeof(struct drm_vc4_gem_info))) {
-		TBM_VC4_ERROR("bo:%p Cannot get gem info from gem:%d, fd:%d (%s)\n",
-			       bo, gem, key, strerror(errno));
-		return 0;
-	}*/
+#ifdef VC4_COPY_NEON
+VC4_NEON_TARGET
+static void
+_copy_to_wc_neon(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)d & (VC4_COPY_BURST - 1);
+
+	if (head > size)
+		head = size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= VC4_COPY_BURST; size -= VC4_COPY_BURST) {
+		uint8x16_t v0 = vld1q_u8(s);
+		uint8x16_t v1 = vld1q_u8(s + 16);
+		uint8x16_t v2 = vld1q_u8(s + 32);
+		uint8x16_t v3 = vld1q_u8(s + 48);
+
+#if defined(__aarch64__)
+		/* the non-temporal pair stores do not allocate in the caches */
+		__asm__ volatile("stnp %q1, %q2, [%0]\n\t"
+				 "stnp %q3, %q4, [%0, #32]"
+				 : : "r"(d), "w"(v0), "w"(v1), "w"(v2), "w"(v3)
+				 : "memory");
+#else
+		vst1q_u8(d, v0);
+		vst1q_u8(d + 16, v1);
+		vst1q_u8(d + 32, v2);
+		vst1q_u8(d + 48, v3);
+#endif
+		d += VC4_COPY_BURST;
+		s += VC4_COPY_BURST;
+	}
 
-	struct drm_gem_open open_arg = {0, };
+	memcpy(d, s, size);
+}
 
-	open_arg.name = name;
-	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_OPEN, &open_arg)) {
-		TBM_VC4_ERROR("Cannot open gem name=%d\n", name);
-		return 0;
+VC4_NEON_TARGET
+static void
+_copy_from_wc_neon(void *dst, const void *src, size_t size)
+{
+	uint8_t bounce[VC4_COPY_BOUNCE] __attribute__((aligned(VC4_COPY_BURST)));
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)s & (VC4_COPY_BURST - 1);
+
+	if (head > size)
+		head = size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	while (size >= VC4_COPY_BURST) {
+		size_t n = size < VC4_COPY_BOUNCE ? size & ~(VC4_COPY_BURST - 1) : VC4_COPY_BOUNCE;
+		size_t i;
+
+		for (i = 0; i < n; i += VC4_COPY_BURST) {
+			uint8x16_t v0 = vld1q_u8(s + i);
+			uint8x16_t v1 = vld1q_u8(s + i + 16);
+			uint8x16_t v2 = vld1q_u8(s + i + 32);
+			uint8x16_t v3 = vld1q_u8(s + i + 48);
+
+			vst1q_u8(bounce + i, v0);
+			vst1q_u8(bounce + i + 16, v1);
+			vst1q_u8(bounce + i + 32, v2);
+			vst1q_u8(bounce + i + 48, v3);
+		}
+		memcpy(d, bounce, n);
+		d += n;
+		s += n;
+		size -= n;
 	}
 
-	if (real_size == -1)
-		real_size = open_arg.size;
+	memcpy(d, s, size);
+}
+#endif
 
-	bo_vc4 = calloc(1, sizeof(struct _tbm_bo_vc4));
-	if (!bo_vc4) {
-		TBM_VC4_ERROR("bo:%p fail to allocate the bo private\n", bo);
-		return 0;
+#ifdef VC4_COPY_SSE2
+static void
+_copy_to_wc_sse2(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)d & 15;
+
+	if (head > size)
+		head = size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	/* the streaming stores fill the write-combining buffers directly */
+	for (; size >= VC4_COPY_BURST; size -= VC4_COPY_BURST) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, v0);
+		_mm_stream_si128((__m128i *)(d + 16), v1);
+		_mm_stream_si128((__m128i *)(d + 32), v2);
+		_mm_stream_si128((__m128i *)(d + 48), v3);
+		d += VC4_COPY_BURST;
+		s += VC4_COPY_BURST;
 	}
+	_mm_sfence();
 
-	bo_vc4->fd = bufmgr_vc4->fd;
-	bo_vc4->gem = gem;
-	bo_vc4->size = real_size;
-	bo_vc4->flags_tbm = 0;
-	bo_vc4->name = name;
+	memcpy(d, s, size);
+}
 
-	if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 1)) {
-		TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
-		free(bo_vc4);
-		return 0;
+/* MOVNTDQA reads the write-combined memory a line at a time through the
+ * streaming load buffers, where a plain load reads it 16 bytes at a time.
+ * it is SSE4.1, the kernel is picked at init if the cpu has it.
+ */
+__attribute__((target("sse4.1")))
+static void
+_copy_from_wc_sse41(void *dst, const void *src, size_t size)
+{
+	__m128i bounce[VC4_COPY_BOUNCE / sizeof(__m128i)];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)s & 15;
+
+	if (head > size)
+		head = size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	while (size >= sizeof(__m128i)) {
+		size_t n = size < VC4_COPY_BOUNCE ? size & ~(sizeof(__m128i) - 1) : VC4_COPY_BOUNCE;
+		size_t i;
+
+		for (i = 0; i < n / sizeof(__m128i); i++)
+			bounce[i] = _mm_stream_load_si128((__m128i *)s + i);
+		memcpy(d, bounce, n);
+		d += n;
+		s += n;
+		size -= n;
 	}
 
-	/* add bo to hash */
-	privGem = NULL;
+	memcpy(d, s, size);
+}
+#endif
 
-	privGem = calloc(1, sizeof(PrivGem));
-	if (!privGem) {
-		TBM_VC4_ERROR("fail to calloc privGem\n");
-		free(bo_vc4);
-		return 0;
-	}
+/* pick the copy kernels of the cpu. TBM_VC4_COPY=scalar forces the
+ * fallback ones.
+ */
+static void
+_bufmgr_copy_init(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	char *env = getenv("TBM_VC4_COPY");
+	int simd = !(env && !strcmp(env, "scalar"));
 
-	privGem->ref_count = 1;
-	privGem->bo_priv = bo_vc4;
+	bufmgr_vc4->copy_to = _copy_to_wc_scalar;
+	bufmgr_vc4->copy_from = _copy_from_wc_scalar;
 
-	if (drmHashInsert(bufmgr_vc4->hashBos, bo_vc4->name,
-			   (void *)privGem) < 0) {
-		TBM_VC4_ERROR("bo:%p Cannot insert bo to Hash(%d) from gem:%d, fd:%d\n",
-			       bo, bo_vc4->name, gem, key);
+#ifdef VC4_COPY_NEON
+#if defined(__arm__)
+	if (!(getauxval(AT_HWCAP) & HWCAP_NEON))
+		simd = 0;
+#endif
+	if (simd) {
+		bufmgr_vc4->copy_to = _copy_to_wc_neon;
+		bufmgr_vc4->copy_from = _copy_from_wc_neon;
 	}
+#elif defined(VC4_COPY_SSE2)
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse2"))
+		simd = 0;
+	if (simd) {
+		bufmgr_vc4->copy_to = _copy_to_wc_sse2;
+		if (__builtin_cpu_supports("sse4.1"))
+			bufmgr_vc4->copy_from = _copy_from_wc_sse41;
+	}
+#endif
 
-	TBM_VC4_DEBUG(" bo:%p, gem:%d(%d), fd:%d, key_fd:%d, flags:%d, size:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    key,
-	    bo_vc4->flags_tbm,
-	    bo_vc4->size);
-
-	return (void *)bo_vc4;
+	TBM_VC4_DEBUG("copy kernels:%s\n", simd ? "simd" : "scalar");
 }
 
-static unsigned int
-tbm_vc4_bo_export(tbm_bo bo)
+/* tell the kernel how the cpu mapping of the bo will be accessed. the
+ * bos of a slab share the pages at their ends with their neighbours, the
+ * advice only changes the readahead and the prefault of these pages.
+ */
+static void
+_bo_map_advise(tbm_bo_vc4 bo_vc4, void *map, int populate)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
-
-	tbm_bo_vc4 bo_vc4;
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)map & ~(page - 1);
+	uintptr_t end = ((uintptr_t)map + bo_vc4->size + page - 1) & ~(page - 1);
+	int advice;
+
+	switch (bo_vc4->access) {
+	case TBM_VC4_ACCESS_SEQUENTIAL_WRITE:
+	case TBM_VC4_ACCESS_UPLOAD_ONCE:
+		advice = MADV_SEQUENTIAL;
+		break;
+	case TBM_VC4_ACCESS_RANDOM_READ:
+		advice = MADV_RANDOM;
+		break;
+	default:
+		advice = MADV_NORMAL;
+		break;
+	}
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+	if (madvise((void *)start, end - start, advice) == -1)
+		TBM_VC4_DEBUG("gem:%d fail to madvise(%s)\n",
+			      bo_vc4->gem, strerror(errno));
 
-	if (!bo_vc4->name) {
-		bo_vc4->name = _get_name(bo_vc4->fd, bo_vc4->gem);
-		if (!bo_vc4->name) {
-			TBM_VC4_ERROR("Cannot get name\n");
-			return 0;
-		}
-	}
+	if (!populate)
+		return;
 
-	TBM_VC4_DEBUG("    bo:%p, gem:%d(%d), fd:%d, flags:%d, size:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    bo_vc4->flags_tbm,
-	    bo_vc4->size);
+	/* fault the pages in now rather than on the first touch, the kernels
+	 * without MADV_POPULATE_WRITE only read the pages ahead. the cma bos
+	 * of vc4 are mapped whole by remap_pfn_range at mmap time: there is no
+	 * fault to save, MAP_POPULATE does nothing and MADV_POPULATE_WRITE
+	 * fails on the VM_PFNMAP vma. only the bos backed by pages faulted one
+	 * by one, like the shmem ones, gain from it.
+	 */
+#ifdef MADV_POPULATE_WRITE
+	if (madvise((void *)start, end - start, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+	madvise((void *)start, end - start, MADV_WILLNEED);
+}
 
-	return (unsigned int)bo_vc4->name;
+static int
+_bo_map_populate(tbm_bo_vc4 bo_vc4)
+{
+	return bo_vc4->access == TBM_VC4_ACCESS_SEQUENTIAL_WRITE ||
+	       bo_vc4->access == TBM_VC4_ACCESS_UPLOAD_ONCE;
 }
 
-tbm_fd
-tbm_vc4_bo_export_fd(tbm_bo bo)
+/* unmap an idle bo. the address of a mapped bo or of a bo given out by
+ * get_handle stays valid, and the bos of a slab point into the mapping of
+ * the slab. called with the bufmgr lock held, the bo mutex is only tried
+ * since _bo_mmap takes it before the bufmgr lock.
+ */
+static int
+_bo_map_evict(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, -1);
+	void *map = bo_vc4->pBase;
 
-	tbm_bo_vc4 bo_vc4;
-	int ret;
+	if (!map || bo_vc4->slab || bo_vc4->is_slab)
+		return 0;
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, -1);
+	/* the bo is being mapped by another thread */
+	if (pthread_mutex_trylock(&bo_vc4->mutex))
+		return 0;
 
-	struct drm_prime_handle arg = {0, };
+	/* a map of the bo racing with this one either sees the NULL pBase and
+	 * waits for the bo mutex in _bo_mmap, or is seen here by its map_cnt.
+	 */
+	bo_vc4->pBase = NULL;
+	__sync_synchronize();
+	if (bo_vc4->map_cnt || bo_vc4->cpu_handle) {
+		bo_vc4->pBase = map;
+		pthread_mutex_unlock(&bo_vc4->mutex);
+		return 0;
+	}
 
-	arg.handle = bo_vc4->gem;
-	ret = drmIoctl(bo_vc4->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &arg);
-	if (ret) {
-		TBM_VC4_ERROR("bo:%p Cannot dmabuf=%d (%s)\n",
-			       bo, bo_vc4->gem, strerror(errno));
-		return (tbm_fd) ret;
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	if (munmap(map, bo_vc4->size) == -1) {
+		TBM_VC4_ERROR("gem:%d fail to munmap(%s)\n",
+			       bo_vc4->gem, strerror(errno));
 	}
 
-	TBM_VC4_DEBUG(" bo:%p, gem:%d(%d), fd:%d, key_fd:%d, flags:%d, size:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    arg.fd,
-	    bo_vc4->flags_tbm,
-	    bo_vc4->size);
+	_list_del(&bo_vc4->map_link);
+	bo_vc4->map_evicted = 1;
+	VC4_STAT_SUB(bufmgr_vc4, map_bytes, bo_vc4->size);
 
-	return (tbm_fd)arg.fd;
+	return 1;
 }
 
-static tbm_bo_handle
-tbm_vc4_bo_get_handle(tbm_bo bo, int device)
+/* unmap the least recently used idle bos until size more bytes fit in
+ * TBM_VC4_MAP_BUDGET. the bos used since the last pass get a second chance.
+ * the budget is exceeded if all the mapped bos are in use.
+ */
+static void
+_bo_map_trim(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+	vc4_list *item, *next;
+
+	for (item = bufmgr_vc4->map_lru.next;
+	     item != &bufmgr_vc4->map_lru &&
+	     bufmgr_vc4->stats.map_bytes + size > bufmgr_vc4->map_budget;
+	     item = next) {
+		tbm_bo_vc4 bo_vc4 = vc4_container_of(item, struct _tbm_bo_vc4, map_link);
+
+		next = item->next;
+
+		if (bo_vc4->map_ref) {
+			bo_vc4->map_ref = 0;
+			_list_del(&bo_vc4->map_link);
+			_list_add_tail(&bo_vc4->map_link, &bufmgr_vc4->map_lru);
+			if (next == &bufmgr_vc4->map_lru)
+				next = bo_vc4->map_link.prev->next;
+			continue;
+		}
 
-	tbm_bo_handle bo_handle;
-	tbm_bo_vc4 bo_vc4;
+		if (_bo_map_evict(bufmgr_vc4, bo_vc4))
+			VC4_STAT_ADD(bufmgr_vc4, map_evictions, 1);
+	}
+}
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, (tbm_bo_handle) NULL);
+/* map the bo on first use. the mapping is made once under the bo mutex,
+ * the bufmgr lock is only taken to account it, so the threads mapping
+ * different bos do not wait for each other. must not be called with the
+ * bufmgr lock held.
+ */
+static void *
+_bo_mmap(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int populate)
+{
+	struct drm_vc4_mmap_bo arg = {0, };
+	void *map;
 
-	if (!bo_vc4->gem) {
-		TBM_VC4_ERROR("Cannot map gem=%d\n", bo_vc4->gem);
-		return (tbm_bo_handle) NULL;
+	map = bo_vc4->pBase;
+	if (map) {
+		bo_vc4->map_ref = 1;
+		return map;
 	}
 
-	TBM_VC4_DEBUG("bo:%p, gem:%d(%d), fd:%d, flags:%d, size:%d, %s\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    bo_vc4->flags_tbm,
-	    bo_vc4->size,
-	    STR_DEVICE[device]);
+	/* the address in the slab mapping is the same for all the threads */
+	if (bo_vc4->slab) {
+		void *base = _bo_mmap(bufmgr_vc4, bo_vc4->slab->bo, populate);
 
-	/*Get mapped bo_handle*/
-	bo_handle = _vc4_bo_handle(bo_vc4, device);
-	if (bo_handle.ptr == NULL) {
-		TBM_VC4_ERROR("Cannot get handle: gem:%d, device:%d\n",
-			bo_vc4->gem, device);
-		return (tbm_bo_handle) NULL;
+		if (!base)
+			return NULL;
+
+		map = (char *)base + bo_vc4->offset;
+		if (bo_vc4->access)
+			_bo_map_advise(bo_vc4, map, _bo_map_populate(bo_vc4));
+
+		bo_vc4->pBase = map;
+		return map;
 	}
 
-	return bo_handle;
-}
+	if (_bo_map_populate(bo_vc4))
+		populate = 1;
 
-static tbm_bo_handle
-tbm_vc4_bo_map(tbm_bo bo, int device, int opt)
-{
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+	pthread_mutex_lock(&bo_vc4->mutex);
 
-	tbm_bo_handle bo_handle;
-	tbm_bo_vc4 bo_vc4;
-	tbm_bufmgr_vc4 bufmgr_vc4;
+	/* mapped by another thread meanwhile, or kept by _bo_map_evict */
+	map = bo_vc4->pBase;
+	if (map) {
+		pthread_mutex_unlock(&bo_vc4->mutex);
+		return map;
+	}
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, (tbm_bo_handle)NULL);
+	if (bufmgr_vc4->map_budget &&
+	    bufmgr_vc4->stats.map_bytes + bo_vc4->size > bufmgr_vc4->map_budget) {
+		pthread_mutex_lock(&bufmgr_vc4->lock);
+		_bo_map_trim(bufmgr_vc4, bo_vc4->size);
+		pthread_mutex_unlock(&bufmgr_vc4->lock);
+	}
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, (tbm_bo_handle) NULL);
+	arg.handle = bo_vc4->gem;
+	if (drmIoctl(bo_vc4->fd, DRM_IOCTL_VC4_MMAP_BO, &arg)){
+		TBM_VC4_ERROR("Cannot map_dumb gem=%d\n", bo_vc4->gem);
+		pthread_mutex_unlock(&bo_vc4->mutex);
+		return NULL;
+	}
 
-	if (!bo_vc4->gem) {
-		TBM_VC4_ERROR("Cannot map gem=%d\n", bo_vc4->gem);
-		return (tbm_bo_handle) NULL;
+	map = mmap(NULL, bo_vc4->size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | (populate ? MAP_POPULATE : 0),
+		   bo_vc4->fd, arg.offset);
+	if (map == MAP_FAILED) {
+		TBM_VC4_ERROR("Cannot usrptr gem=%d\n", bo_vc4->gem);
+		pthread_mutex_unlock(&bo_vc4->mutex);
+		return NULL;
 	}
+	if (bo_vc4->access)
+		_bo_map_advise(bo_vc4, map, 0);
 
-	TBM_VC4_DEBUG("       bo:%p, gem:%d(%d), fd:%d, %s, %s\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf,
-	    STR_DEVICE[device],
-	    STR_OPT[opt]);
+	pthread_mutex_lock(&bufmgr_vc4->lock);
 
-	/*Get mapped bo_handle*/
-	bo_handle = _vc4_bo_handle(bo_vc4, device);
-	if (bo_handle.ptr == NULL) {
-		TBM_VC4_ERROR("Cannot get handle: gem:%d, device:%d, opt:%d\n",
-			       bo_vc4->gem, device, opt);
-		return (tbm_bo_handle) NULL;
+	_list_add_tail(&bo_vc4->map_link, &bufmgr_vc4->map_lru);
+	VC4_STAT_ADD(bufmgr_vc4, map_bytes, bo_vc4->size);
+
+	if (bo_vc4->map_evicted) {
+		bo_vc4->map_evicted = 0;
+		VC4_STAT_ADD(bufmgr_vc4, remaps, 1);
 	}
 
-	if (bo_vc4->map_cnt == 0)
-		_bo_set_cache_state(bufmgr_vc4, bo_vc4, device, opt);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
 
-	bo_vc4->last_map_device = device;
+	/* published last, the fast path of the other threads uses it as is */
+	__sync_synchronize();
+	bo_vc4->pBase = map;
 
-	bo_vc4->map_cnt++;
+	pthread_mutex_unlock(&bo_vc4->mutex);
 
-	return bo_handle;
+	return map;
 }
 
-static int
-tbm_vc4_bo_unmap(tbm_bo bo)
+/* called with the bufmgr lock held */
+static void
+_bo_range_release(tbm_bufmgr_vc4 bufmgr_vc4, vc4_bo_range *range)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	_list_del(&range->link);
+	free(range);
+}
 
-	tbm_bo_vc4 bo_vc4;
-	tbm_bufmgr_vc4 bufmgr_vc4;
+/* called with the bufmgr lock held */
+static void
+_bo_munmap(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	if (!bo_vc4->pBase)
+		return;
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+	/* the mapping of a bo of a slab belongs to the slab */
+	if (bo_vc4->slab) {
+		bo_vc4->pBase = NULL;
+		return;
+	}
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+	if (munmap(bo_vc4->pBase, bo_vc4->size) == -1) {
+		TBM_VC4_ERROR("gem:%d fail to munmap(%s)\n",
+			       bo_vc4->gem, strerror(errno));
+	}
 
+	_list_del(&bo_vc4->map_link);
+	bo_vc4->pBase = NULL;
+	VC4_STAT_SUB(bufmgr_vc4, map_bytes, bo_vc4->size);
+}
 
-	if (!bo_vc4->gem)
-		return 0;
+static tbm_bo_handle
+_vc4_bo_handle(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int device)
+{
+	tbm_bo_handle bo_handle;
 
-	bo_vc4->map_cnt--;
+	memset(&bo_handle, 0x0, sizeof(uint64_t));
 
-	if (bo_vc4->map_cnt == 0)
-		_bo_save_cache_state(bufmgr_vc4, bo_vc4);
+	/* the gem handle and the dmabuf of a slab bo would be the ones of the
+	 * whole slab, only its cpu mapping is its own
+	 */
+	if (bo_vc4->slab && device != TBM_DEVICE_CPU) {
+		TBM_VC4_ERROR("Cannot get the handle of a slab bo(gem:%d, device:%d)\n",
+			       bo_vc4->gem, device);
+		return (tbm_bo_handle) NULL;
+	}
 
-#ifdef ENABLE_CACHECRTL
-	if (bo_vc4->last_map_device == TBM_DEVICE_CPU)
-		_vc4_cache_flush(bufmgr_vc4, bo_vc4, TBM_VC4_CACHE_FLUSH_ALL);
-#endif
+	switch (device) {
+	case TBM_DEVICE_DEFAULT:
+	case TBM_DEVICE_2D:
+		bo_handle.u32 = (uint32_t)bo_vc4->gem;
+		break;
+	case TBM_DEVICE_CPU:
+		bo_handle.ptr = _bo_mmap(bufmgr_vc4, bo_vc4, 0);
+		if (!bo_handle.ptr)
+			return (tbm_bo_handle) NULL;
+		break;
+	case TBM_DEVICE_3D:
+#ifdef USE_DMAIMPORT
+		/* the fd is used by the caller from now on, so it is never
+		 * closed before the bo. it is set before the bufmgr lock is
+		 * taken, see _bo_trim_dmabuf.
+		 */
+		__sync_lock_test_and_set(&bo_vc4->dmabuf_handle, 1);
+		if (!_bo_get_dmabuf(bufmgr_vc4, bo_vc4))
+			return (tbm_bo_handle) NULL;
 
-	bo_vc4->last_map_device = -1;
+		bo_handle.u32 = (uint32_t)bo_vc4->dmabuf;
+#endif
+		break;
+	case TBM_DEVICE_MM:
+		__sync_lock_test_and_set(&bo_vc4->dmabuf_handle, 1);
+		if (!_bo_get_dmabuf(bufmgr_vc4, bo_vc4))
+			return (tbm_bo_handle) NULL;
 
-	TBM_VC4_DEBUG("     bo:%p, gem:%d(%d), fd:%d\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf);
+		bo_handle.u32 = (uint32_t)bo_vc4->dmabuf;
+		break;
+	default:
+		TBM_VC4_ERROR("Not supported device:%d\n", device);
+		bo_handle.ptr = (void *) NULL;
+		break;
+	}
 
-	return 1;
+	return bo_handle;
 }
 
 static int
-tbm_vc4_bo_lock(tbm_bo bo, int device, int opt)
+tbm_vc4_bo_size(tbm_bo bo)
 {
 	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
 
-#ifndef ALWAYS_BACKEND_CTRL
-	tbm_bufmgr_vc4 bufmgr_vc4;
 	tbm_bo_vc4 bo_vc4;
-	struct dma_buf_fence fence;
-	struct flock filelock;
-	int ret = 0;
-
-	if (device != TBM_DEVICE_3D && device != TBM_DEVICE_CPU) {
-		TBM_VC4_DEBUG("Not support device type,\n");
-		return 0;
-	}
 
 	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
 	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+	return bo_vc4->size;
+}
 
-	memset(&fence, 0, sizeof(struct dma_buf_fence));
+static time_t
+_get_time(void)
+{
+	struct timespec tp;
 
-	/* Check if the given type is valid or not. */
-	if (opt & TBM_OPTION_WRITE) {
-		if (device == TBM_DEVICE_3D)
-			fence.type = DMA_BUF_ACCESS_WRITE | DMA_BUF_ACCESS_DMA;
-	} else if (opt & TBM_OPTION_READ) {
-		if (device == TBM_DEVICE_3D)
-			fence.type = DMA_BUF_ACCESS_READ | DMA_BUF_ACCESS_DMA;
-	} else {
-		TBM_VC4_ERROR("Invalid argument\n");
-		return 0;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &tp);
 
-	/* Check if the tbm manager supports dma fence or not. */
-	if (!bufmgr_vc4->use_dma_fence) {
-		TBM_VC4_ERROR("Not support DMA FENCE(%s)\n", strerror(errno));
-		return 0;
+	return tp.tv_sec;
+}
 
+/* parse a size in bytes with an optional K, M or G suffix */
+static unsigned long
+_parse_size(const char *str)
+{
+	char *end;
+	unsigned long size;
+
+	size = strtoul(str, &end, 10);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size *= 1024;
+		/* fall through */
+	case 'm':
+	case 'M':
+		size *= 1024;
+		/* fall through */
+	case 'k':
+	case 'K':
+		size *= 1024;
+		break;
+	default:
+		break;
 	}
 
-	if (device == TBM_DEVICE_3D) {
-		ret = ioctl(bo_vc4->dmabuf, DMABUF_IOCTL_GET_FENCE, &fence);
-		if (ret < 0) {
-			TBM_VC4_ERROR("Cannot set GET FENCE(%s)\n", strerror(errno));
-			return 0;
-		}
-	} else {
-		if (opt & TBM_OPTION_WRITE)
-			filelock.l_type = F_WRLCK;
-		else
-			filelock.l_type = F_RDLCK;
-
-		filelock.l_whence = SEEK_CUR;
-		filelock.l_start = 0;
-		filelock.l_len = 0;
+	return size;
+}
 
-		if (-1 == fcntl(bo_vc4->dmabuf, F_SETLKW, &filelock))
-			return 0;
+/* allocate count bo privates in one block and put them in the free list */
+static int
+_bo_priv_reserve(tbm_bufmgr_vc4 bufmgr_vc4, int count)
+{
+	struct _vc4_bo_chunk *chunk;
+	int i;
+
+	/* keep each bo on its own cache lines */
+	if (posix_memalign((void **)&chunk, TBM_VC4_CACHE_LINE,
+			   sizeof(struct _vc4_bo_chunk) +
+			   sizeof(struct _tbm_bo_vc4) * count)) {
+		TBM_VC4_ERROR("fail to allocate the bo privates(%d)\n", count);
+		return 0;
 	}
 
-	pthread_mutex_lock(&bo_vc4->mutex);
+	chunk->next = bufmgr_vc4->priv_chunks;
+	bufmgr_vc4->priv_chunks = chunk;
 
-	if (device == TBM_DEVICE_3D) {
-		int i;
+	for (i = 0; i < count; i++)
+		_list_add_tail(&chunk->bos[i].cache_link, &bufmgr_vc4->priv_free);
 
-		for (i = 0; i < DMA_FENCE_LIST_MAX; i++) {
-			if (bo_vc4->dma_fence[i].ctx == 0) {
-				bo_vc4->dma_fence[i].type = fence.type;
-				bo_vc4->dma_fence[i].ctx = fence.ctx;
-				break;
-			}
-		}
+	return 1;
+}
 
-		if (i == DMA_FENCE_LIST_MAX) {
-			/*TODO: if dma_fence list is full, it needs realloc. I will fix this. by minseok3.kim*/
-			TBM_VC4_ERROR("fence list is full\n");
-		}
-	}
+/* take a bo private out of a list of free ones */
+static tbm_bo_vc4
+_bo_priv_take(vc4_list *list)
+{
+	tbm_bo_vc4 bo_vc4;
 
-	pthread_mutex_unlock(&bo_vc4->mutex);
+	bo_vc4 = vc4_container_of(list->next, struct _tbm_bo_vc4, cache_link);
+	_list_del(&bo_vc4->cache_link);
 
-	TBM_VC4_DEBUG("DMABUF_IOCTL_GET_FENCE! bo:%p, gem:%d(%d), fd:%ds\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf);
-#endif /* ALWAYS_BACKEND_CTRL */
+	memset(bo_vc4, 0, sizeof(struct _tbm_bo_vc4));
+	_list_init(&bo_vc4->cache_link);
+	_list_init(&bo_vc4->dmabuf_link);
+	_list_init(&bo_vc4->map_link);
+	_list_init(&bo_vc4->ranges);
 
-	return 1;
+	return bo_vc4;
 }
 
-static int
-tbm_vc4_bo_unlock(tbm_bo bo)
+static tbm_bo_vc4
+_bo_priv_alloc(tbm_bufmgr_vc4 bufmgr_vc4)
 {
-	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	if (_list_empty(&bufmgr_vc4->priv_free) &&
+	    !_bo_priv_reserve(bufmgr_vc4, BO_PRIV_CHUNK))
+		return NULL;
 
-#ifndef ALWAYS_BACKEND_CTRL
-	tbm_bo_vc4 bo_vc4;
-	struct dma_buf_fence fence;
-	struct flock filelock;
-	unsigned int dma_type = 0;
-	int ret = 0;
+	return _bo_priv_take(&bufmgr_vc4->priv_free);
+}
 
-	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
-	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+static void
+_bo_priv_free(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	_list_add_tail(&bo_vc4->cache_link, &bufmgr_vc4->priv_free);
+}
 
-	if (bo_vc4->dma_fence[0].type & DMA_BUF_ACCESS_DMA)
-		dma_type = 1;
+static void
+_bo_priv_fini(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	while (bufmgr_vc4->priv_chunks) {
+		struct _vc4_bo_chunk *chunk = bufmgr_vc4->priv_chunks;
 
-	if (!bo_vc4->dma_fence[0].ctx && dma_type) {
-		TBM_VC4_DEBUG("FENCE not support or ignored,\n");
-		return 0;
+		bufmgr_vc4->priv_chunks = chunk->next;
+		free(chunk);
 	}
 
-	if (!bo_vc4->dma_fence[0].ctx && dma_type) {
-		TBM_VC4_DEBUG("device type is not 3D/CPU,\n");
-		return 0;
-	}
+	_list_init(&bufmgr_vc4->priv_free);
+}
 
-	pthread_mutex_lock(&bo_vc4->mutex);
+static void
+_bo_cache_add_bucket(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size)
+{
+	int i = bufmgr_vc4->num_buckets;
 
-	if (dma_type) {
-		fence.type = bo_vc4->dma_fence[0].type;
-		fence.ctx = bo_vc4->dma_fence[0].ctx;
-		int i;
+	VC4_RETURN_IF_FAIL(i < BO_CACHE_BUCKET_MAX);
 
-		for (i = 1; i < DMA_FENCE_LIST_MAX; i++) {
-			bo_vc4->dma_fence[i - 1].type = bo_vc4->dma_fence[i].type;
-			bo_vc4->dma_fence[i - 1].ctx = bo_vc4->dma_fence[i].ctx;
-		}
-		bo_vc4->dma_fence[DMA_FENCE_LIST_MAX - 1].type = 0;
-		bo_vc4->dma_fence[DMA_FENCE_LIST_MAX - 1].ctx = 0;
-	}
-	pthread_mutex_unlock(&bo_vc4->mutex);
+	_list_init(&bufmgr_vc4->cache_bucket[i].head);
+	bufmgr_vc4->cache_bucket[i].size = size;
+	bufmgr_vc4->num_buckets++;
+}
 
-	if (dma_type) {
-		ret = ioctl(bo_vc4->dmabuf, DMABUF_IOCTL_PUT_FENCE, &fence);
-		if (ret < 0) {
-			TBM_VC4_ERROR("Can not set PUT FENCE(%s)\n", strerror(errno));
-			return 0;
-		}
-	} else {
-		filelock.l_type = F_UNLCK;
-		filelock.l_whence = SEEK_CUR;
-		filelock.l_start = 0;
-		filelock.l_len = 0;
+static void
+_bo_cache_init(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	unsigned int size;
 
-		if (-1 == fcntl(bo_vc4->dmabuf, F_SETLKW, &filelock))
-			return 0;
+	/* power of two buckets waste too much memory, so give 3 other sizes
+	 * between each power of two.
+	 */
+	_bo_cache_add_bucket(bufmgr_vc4, TBM_VC4_PAGE_SIZE);
+	_bo_cache_add_bucket(bufmgr_vc4, TBM_VC4_PAGE_SIZE * 2);
+	_bo_cache_add_bucket(bufmgr_vc4, TBM_VC4_PAGE_SIZE * 3);
+
+	for (size = TBM_VC4_PAGE_SIZE * 4; size <= BO_CACHE_MAX_SIZE; size *= 2) {
+		_bo_cache_add_bucket(bufmgr_vc4, size);
+		_bo_cache_add_bucket(bufmgr_vc4, size + size * 1 / 4);
+		_bo_cache_add_bucket(bufmgr_vc4, size + size * 2 / 4);
+		_bo_cache_add_bucket(bufmgr_vc4, size + size * 3 / 4);
 	}
+}
 
-	TBM_VC4_DEBUG("DMABUF_IOCTL_PUT_FENCE! bo:%p, gem:%d(%d), fd:%ds\n",
-	    bo,
-	    bo_vc4->gem, bo_vc4->name,
-	    bo_vc4->dmabuf);
-#endif /* ALWAYS_BACKEND_CTRL */
+static struct _vc4_bo_bucket *
+_bo_cache_bucket_for_size(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size)
+{
+	int i;
 
-	return 1;
+	for (i = 0; i < bufmgr_vc4->num_buckets; i++) {
+		struct _vc4_bo_bucket *bucket = &bufmgr_vc4->cache_bucket[i];
+
+		if (bucket->size >= size)
+			return bucket;
+	}
+
+	return NULL;
 }
 
+static void _bo_slab_free(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4);
+
+/* remove the bo from its bucket of the bo cache */
 static void
-tbm_vc4_bufmgr_deinit(void *priv)
+_bo_cache_unlink(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	VC4_RETURN_IF_FAIL(priv != NULL);
+	if (_list_empty(&bo_vc4->cache_link))
+		return;
 
-	tbm_bufmgr_vc4 bufmgr_vc4;
+	_list_del(&bo_vc4->cache_link);
 
-	bufmgr_vc4 = (tbm_bufmgr_vc4)priv;
+	VC4_STAT_SUB(bufmgr_vc4, cache_count, 1);
+	VC4_STAT_SUB(bufmgr_vc4, cache_bytes, bo_vc4->size);
+}
 
-	if (bufmgr_vc4->hashBos) {
-		unsigned long key;
-		void *value;
+static void
+_bo_destroy(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	struct drm_gem_close arg = {0, };
 
-		while (drmHashFirst(bufmgr_vc4->hashBos, &key, &value) > 0) {
-			free(value);
-			drmHashDelete(bufmgr_vc4->hashBos, key);
-		}
+	__sync_lock_test_and_set(&bo_vc4->state, BO_STATE_DYING);
 
-		drmHashDestroy(bufmgr_vc4->hashBos);
-		bufmgr_vc4->hashBos = NULL;
+	if (bo_vc4->slab) {
+		_bo_slab_free(bufmgr_vc4, bo_vc4);
+		return;
 	}
 
-	_bufmgr_deinit_cache_state(bufmgr_vc4);
+	/* a bo taken back by an import may still be linked in the bo cache */
+	_bo_cache_unlink(bufmgr_vc4, bo_vc4);
 
-	if (bufmgr_vc4->bind_display)
-		tbm_drm_helper_wl_auth_server_deinit();
+	_bo_munmap(bufmgr_vc4, bo_vc4);
 
-	if (bufmgr_vc4->device_name)
-		free(bufmgr_vc4->device_name);
+	/* close dmabuf */
+	_bo_close_dmabuf(bufmgr_vc4, bo_vc4);
 
-	if (tbm_backend_is_display_server())
-		tbm_drm_helper_unset_tbm_master_fd();
+	if (bo_vc4->imported)
+		VC4_STAT_SUB(bufmgr_vc4, import_bytes, bo_vc4->size);
 	else
-		tbm_drm_helper_unset_fd();
+		VC4_STAT_SUB(bufmgr_vc4, alloc_bytes, bo_vc4->size);
 
-	close(bufmgr_vc4->fd);
+	_bo_destroy_cache_state(bufmgr_vc4, bo_vc4);
 
-	free(bufmgr_vc4);
+	/* delete bo from hash and free gem handle, the imports do not look
+	 * up the bo or get the handle from the kernel meanwhile.
+	 */
+	pthread_rwlock_wrlock(&bufmgr_vc4->handle_lock);
+
+	_bo_unregister(bufmgr_vc4, bo_vc4);
+
+	arg.handle = bo_vc4->gem;
+	if (drmIoctl(bo_vc4->fd, DRM_IOCTL_GEM_CLOSE, &arg)) {
+		TBM_VC4_ERROR("gem:%d fail to gem close.(%s)\n",
+			       bo_vc4->gem, strerror(errno));
+	}
+
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+
+	_bo_priv_free(bufmgr_vc4, bo_vc4);
 }
 
-int
-tbm_vc4_surface_supported_format(uint32_t **formats, uint32_t *num)
+/* returns 1 if the pages of the bo are retained, 0 if the kernel purged
+ * them, -1 on error.
+ */
+static int
+_bo_madvise(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int willneed)
 {
-	uint32_t *color_formats = NULL;
+#ifdef DRM_IOCTL_VC4_GEM_MADVISE
+	struct drm_vc4_gem_madvise arg = {0, };
 
-	color_formats = (uint32_t *)calloc(1,
-					   sizeof(uint32_t) * TBM_COLOR_FORMAT_COUNT);
+	if (!bufmgr_vc4->use_madvise)
+		return 1;
 
-	if (color_formats == NULL)
-		return 0;
+	arg.handle = bo_vc4->gem;
+	arg.madv = willneed ? VC4_MADV_WILLNEED : VC4_MADV_DONTNEED;
+	if (drmIoctl(bo_vc4->fd, DRM_IOCTL_VC4_GEM_MADVISE, &arg)) {
+		/* a kernel without the ioctl fails with EINVAL on the bos it
+		 * made, an imported bo of another device fails alone.
+		 */
+		if (errno == ENOTTY || (errno == EINVAL && !bo_vc4->imported)) {
+			TBM_VC4_DEBUG("madvise is not supported(%s)\n", strerror(errno));
+			bufmgr_vc4->use_madvise = 0;
+			bo_vc4->purgeable = 0;
+			return 1;
+		}
 
-	memcpy(color_formats, tbm_vc4_color_format_list,
-	       sizeof(uint32_t)*TBM_COLOR_FORMAT_COUNT);
+		if (errno == EINVAL) {
+			TBM_VC4_DEBUG("gem:%d cannot be madvised\n", bo_vc4->gem);
+			bo_vc4->purgeable = 0;
+			return 1;
+		}
 
-	*formats = color_formats;
-	*num = TBM_COLOR_FORMAT_COUNT;
+		TBM_VC4_ERROR("fail to madvise gem:%d (%s)\n",
+			       bo_vc4->gem, strerror(errno));
+		return -1;
+	}
 
-	TBM_VC4_DEBUG("tbm_vc4_surface_supported_format  count = %d\n", *num);
+	bo_vc4->purgeable = !willneed;
+
+	if (!willneed) {
+		VC4_STAT_ADD(bufmgr_vc4, purgeable_marked, 1);
+		return 1;
+	}
+
+	if (!arg.retained) {
+		VC4_STAT_ADD(bufmgr_vc4, purged, 1);
+		return 0;
+	}
+#endif
 
 	return 1;
 }
 
+/* replace the purged gem object of a bo by a new one. the contents are lost.
+ * the new object is created first, so that the bo keeps the purged one if
+ * it fails. the bos whose mapping or dmabuf fd are used outside of the bo
+ * cannot change their object. called with the bo mutex and the bufmgr lock
+ * held.
+ */
 static int
-_new_calc_plane_nv12(int width, int height)
+_bo_recreate(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	int mbX, mbY;
+	struct drm_vc4_create_bo create_arg = {0, };
+	struct drm_gem_close close_arg = {0, };
+	unsigned int gem;
+	int label;
+	int ret;
 
-	mbX = DIV_ROUND_UP(width, S5P_FIMV_NUM_PIXELS_IN_MB_ROW);
-	mbY = DIV_ROUND_UP(height, S5P_FIMV_NUM_PIXELS_IN_MB_COL);
+	if (bo_vc4->cpu_handle || bo_vc4->dmabuf_handle || bo_vc4->map_cnt ||
+	    !_list_empty(&bo_vc4->ranges) || !bo_vc4->reusable) {
+		TBM_VC4_ERROR("gem:%d is in use, cannot be recreated\n", bo_vc4->gem);
+		bo_vc4->purgeable = 1;
+		return 0;
+	}
 
-	if (width * height < S5P_FIMV_MAX_FRAME_SIZE)
-		mbY = (mbY + 1) / 2 * 2;
+	create_arg.flags = bo_vc4->flags_tbm & ~TBM_BO_VENDOR;
+	create_arg.size = (__u32)bo_vc4->size;
+	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_VC4_CREATE_BO, &create_arg)) {
+		TBM_VC4_ERROR("Cannot create bo(flag:%x, size:%d)\n", create_arg.flags,
+			       (unsigned int)create_arg.size);
+		VC4_STAT_ADD(bufmgr_vc4, kernel_failures, 1);
+		/* still purged, the next use tries again */
+		bo_vc4->purgeable = 1;
+		return 0;
+	}
 
-	return ((mbX * S5P_FIMV_NUM_PIXELS_IN_MB_COL) * (mbY *
-			S5P_FIMV_NUM_PIXELS_IN_MB_ROW));
+	_bo_munmap(bufmgr_vc4, bo_vc4);
+
+	_bo_close_dmabuf(bufmgr_vc4, bo_vc4);
+
+	pthread_rwlock_wrlock(&bufmgr_vc4->handle_lock);
+
+	_bo_unregister(bufmgr_vc4, bo_vc4);
+
+	gem = bo_vc4->gem;
+	bo_vc4->gem = (unsigned int)create_arg.handle;
+	bo_vc4->name = 0;
+	bo_vc4->ino = 0;
+
+	ret = _bo_register(bufmgr_vc4, bo_vc4) == bo_vc4;
+
+	close_arg.handle = gem;
+	if (drmIoctl(bo_vc4->fd, DRM_IOCTL_GEM_CLOSE, &close_arg)) {
+		TBM_VC4_ERROR("gem:%d fail to gem close.(%s)\n",
+			       gem, strerror(errno));
+	}
+
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+
+	/* the label of the kernel object is set again */
+	label = bo_vc4->label;
+	_bo_label_del(bufmgr_vc4, bo_vc4);
+	bo_vc4->label = TBM_VC4_LABEL_NONE;
+	_bo_label_add(bufmgr_vc4, bo_vc4, label);
+
+	return ret;
 }
 
+/* mark a purgeable bo willneed before it is used. a purged bo gets a new
+ * gem object, its mapping is replaced under the bo mutex, see _bo_mmap.
+ * return 1 if the contents are retained, 0 if they were purged, -1 if the
+ * bo cannot be used.
+ */
 static int
-_calc_yplane_nv12(int width, int height)
+_bo_willneed(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	int mbX, mbY;
+	int ret = 1;
 
-	mbX = SIZE_ALIGN(width + 24, S5P_FIMV_NV12MT_HALIGN);
-	mbY = SIZE_ALIGN(height + 16, S5P_FIMV_NV12MT_VALIGN);
+	if (!bo_vc4->purgeable)
+		return 1;
 
-	return SIZE_ALIGN(mbX * mbY, S5P_FIMV_DEC_BUF_ALIGN);
+	pthread_mutex_lock(&bo_vc4->mutex);
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	if (bo_vc4->purgeable) {
+		ret = _bo_madvise(bufmgr_vc4, bo_vc4, 1);
+		if (ret == 0 && !_bo_recreate(bufmgr_vc4, bo_vc4))
+			ret = -1;
+	}
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	return ret;
 }
 
-static int
-_calc_uvplane_nv12(int width, int height)
+static void
+_bo_cache_evict(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
 {
-	int mbX, mbY;
+	_bo_cache_unlink(bufmgr_vc4, bo_vc4);
 
-	mbX = SIZE_ALIGN(width + 16, S5P_FIMV_NV12MT_HALIGN);
-	mbY = SIZE_ALIGN(height + 4, S5P_FIMV_NV12MT_VALIGN);
+	/* an import took the bo back, it is only unlinked */
+	if (!__sync_bool_compare_and_swap(&bo_vc4->state, BO_STATE_CACHED,
+					  BO_STATE_DYING))
+		return;
 
-	return SIZE_ALIGN((mbX * mbY) >> 1, S5P_FIMV_DEC_BUF_ALIGN);
+	VC4_STAT_ADD(bufmgr_vc4, cache_evictions, 1);
+
+	_bo_destroy(bufmgr_vc4, bo_vc4);
 }
 
-static int
-_new_calc_yplane_nv12(int width, int height)
+/* release the cached bos which have been idle for BO_CACHE_TIMEOUT.
+ * this runs from the alloc/free paths, at most once a second.
+ */
+static void
+_bo_cache_cleanup(tbm_bufmgr_vc4 bufmgr_vc4, time_t time)
 {
-	return SIZE_ALIGN(_new_calc_plane_nv12(width,
-						height) + S5P_FIMV_D_ALIGN_PLANE_SIZE,
-			   TBM_SURFACE_ALIGNMENT_PLANE_NV12);
+	int i;
+
+	if (bufmgr_vc4->cache_time == time)
+		return;
+
+	for (i = 0; i < bufmgr_vc4->num_buckets; i++) {
+		struct _vc4_bo_bucket *bucket = &bufmgr_vc4->cache_bucket[i];
+
+		/* the oldest bos are at the head of the bucket */
+		while (!_list_empty(&bucket->head)) {
+			tbm_bo_vc4 bo_vc4 = vc4_container_of(bucket->head.next,
+						struct _tbm_bo_vc4, cache_link);
+
+			if (time - bo_vc4->free_time <= BO_CACHE_TIMEOUT)
+				break;
+
+			_bo_cache_evict(bufmgr_vc4, bo_vc4);
+		}
+	}
+
+	bufmgr_vc4->cache_time = time;
 }
 
-static int
-_new_calc_uvplane_nv12(int width, int height)
+static void
+_bo_cache_purge(tbm_bufmgr_vc4 bufmgr_vc4)
 {
-	return SIZE_ALIGN((_new_calc_plane_nv12(width,
-						height) >> 1) + S5P_FIMV_D_ALIGN_PLANE_SIZE,
-			  TBM_SURFACE_ALIGNMENT_PLANE_NV12);
+	int i;
+
+	for (i = 0; i < bufmgr_vc4->num_buckets; i++) {
+		struct _vc4_bo_bucket *bucket = &bufmgr_vc4->cache_bucket[i];
+
+		while (!_list_empty(&bucket->head)) {
+			tbm_bo_vc4 bo_vc4 = vc4_container_of(bucket->head.next,
+						struct _tbm_bo_vc4, cache_link);
+
+			_bo_cache_evict(bufmgr_vc4, bo_vc4);
+		}
+	}
 }
 
-/**
- * @brief get the plane data of the surface.
- * @param[in] width : the width of the surface
- * @param[in] height : the height of the surface
- * @param[in] format : the format of the surface
- * @param[in] plane_idx : the format of the surface
- * @param[out] size : the size of the plane
- * @param[out] offset : the offset of the plane
- * @param[out] pitch : the pitch of the plane
- * @param[out] padding : the padding of the plane
- * @return 1 if this function succeeds, otherwise 0.
- */
-int
-tbm_vc4_surface_get_plane_data(int width, int height,
-				  tbm_format format, int plane_idx, uint32_t *size, uint32_t *offset,
-				  uint32_t *pitch, int *bo_idx)
+static tbm_bo_vc4
+_bo_cache_get(tbm_bufmgr_vc4 bufmgr_vc4, struct _vc4_bo_bucket *bucket,
+	      unsigned int size, int flags)
 {
-	int ret = 1;
-	int bpp;
-	int _offset = 0;
-	int _pitch = 0;
-	int _size = 0;
-	int _bo_idx = 0;
+	vc4_list *item, *prev;
 
-	switch (format) {
-		/* 16 bpp RGB */
-	case TBM_FORMAT_XRGB4444:
-	case TBM_FORMAT_XBGR4444:
-	case TBM_FORMAT_RGBX4444:
-	case TBM_FORMAT_BGRX4444:
-	case TBM_FORMAT_ARGB4444:
-	case TBM_FORMAT_ABGR4444:
-	case TBM_FORMAT_RGBA4444:
-	case TBM_FORMAT_BGRA4444:
-	case TBM_FORMAT_XRGB1555:
-	case TBM_FORMAT_XBGR1555:
-	case TBM_FORMAT_RGBX5551:
-	case TBM_FORMAT_BGRX5551:
-	case TBM_FORMAT_ARGB1555:
-	case TBM_FORMAT_ABGR1555:
-	case TBM_FORMAT_RGBA5551:
-	case TBM_FORMAT_BGRA5551:
-	case TBM_FORMAT_RGB565:
-		bpp = 16;
-		_offset = 0;
-		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_RGB);
-		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-		_bo_idx = 0;
-		break;
-		/* 24 bpp RGB */
-	case TBM_FORMAT_RGB888:
-	case TBM_FORMAT_BGR888:
-		bpp = 24;
-		_offset = 0;
-		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_RGB);
-		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-		_bo_idx = 0;
-		break;
-		/* 32 bpp RGB */
-	case TBM_FORMAT_XRGB8888:
-	case TBM_FORMAT_XBGR8888:
-	case TBM_FORMAT_RGBX8888:
-	case TBM_FORMAT_BGRX8888:
-	case TBM_FORMAT_ARGB8888:
-	case TBM_FORMAT_ABGR8888:
-	case TBM_FORMAT_RGBA8888:
-	case TBM_FORMAT_BGRA8888:
-		bpp = 32;
-		_offset = 0;
-		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_RGB);
-		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-		_bo_idx = 0;
-		break;
+	/* take the most recently freed bo, it is the most likely to be hot */
+	for (item = bucket->head.prev; item != &bucket->head; item = prev) {
+		tbm_bo_vc4 bo_vc4 = vc4_container_of(item, struct _tbm_bo_vc4, cache_link);
 
-		/* packed YCbCr */
-	case TBM_FORMAT_YUYV:
-	case TBM_FORMAT_YVYU:
-	case TBM_FORMAT_UYVY:
-	case TBM_FORMAT_VYUY:
-	case TBM_FORMAT_AYUV:
-		bpp = 32;
-		_offset = 0;
-		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-		_bo_idx = 0;
-		break;
+		prev = item->prev;
 
-		/*
-		* 2 plane YCbCr
-		* index 0 = Y plane, [7:0] Y
-		* index 1 = Cr:Cb plane, [15:0] Cr:Cb little endian
-		* or
-		* index 1 = Cb:Cr plane, [15:0] Cb:Cr little endian
-		*/
-	case TBM_FORMAT_NV12:
-		bpp = 12;
-		if (plane_idx == 0) {
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = MAX(_calc_yplane_nv12(width, height), _new_calc_yplane_nv12(width,
-					height));
-			_bo_idx = 0;
-		} else if (plane_idx == 1) {
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = MAX(_calc_uvplane_nv12(width, height), _new_calc_uvplane_nv12(width,
-					height));
-			_bo_idx = 1;
+		/* the label is changed on reuse */
+		if (bo_vc4->size < size ||
+		    (bo_vc4->flags_tbm & ~TBM_BO_VENDOR) != (flags & ~TBM_BO_VENDOR))
+			continue;
+
+		_bo_cache_unlink(bufmgr_vc4, bo_vc4);
+
+		/* an import took the bo back */
+		if (!__sync_bool_compare_and_swap(&bo_vc4->state, BO_STATE_CACHED,
+						  BO_STATE_LIVE))
+			continue;
+
+		/* the kernel may have purged the bo while it was cached */
+		if (bo_vc4->purgeable && _bo_madvise(bufmgr_vc4, bo_vc4, 1) != 1) {
+			VC4_STAT_ADD(bufmgr_vc4, cache_evictions, 1);
+			_bo_destroy(bufmgr_vc4, bo_vc4);
+			continue;
 		}
-		break;
-	case TBM_FORMAT_NV21:
-		bpp = 12;
-		if (plane_idx == 0) {
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-		} else if (plane_idx == 1) {
-			_offset = width * height;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = SIZE_ALIGN(_pitch * (height / 2), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
+
+		if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 0)) {
+			TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
+			_bo_destroy(bufmgr_vc4, bo_vc4);
+			return NULL;
 		}
-		break;
 
-	case TBM_FORMAT_NV16:
-	case TBM_FORMAT_NV61:
-		bpp = 16;
-		/*if(plane_idx == 0)*/
-		{
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 0)
-				break;
+		return bo_vc4;
+	}
+
+	return NULL;
+}
+
+static void
+_bo_cache_add(tbm_bufmgr_vc4 bufmgr_vc4, struct _vc4_bo_bucket *bucket,
+	      tbm_bo_vc4 bo_vc4, time_t time)
+{
+	/* the pBase, dmabuf and flink name stay alive while the bo is cached */
+	_bo_destroy_cache_state(bufmgr_vc4, bo_vc4);
+
+	memset(bo_vc4->dma_fence, 0, sizeof(bo_vc4->dma_fence));
+	bo_vc4->lock_cnt = 0;
+	bo_vc4->map_cnt = 0;
+	bo_vc4->last_map_device = -1;
+	bo_vc4->free_time = time;
+	bo_vc4->has_desc = 0;
+	bo_vc4->access = TBM_VC4_ACCESS_NONE;
+	bo_vc4->bo = NULL;
+
+	/* what get_handle gave out belonged to the freed tbm_bo */
+	bo_vc4->cpu_handle = 0;
+	bo_vc4->dmabuf_handle = 0;
+
+	_list_add_tail(&bo_vc4->cache_link, &bucket->head);
+
+	VC4_STAT_ADD(bufmgr_vc4, cache_count, 1);
+	VC4_STAT_ADD(bufmgr_vc4, cache_bytes, bo_vc4->size);
+
+	/* from now on an import may take it back */
+	__sync_lock_test_and_set(&bo_vc4->state, BO_STATE_CACHED);
+}
+
+static int
+_bo_cache_put(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	struct _vc4_bo_bucket *bucket;
+
+	if (!bufmgr_vc4->use_bo_cache || !bo_vc4->reusable)
+		return 0;
+
+	bucket = _bo_cache_bucket_for_size(bufmgr_vc4, bo_vc4->size);
+	if (!bucket || bucket->size != bo_vc4->size)
+		return 0;
+
+	/* let the kernel reclaim the pages while the bo is idle. the bos
+	 * created for the cache are not, they are about to be used.
+	 */
+	_bo_madvise(bufmgr_vc4, bo_vc4, 0);
+
+	_bo_cache_add(bufmgr_vc4, bucket, bo_vc4, _get_time());
+
+	return 1;
+}
+
+/* release the memory which is not in use: the bo cache, the dmabuf fds and
+ * the cpu mappings of the idle bos.
+ */
+static void
+_bufmgr_trim(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	vc4_list *item, *next;
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	_bo_cache_purge(bufmgr_vc4);
+
+	for (item = bufmgr_vc4->dmabuf_lru.next; item != &bufmgr_vc4->dmabuf_lru; item = next) {
+		tbm_bo_vc4 bo_vc4 = vc4_container_of(item, struct _tbm_bo_vc4, dmabuf_link);
+
+		next = item->next;
+
+		if (bo_vc4->lock_cnt || bo_vc4->map_cnt || bo_vc4->is_slab ||
+		    bo_vc4->dmabuf_handle)
+			continue;
+
+		_bo_close_dmabuf(bufmgr_vc4, bo_vc4);
+		VC4_STAT_ADD(bufmgr_vc4, dmabuf_evictions, 1);
+	}
+
+	for (item = bufmgr_vc4->map_lru.next; item != &bufmgr_vc4->map_lru; item = next) {
+		tbm_bo_vc4 bo_vc4 = vc4_container_of(item, struct _tbm_bo_vc4, map_link);
+
+		next = item->next;
+		_bo_map_evict(bufmgr_vc4, bo_vc4);
+	}
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	VC4_STAT_ADD(bufmgr_vc4, trims, 1);
+
+	TBM_VC4_DEBUG("alloc:%lu, import:%lu, map:%lu bytes\n",
+	    bufmgr_vc4->stats.alloc_bytes,
+	    bufmgr_vc4->stats.import_bytes,
+	    bufmgr_vc4->stats.map_bytes);
+}
+
+/* trim if the memory pressure monitor asked for it */
+static void
+_bufmgr_check_pressure(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	if (bufmgr_vc4->pressure &&
+	    __sync_bool_compare_and_swap(&bufmgr_vc4->pressure, 1, 0))
+		_bufmgr_trim(bufmgr_vc4);
+}
+
+/* account size bytes to the allocated ones before the bo is created, so
+ * that the concurrent allocations cannot pass the hard budget together.
+ * a failed creation gives them back with _bo_budget_release().
+ */
+static int
+_bo_budget_reserve(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size)
+{
+	unsigned long alloc;
+	int trimmed = 0;
+
+	if (!bufmgr_vc4->budget_hard) {
+		VC4_STAT_ADD(bufmgr_vc4, alloc_bytes, size);
+		return 1;
+	}
+
+	for (;;) {
+		alloc = bufmgr_vc4->stats.alloc_bytes;
+		if (alloc + size <= bufmgr_vc4->budget_hard) {
+			if (__sync_bool_compare_and_swap(&bufmgr_vc4->stats.alloc_bytes,
+							 alloc, alloc + size))
+				return 1;
+			continue;
 		}
-		/*else if( plane_idx ==1 )*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
+
+		if (trimmed)
+			break;
+
+		_bufmgr_trim(bufmgr_vc4);
+		trimmed = 1;
+	}
+
+	TBM_VC4_ERROR("over the memory budget(alloc:%lu, size:%d, hard:%lu)\n",
+		       alloc, size, bufmgr_vc4->budget_hard);
+
+	VC4_STAT_ADD(bufmgr_vc4, budget_failures, 1);
+	errno = ENOSPC;
+
+	return 0;
+}
+
+static void
+_bo_budget_release(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size)
+{
+	VC4_STAT_SUB(bufmgr_vc4, alloc_bytes, size);
+}
+
+static tbm_bo_vc4
+_bo_create(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size, int flags)
+{
+	struct drm_gem_close close_arg = {0, };
+	tbm_bo_vc4 bo_vc4;
+
+	if (!_bo_budget_reserve(bufmgr_vc4, size))
+		return NULL;
+
+	bo_vc4 = _bo_priv_alloc(bufmgr_vc4);
+	if (!bo_vc4) {
+		TBM_VC4_ERROR("fail to allocate the bo private\n");
+		_bo_budget_release(bufmgr_vc4, size);
+		return NULL;
+	}
+
+	struct drm_vc4_create_bo arg = {0, };
+	arg.flags = flags & ~TBM_BO_VENDOR;/*currently no values for the flags,but it may be used in future extension*/
+	arg.size = (__u32)size;
+	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_VC4_CREATE_BO, &arg)){
+		TBM_VC4_ERROR("Cannot create bo(flag:%x, size:%d)\n", arg.flags,
+			       (unsigned int)arg.size);
+		VC4_STAT_ADD(bufmgr_vc4, kernel_failures, 1);
+		_bo_priv_free(bufmgr_vc4, bo_vc4);
+		_bo_budget_release(bufmgr_vc4, size);
+		return NULL;
+	}
+
+	bo_vc4->fd = bufmgr_vc4->fd;
+	bo_vc4->gem = (unsigned int)arg.handle;
+	bo_vc4->size = size;
+	bo_vc4->flags_tbm = flags;
+	bo_vc4->reusable = 1;
+
+	if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 0)) {
+		TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
+		goto fail_close;
+	}
+
+	pthread_mutex_init(&bo_vc4->mutex, NULL);
+
+	/* add bo to hash, a new handle cannot be known yet */
+	if (_bo_register(bufmgr_vc4, bo_vc4) != bo_vc4) {
+		_bo_destroy_cache_state(bufmgr_vc4, bo_vc4);
+		goto fail_close;
+	}
+
+	/* keep under the soft budget by dropping the bo cache */
+	if (bufmgr_vc4->budget_soft &&
+	    bufmgr_vc4->stats.alloc_bytes > bufmgr_vc4->budget_soft)
+		_bo_cache_purge(bufmgr_vc4);
+
+	return bo_vc4;
+
+fail_close:
+	/* the handle was just created, no one else knows it */
+	close_arg.handle = bo_vc4->gem;
+	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_CLOSE, &close_arg))
+		TBM_VC4_ERROR("gem:%d fail to gem close.(%s)\n",
+			       bo_vc4->gem, strerror(errno));
+	_bo_priv_free(bufmgr_vc4, bo_vc4);
+	_bo_budget_release(bufmgr_vc4, size);
+
+	return NULL;
+}
+
+static int
+_slab_find_pages(struct _vc4_slab *slab, int pages)
+{
+	uint64_t mask = (pages == SLAB_PAGES) ? ~0ULL : ((1ULL << pages) - 1);
+	int i;
+
+	for (i = 0; i + pages <= SLAB_PAGES; i++) {
+		if (!(slab->used & (mask << i)))
+			return i;
+	}
+
+	return -1;
+}
+
+/* carve a small bo out of a slab which has the same flags */
+static tbm_bo_vc4
+_bo_slab_alloc(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size, int flags)
+{
+	struct _vc4_slab *slab = NULL;
+	tbm_bo_vc4 bo_vc4;
+	vc4_list *item;
+	int pages = size / TBM_VC4_PAGE_SIZE;
+	int first = -1;
+
+	for (item = bufmgr_vc4->slabs.next; item != &bufmgr_vc4->slabs; item = item->next) {
+		struct _vc4_slab *cur = vc4_container_of(item, struct _vc4_slab, link);
+
+		if ((cur->bo->flags_tbm & ~TBM_BO_VENDOR) != (flags & ~TBM_BO_VENDOR))
+			continue;
+
+		first = _slab_find_pages(cur, pages);
+		if (first >= 0) {
+			slab = cur;
+			break;
 		}
-		break;
+	}
+
+	if (!slab) {
+		slab = calloc(1, sizeof(struct _vc4_slab));
+		if (!slab) {
+			TBM_VC4_ERROR("fail to allocate the slab\n");
+			return NULL;
+		}
+
+		slab->bo = _bo_create(bufmgr_vc4, SLAB_SIZE, flags);
+		if (!slab->bo) {
+			free(slab);
+			return NULL;
+		}
+		slab->bo->reusable = 0;
+		slab->bo->is_slab = 1;
+
+		_list_add_tail(&slab->link, &bufmgr_vc4->slabs);
+		VC4_STAT_ADD(bufmgr_vc4, slab_count, 1);
+
+		first = 0;
+	}
+
+	bo_vc4 = _bo_priv_alloc(bufmgr_vc4);
+	if (!bo_vc4) {
+		TBM_VC4_ERROR("fail to allocate the bo private\n");
+		if (slab->count == 0) {
+			_list_del(&slab->link);
+			VC4_STAT_SUB(bufmgr_vc4, slab_count, 1);
+			_bo_destroy(bufmgr_vc4, slab->bo);
+			free(slab);
+		}
+		return NULL;
+	}
+
+	bo_vc4->fd = bufmgr_vc4->fd;
+	bo_vc4->gem = slab->bo->gem;
+	bo_vc4->size = size;
+	bo_vc4->flags_tbm = flags;
+	bo_vc4->slab = slab;
+	bo_vc4->offset = first * TBM_VC4_PAGE_SIZE;
+
+	pthread_mutex_init(&bo_vc4->mutex, NULL);
+
+	if (pages == SLAB_PAGES)
+		slab->used = ~0ULL;
+	else
+		slab->used |= ((1ULL << pages) - 1) << first;
+	slab->count++;
+
+	VC4_STAT_ADD(bufmgr_vc4, slab_bos, 1);
+
+	return bo_vc4;
+}
+
+/* give the pages back to the slab and release the slab with its last bo */
+static void
+_bo_slab_free(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	struct _vc4_slab *slab = bo_vc4->slab;
+	int pages = bo_vc4->size / TBM_VC4_PAGE_SIZE;
+	int first = bo_vc4->offset / TBM_VC4_PAGE_SIZE;
+
+	if (pages == SLAB_PAGES)
+		slab->used = 0;
+	else
+		slab->used &= ~(((1ULL << pages) - 1) << first);
+	slab->count--;
+
+	VC4_STAT_SUB(bufmgr_vc4, slab_bos, 1);
+
+	_bo_priv_free(bufmgr_vc4, bo_vc4);
+
+	if (slab->count > 0)
+		return;
+
+	_list_del(&slab->link);
+	VC4_STAT_SUB(bufmgr_vc4, slab_count, 1);
+
+	_bo_destroy(bufmgr_vc4, slab->bo);
+	free(slab);
+}
+
+/* tag the bo with its label for the kernel and count it under the label */
+static void
+_bo_label_add(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int label)
+{
+	if (label < 0 || label >= TBM_VC4_LABEL_MAX)
+		label = TBM_VC4_LABEL_NONE;
+
+#ifdef DRM_IOCTL_VC4_LABEL_BO
+	/* the label of a slab bo would be the label of the whole slab */
+	if (bufmgr_vc4->use_label && label != bo_vc4->label && !bo_vc4->slab) {
+		struct drm_vc4_label_bo arg = {0, };
+
+		arg.handle = bo_vc4->gem;
+		arg.len = strlen(STR_LABEL[label]);
+		arg.name = (uintptr_t)STR_LABEL[label];
+		if (drmIoctl(bo_vc4->fd, DRM_IOCTL_VC4_LABEL_BO, &arg)) {
+			if (errno == EINVAL || errno == ENOTTY) {
+				TBM_VC4_DEBUG("label is not supported(%s)\n", strerror(errno));
+				bufmgr_vc4->use_label = 0;
+			} else {
+				TBM_VC4_ERROR("fail to label gem:%d as %s(%s)\n",
+					       bo_vc4->gem, STR_LABEL[label], strerror(errno));
+			}
+		}
+	}
+#endif
+
+	bo_vc4->label = label;
+
+	/* atomic, an import takes a cached bo back without the bufmgr lock */
+	__sync_fetch_and_add(&bufmgr_vc4->label_stats[label].count, 1);
+	__sync_fetch_and_add(&bufmgr_vc4->label_stats[label].bytes, bo_vc4->size);
+}
+
+static void
+_bo_label_del(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	__sync_fetch_and_sub(&bufmgr_vc4->label_stats[bo_vc4->label].count, 1);
+	__sync_fetch_and_sub(&bufmgr_vc4->label_stats[bo_vc4->label].bytes, bo_vc4->size);
+}
+
+/* create and prefault the prewarm bos. the thread only does the kernel
+ * work, the bos are registered and cached by the thread of the next alloc.
+ */
+static void *
+_bo_prewarm_thread(void *data)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4 = (tbm_bufmgr_vc4)data;
+	unsigned long mapped = 0;
+	int i;
+
+	for (i = 0; i < bufmgr_vc4->prewarm_count; i++) {
+		tbm_bo_vc4 bo_vc4 = bufmgr_vc4->prewarm_bos[i];
+		struct drm_vc4_create_bo arg = {0, };
+		struct drm_vc4_mmap_bo map_arg = {0, };
+		void *map;
+
+		if (bufmgr_vc4->prewarm_stop)
+			break;
+
+		arg.flags = bo_vc4->flags_tbm & ~TBM_BO_VENDOR;
+		arg.size = (__u32)bo_vc4->size;
+		if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_VC4_CREATE_BO, &arg)) {
+			TBM_VC4_ERROR("Cannot create bo(flag:%x, size:%d)\n", arg.flags,
+				       (unsigned int)arg.size);
+			__sync_fetch_and_add(&bufmgr_vc4->prewarm_ready, 1);
+			continue;
+		}
+		bo_vc4->gem = (unsigned int)arg.handle;
+
+		/* the mappings are charged to TBM_VC4_MAP_BUDGET when collected,
+		 * the ones over it would be unmapped right away.
+		 */
+		if (bufmgr_vc4->map_budget &&
+		    mapped + bo_vc4->size > bufmgr_vc4->map_budget) {
+			__sync_fetch_and_add(&bufmgr_vc4->prewarm_ready, 1);
+			continue;
+		}
+
+		map_arg.handle = bo_vc4->gem;
+		if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_VC4_MMAP_BO, &map_arg) == 0) {
+			map = mmap(NULL, bo_vc4->size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, bufmgr_vc4->fd, map_arg.offset);
+			if (map != MAP_FAILED) {
+				bo_vc4->pBase = map;
+				mapped += bo_vc4->size;
+			}
+		}
+
+		__sync_fetch_and_add(&bufmgr_vc4->prewarm_ready, 1);
+	}
+
+	return NULL;
+}
+
+/* move the bos the prewarm thread is done with to the bo cache. they stay
+ * WILLNEED until they are handed out, the kernel would purge them first.
+ */
+static void
+_bo_prewarm_collect(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	time_t time;
+	int ready;
+
+	ready = __sync_fetch_and_add(&bufmgr_vc4->prewarm_ready, 0);
+	if (bufmgr_vc4->prewarm_taken == ready)
+		return;
+
+	/* keep them longer than the freed bos, they are for the first frames */
+	time = _get_time() + PREWARM_HOLD;
+
+	while (bufmgr_vc4->prewarm_taken < ready) {
+		tbm_bo_vc4 bo_vc4 = bufmgr_vc4->prewarm_bos[bufmgr_vc4->prewarm_taken++];
+
+		if (!bo_vc4->gem) {
+			_bo_priv_free(bufmgr_vc4, bo_vc4);
+			continue;
+		}
+
+		pthread_mutex_init(&bo_vc4->mutex, NULL);
+
+		/* accounted first, so that _bo_destroy unwinds all of it */
+		VC4_STAT_ADD(bufmgr_vc4, alloc_bytes, bo_vc4->size);
+		if (bo_vc4->pBase) {
+			_list_add_tail(&bo_vc4->map_link, &bufmgr_vc4->map_lru);
+			VC4_STAT_ADD(bufmgr_vc4, map_bytes, bo_vc4->size);
+		}
+
+		if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 0) ||
+		    _bo_register(bufmgr_vc4, bo_vc4) != bo_vc4) {
+			TBM_VC4_ERROR("fail to register the prewarm bo(gem:%d)\n",
+				       bo_vc4->gem);
+			_bo_destroy(bufmgr_vc4, bo_vc4);
+			continue;
+		}
+
+		VC4_STAT_ADD(bufmgr_vc4, prewarmed, 1);
+
+		_bo_cache_add(bufmgr_vc4,
+			      _bo_cache_bucket_for_size(bufmgr_vc4, bo_vc4->size),
+			      bo_vc4, time);
+	}
+
+	if (bufmgr_vc4->map_budget &&
+	    bufmgr_vc4->stats.map_bytes > bufmgr_vc4->map_budget)
+		_bo_map_trim(bufmgr_vc4, 0);
+}
+
+static void
+_bo_prewarm_add(tbm_bufmgr_vc4 bufmgr_vc4, unsigned int size, int flags, int count)
+{
+	struct _vc4_bo_bucket *bucket;
+	int i;
+
+	size = SIZE_ALIGN(size, TBM_VC4_PAGE_SIZE);
+
+	/* the small bos come from the slabs */
+	if (size < bufmgr_vc4->slab_threshold)
+		return;
+
+	bucket = _bo_cache_bucket_for_size(bufmgr_vc4, size);
+	if (!bucket) {
+		TBM_VC4_ERROR("cannot prewarm the bo of size:%d\n", size);
+		return;
+	}
+
+	for (i = 0; i < count && bufmgr_vc4->prewarm_count < PREWARM_MAX; i++) {
+		tbm_bo_vc4 bo_vc4 = _bo_priv_alloc(bufmgr_vc4);
+
+		if (!bo_vc4)
+			return;
+
+		bo_vc4->fd = bufmgr_vc4->fd;
+		bo_vc4->size = bucket->size;
+		bo_vc4->flags_tbm = flags;
+		bo_vc4->reusable = 1;
+
+		bufmgr_vc4->prewarm_bos[bufmgr_vc4->prewarm_count++] = bo_vc4;
+	}
+}
+
+/* the spec is a list of [count:]size[@flags] separated by commas or new
+ * lines. the size is in bytes with an optional K, M or G suffix, or is
+ * WIDTHxHEIGHT of ARGB8888. a spec starting with @ is the path of a file
+ * holding the spec, where the lines starting with # are skipped.
+ */
+static void
+_bo_prewarm_parse(tbm_bufmgr_vc4 bufmgr_vc4, const char *spec)
+{
+	char buf[PREWARM_SPEC_MAX];
+	char *entry, *save = NULL;
+
+	if (spec[0] == '@') {
+		int fp;
+		int len;
+
+		fp = open(spec + 1, O_RDONLY | O_CLOEXEC);
+		if (fp < 0) {
+			TBM_VC4_ERROR("fail to open %s(%s)\n", spec + 1, strerror(errno));
+			return;
+		}
+
+		len = read(fp, buf, sizeof(buf) - 1);
+		close(fp);
+		if (len < 0) {
+			TBM_VC4_ERROR("fail to read %s(%s)\n", spec + 1, strerror(errno));
+			return;
+		}
+		buf[len] = '\0';
+	} else {
+		snprintf(buf, sizeof(buf), "%s", spec);
+	}
+
+	for (entry = strtok_r(buf, ",\n", &save); entry;
+	     entry = strtok_r(NULL, ",\n", &save)) {
+		unsigned long count = 1, size;
+		int flags = TBM_BO_DEFAULT;
+		char *str = entry, *end;
+
+		while (*str == ' ' || *str == '\t')
+			str++;
+
+		if (*str == '\0' || *str == '#')
+			continue;
+
+		end = strchr(str, ':');
+		if (end) {
+			count = strtoul(str, NULL, 10);
+			str = end + 1;
+		}
+
+		end = strchr(str, '@');
+		if (end)
+			flags = atoi(end + 1);
+
+		end = strchr(str, 'x');
+		if (end)
+			size = strtoul(str, NULL, 10) * strtoul(end + 1, NULL, 10) * 4;
+		else
+			size = _parse_size(str);
+
+		if (!size || !count) {
+			TBM_VC4_ERROR("invalid prewarm entry:%s\n", entry);
+			continue;
+		}
+
+		_bo_prewarm_add(bufmgr_vc4, (unsigned int)size, flags, (int)count);
+	}
+}
+
+static void
+_bo_prewarm_init(tbm_bufmgr_vc4 bufmgr_vc4, const char *spec)
+{
+	if (!bufmgr_vc4->use_bo_cache) {
+		TBM_VC4_ERROR("the bo cache is disabled, no prewarm\n");
+		return;
+	}
+
+	bufmgr_vc4->prewarm_bos = calloc(PREWARM_MAX, sizeof(tbm_bo_vc4));
+	if (!bufmgr_vc4->prewarm_bos) {
+		TBM_VC4_ERROR("fail to allocate the prewarm bos\n");
+		return;
+	}
+
+	_bo_prewarm_parse(bufmgr_vc4, spec);
+
+	if (bufmgr_vc4->prewarm_count &&
+	    pthread_create(&bufmgr_vc4->prewarm_thread, NULL,
+			   _bo_prewarm_thread, bufmgr_vc4) == 0)
+		return;
+
+	TBM_VC4_ERROR("no prewarm(%d bos)\n", bufmgr_vc4->prewarm_count);
+
+	while (bufmgr_vc4->prewarm_count > 0)
+		_bo_priv_free(bufmgr_vc4,
+			      bufmgr_vc4->prewarm_bos[--bufmgr_vc4->prewarm_count]);
+
+	free(bufmgr_vc4->prewarm_bos);
+	bufmgr_vc4->prewarm_bos = NULL;
+}
+
+static void
+_bo_prewarm_fini(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	int i;
+
+	if (!bufmgr_vc4->prewarm_bos)
+		return;
+
+	bufmgr_vc4->prewarm_stop = 1;
+	pthread_join(bufmgr_vc4->prewarm_thread, NULL);
+
+	_bo_prewarm_collect(bufmgr_vc4);
+
+	/* the bos the thread did not get to */
+	for (i = bufmgr_vc4->prewarm_taken; i < bufmgr_vc4->prewarm_count; i++)
+		_bo_priv_free(bufmgr_vc4, bufmgr_vc4->prewarm_bos[i]);
+
+	free(bufmgr_vc4->prewarm_bos);
+	bufmgr_vc4->prewarm_bos = NULL;
+}
+
+/* called with the bufmgr lock held */
+static tbm_bo_vc4
+_bo_alloc(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo bo, int size, int flags)
+{
+	tbm_bo_vc4 bo_vc4;
+	struct _vc4_bo_bucket *bucket;
+	unsigned int alloc_size;
+
+	if (bufmgr_vc4->prewarm_bos)
+		_bo_prewarm_collect(bufmgr_vc4);
+
+	alloc_size = SIZE_ALIGN((unsigned int)size, TBM_VC4_PAGE_SIZE);
+
+	if (alloc_size < bufmgr_vc4->slab_threshold) {
+		bo_vc4 = _bo_slab_alloc(bufmgr_vc4, alloc_size, flags);
+		if (bo_vc4) {
+			_bo_label_add(bufmgr_vc4, bo_vc4, TBM_VC4_BO_LABEL_GET(flags));
+
+			TBM_VC4_DEBUG("     bo:%p, gem:%d(%d), flags:%d, size:%d, offset:%d (slab)\n",
+			    bo,
+			    bo_vc4->gem, bo_vc4->name,
+			    flags,
+			    bo_vc4->size,
+			    bo_vc4->offset);
+
+			return (void *)bo_vc4;
+		}
+	}
+
+	bucket = _bo_cache_bucket_for_size(bufmgr_vc4, alloc_size);
+	if (bucket) {
+		bo_vc4 = _bo_cache_get(bufmgr_vc4, bucket, alloc_size, flags);
+		if (bo_vc4) {
+			VC4_STAT_ADD(bufmgr_vc4, cache_hits, 1);
+
+			bo_vc4->flags_tbm = flags;
+			_bo_label_add(bufmgr_vc4, bo_vc4, TBM_VC4_BO_LABEL_GET(flags));
+
+			TBM_VC4_DEBUG("     bo:%p, gem:%d(%d), flags:%d, size:%d (cached)\n",
+			    bo,
+			    bo_vc4->gem, bo_vc4->name,
+			    flags,
+			    bo_vc4->size);
+
+			return (void *)bo_vc4;
+		}
+
+		/* allocate the bucket size so that the bo can be cached later */
+		if (bufmgr_vc4->use_bo_cache)
+			alloc_size = bucket->size;
+	}
+
+	VC4_STAT_ADD(bufmgr_vc4, cache_misses, 1);
+
+	bo_vc4 = _bo_create(bufmgr_vc4, alloc_size, flags);
+	if (!bo_vc4)
+		return 0;
+
+	_bo_label_add(bufmgr_vc4, bo_vc4, TBM_VC4_BO_LABEL_GET(flags));
+
+	TBM_VC4_DEBUG("     bo:%p, gem:%d(%d), flags:%d, size:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    flags,
+	    bo_vc4->size);
+
+	if (bufmgr_vc4->use_bo_cache)
+		_bo_cache_cleanup(bufmgr_vc4, _get_time());
+
+	return bo_vc4;
+}
+
+static void *
+tbm_vc4_bo_alloc(tbm_bo bo, int size, int flags)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	_bufmgr_check_pressure(bufmgr_vc4);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	bo_vc4 = _bo_alloc(bufmgr_vc4, bo, size, flags);
+	if (bo_vc4) {
+		bo_vc4->bo = bo;
+		bo_vc4->refs = 1;
+	}
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return (void *)bo_vc4;
+}
+
+/* drop a ref of the bo, the last one caches or destroys it */
+static void
+_bo_unref(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	/* an import returning the bo meanwhile takes it over */
+	if (__sync_sub_and_fetch(&bo_vc4->refs, 1) > 0)
+		return;
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	/* the imports of the bo wait until it is cached or destroyed */
+	__sync_lock_test_and_set(&bo_vc4->state, BO_STATE_DYING);
+
+	if (!bo_vc4->imported)
+		_bo_label_del(bufmgr_vc4, bo_vc4);
+
+	/* the windows left mapped go with the bo */
+	while (!_list_empty(&bo_vc4->ranges))
+		_bo_range_release(bufmgr_vc4,
+				  vc4_container_of(bo_vc4->ranges.next, vc4_bo_range, link));
+	bo_vc4->win_size = 0;
+
+	if (!_bo_cache_put(bufmgr_vc4, bo_vc4))
+		_bo_destroy(bufmgr_vc4, bo_vc4);
+
+	if (bufmgr_vc4->use_bo_cache)
+		_bo_cache_cleanup(bufmgr_vc4, _get_time());
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	_bufmgr_check_pressure(bufmgr_vc4);
+}
+
+static void
+tbm_vc4_bo_free(tbm_bo bo)
+{
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	if (!bo)
+		return;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_IF_FAIL(bufmgr_vc4 != NULL);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_IF_FAIL(bo_vc4 != NULL);
+
+	TBM_VC4_DEBUG("      bo:%p, gem:%d(%d), fd:%d, size:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    bo_vc4->size);
+
+	_bo_unref(bufmgr_vc4, bo_vc4);
+}
+
+/* the bo_import and bo_import_fd of the backend of libtbm
+ * (TBM_ABI_VERSION 1) take only the key or the fd. the imports of
+ * tbm_bufmgr_vc4.h which need more pass it in the thread locals below,
+ * and rely on tbm_bo_import() and tbm_bo_import_fd() calling the backend
+ * in the calling thread before they return. each is set just around that
+ * call by a thread which has none set, see _bo_import_busy(), and the
+ * single ones are taken by the backend so that no other import sees them.
+ */
+
+/* the imports of tbm_vc4_bo_import_fds() share the bo privates taken in
+ * one go, and the fstat of the fds.
+ */
+struct _vc4_import_batch {
+	vc4_list privs;       /* free bo privates of the batch */
+	int want;             /* privates to take at once on the first miss */
+	struct stat *st;      /* stat of the fd being imported, NULL if unknown */
+};
+
+static __thread struct _vc4_import_batch *import_batch;
+
+static tbm_bo_vc4
+_bo_import_priv_alloc(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	tbm_bo_vc4 bo_vc4;
+
+	if (import_batch) {
+		/* the known dmabufs need none, the new ones take them together */
+		if (_list_empty(&import_batch->privs) && import_batch->want > 0) {
+			pthread_mutex_lock(&bufmgr_vc4->lock);
+			for (; import_batch->want > 0; import_batch->want--) {
+				bo_vc4 = _bo_priv_alloc(bufmgr_vc4);
+				if (!bo_vc4)
+					break;
+				_list_add_tail(&bo_vc4->cache_link, &import_batch->privs);
+			}
+			pthread_mutex_unlock(&bufmgr_vc4->lock);
+		}
+
+		if (!_list_empty(&import_batch->privs))
+			return _bo_priv_take(&import_batch->privs);
+	}
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	bo_vc4 = _bo_priv_alloc(bufmgr_vc4);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return bo_vc4;
+}
+
+static void
+_bo_import_priv_free(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4)
+{
+	if (import_batch) {
+		_list_add_tail(&bo_vc4->cache_link, &import_batch->privs);
+		return;
+	}
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	_bo_priv_free(bufmgr_vc4, bo_vc4);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+}
+
+/* set by tbm_vc4_bufmgr_get_bo(), which imports a live bo by its handle
+ * through tbm_bo_import() to get its tbm_bo with a reference.
+ */
+static __thread int import_handle;
+
+static void *
+tbm_vc4_bo_import(tbm_bo bo, unsigned int key)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 bo_vc4, found, priv = NULL;
+	int by_handle = import_handle;
+	int raced = 0;
+	int ret;
+
+	import_handle = 0;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	if (by_handle) {
+		if (_registry_lookup_ref(&bufmgr_vc4->bos, key, _bo_ref_live,
+					 (void **)&bo_vc4) <= 0)
+			return NULL;
+
+		_bo_lookup_done(bo_vc4, bo);
+		return (void *)bo_vc4;
+	}
+
+retry:
+	pthread_rwlock_rdlock(&bufmgr_vc4->handle_lock);
+
+	ret = _bo_lookup_import(bufmgr_vc4, &bufmgr_vc4->names, key, bo, &found);
+	if (ret) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		if (ret < 0) {
+			sched_yield();
+			goto retry;
+		}
+		bo_vc4 = found;
+		goto done;
+	}
+
+	/* the key of a render node bo is only known to its process */
+	if (bufmgr_vc4->render_node) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		TBM_VC4_ERROR("Cannot import key=%d on a render node, use the fd\n", key);
+		bo_vc4 = NULL;
+		goto done;
+	}
+
+	/* the bo privates are allocated under the bufmgr lock, which is
+	 * taken before handle_lock.
+	 */
+	if (!priv) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		priv = _bo_import_priv_alloc(bufmgr_vc4);
+		if (!priv) {
+			TBM_VC4_ERROR("fail to allocate the bo private\n");
+			return 0;
+		}
+		goto retry;
+	}
+
+	struct drm_gem_open arg = {0, };
+
+	arg.name = key;
+	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_OPEN, &arg)) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		TBM_VC4_ERROR("Cannot open gem name=%d\n", key);
+		bo_vc4 = NULL;
+		goto done;
+	}
+
+	bo_vc4 = priv;
+	bo_vc4->fd = bufmgr_vc4->fd;
+	bo_vc4->gem = arg.handle;
+	bo_vc4->size = arg.size;
+	bo_vc4->name = key;
+	bo_vc4->flags_tbm = 0;
+	bo_vc4->imported = 1;
+	bo_vc4->bo = bo;
+	bo_vc4->refs = 1;
+
+	if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 1)) {
+		TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
+		bo_vc4 = NULL;
+		goto fail_close;
+	}
+
+	/* add bo to hash */
+	if (!_bo_register(bufmgr_vc4, bo_vc4)) {
+		bo_vc4 = NULL;
+		goto fail_close;
+	}
+
+	/* a concurrent import of the same name came first, its bo is looked
+	 * up again.
+	 */
+	if (_registry_lookup(&bufmgr_vc4->names, key) != bo_vc4) {
+		_bo_unregister(bufmgr_vc4, bo_vc4);
+		bo_vc4 = NULL;
+		raced = 1;
+		goto fail_close;
+	}
+
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+
+	priv = NULL;
+	VC4_STAT_ADD(bufmgr_vc4, import_bytes, bo_vc4->size);
+
+	TBM_VC4_DEBUG("    bo:%p, gem:%d(%d), fd:%d, flags:%d, size:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    bo_vc4->flags_tbm,
+	    bo_vc4->size);
+
+	return (void *)bo_vc4;
+
+fail_close:
+	{
+		/* the handle was just opened, no one else knows it */
+		struct drm_gem_close close_arg = {0, };
+
+		close_arg.handle = arg.handle;
+		drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+	}
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+	if (raced) {
+		raced = 0;
+		goto retry;
+	}
+done:
+	if (priv)
+		_bo_import_priv_free(bufmgr_vc4, priv);
+
+	if (bo_vc4 && bo_vc4 == found)
+		_bo_lookup_done(bo_vc4, bo);
+
+	return (void *)bo_vc4;
+}
+
+/* the descriptor of tbm_vc4_bo_import_fd_desc(), which imports through
+ * tbm_bo_import_fd().
+ */
+static __thread const tbm_vc4_bo_desc *import_desc;
+
+/* an import of tbm_bufmgr_vc4.h started while another one of the thread
+ * is still in libtbm, from a signal handler or a hook, would pass on the
+ * side-band of the other one
+ */
+static int
+_bo_import_busy(void)
+{
+	if (!import_batch && !import_handle && !import_desc)
+		return 0;
+
+	TBM_VC4_ERROR("an import of the thread is in progress(batch:%p, handle:%d, desc:%p)\n",
+		       import_batch, import_handle, import_desc);
+
+	return 1;
+}
+
+/* the rows of a plane of a surface of height rows, at least one */
+static unsigned int
+_bo_desc_rows(const tbm_vc4_bo_desc *desc, int plane)
+{
+	unsigned int rows = desc->height;
+
+	if (plane > 0) {
+		switch (desc->format) {
+		case TBM_FORMAT_NV12:
+		case TBM_FORMAT_NV21:
+		case TBM_FORMAT_YUV420:
+		case TBM_FORMAT_YVU420:
+			rows = (rows + 1) / 2;
+			break;
+		case TBM_FORMAT_YUV410:
+		case TBM_FORMAT_YVU410:
+			rows = (rows + 3) / 4;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return rows ? rows : 1;
+}
+
+/* check a descriptor against the size of the bo, 0 if it is not known */
+static int
+_bo_desc_check(const tbm_vc4_bo_desc *desc, unsigned int size)
+{
+	int i;
+
+	if (!desc->size || (size && desc->size > size))
+		return 0;
+
+	if (desc->num_planes < 1 || desc->num_planes > TBM_VC4_PLANE_MAX)
+		return 0;
+
+	for (i = 0; i < desc->num_planes; i++) {
+		uint64_t end = (uint64_t)desc->pitches[i] * _bo_desc_rows(desc, i);
+
+		if (desc->offsets[i] >= desc->size ||
+		    desc->offsets[i] + end > desc->size)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+_bo_set_desc(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4,
+	     const tbm_vc4_bo_desc *desc)
+{
+	if (!_bo_desc_check(desc, bo_vc4->size))
+		return 0;
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	bo_vc4->desc = *desc;
+	bo_vc4->has_desc = 1;
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return 1;
+}
+
+static void *
+tbm_vc4_bo_import_fd(tbm_bo bo, tbm_fd key)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 bo_vc4 = NULL, found = NULL, registered, priv = NULL;
+	const tbm_vc4_bo_desc *desc = import_desc;
+	unsigned int gem = 0;
+	unsigned int name;
+	struct stat st;
+	int has_st;
+	int ret;
+
+	import_desc = NULL;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	VC4_STAT_ADD(bufmgr_vc4, import_calls, 1);
+
+	if (import_batch && import_batch->st) {
+		st = *import_batch->st;
+		import_batch->st = NULL;
+		has_st = 1;
+	} else {
+		VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+		has_st = (fstat(key, &st) == 0);
+	}
+
+retry:
+	pthread_rwlock_rdlock(&bufmgr_vc4->handle_lock);
+
+	/* a known dmabuf is found by its inode without the kernel */
+	if (has_st && bufmgr_vc4->use_inode > 0 && st.st_dev == bufmgr_vc4->dmabuf_dev) {
+		ret = _bo_lookup_import(bufmgr_vc4, &bufmgr_vc4->inodes, st.st_ino, bo, &found);
+		if (ret) {
+			pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+			if (ret < 0) {
+				sched_yield();
+				goto retry;
+			}
+			VC4_STAT_ADD(bufmgr_vc4, import_fast, 1);
+			bo_vc4 = found;
+			goto done;
+		}
+	}
+
+	/* the bo privates are allocated under the bufmgr lock, which is
+	 * taken before handle_lock.
+	 */
+	if (!priv) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		priv = _bo_import_priv_alloc(bufmgr_vc4);
+		if (!priv) {
+			TBM_VC4_ERROR("bo:%p fail to allocate the bo private\n", bo);
+			return 0;
+		}
+		goto retry;
+	}
+
+	/*getting handle from fd*/
+	struct drm_prime_handle arg = {0, };
+
+	gem = 0;
+
+	arg.fd = key;
+	arg.flags = 0;
+	VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+	if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &arg)) {
+		TBM_VC4_ERROR("bo:%p Cannot get gem handle from fd:%d (%s)\n",
+			       bo, arg.fd, strerror(errno));
+		goto fail;
+	}
+	gem = arg.handle;
+
+	/* the prime handle of a known object is the handle we already have */
+	ret = _bo_lookup_import(bufmgr_vc4, &bufmgr_vc4->bos, gem, bo, &found);
+	if (ret) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		if (ret < 0) {
+			sched_yield();
+			goto retry;
+		}
+		bo_vc4 = found;
+		if (has_st)
+			_bo_set_inode(bufmgr_vc4, bo_vc4, &st);
+		goto done;
+	}
+
+	/* the name is made on export, see _bo_get_name() */
+	name = 0;
+
+	unsigned int real_size = -1;
+	//struct drm_vc4_gem_info info = {0, };
+
+	/* Determine size of bo.  The fd-to-handle ioctl really should
+	 * return the size, but it doesn't.  If we have kernel 3.12 or
+	 * later, we can lseek on the prime fd to get the size.  Older
+	 * kernels will just fail, in which case we fall back to the
+	 * provided (estimated or guess size).
+	 */
+	VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+	real_size = lseek(key, 0, SEEK_END);
+
+	/* the default llseek of the older kernels gives 0, the inode size */
+	if (real_size == 0)
+		real_size = -1;
+
+	/*info.handle = gem;
+	if (drmCommandWriteRead(bufmgr_vc4->fd,
+				DRM_VC4_GEM_GET,
+				&info,
+				sizeof(struct drm_vc4_gem_info))) {
+		TBM_VC4_ERROR("bo:%p Cannot get gem info from gem:%d, fd:%d (%s)\n",
+			       bo, gem, key, strerror(errno));
+		return 0;
+	}*/
+
+	/* the bo uses the prime handle only. on a kernel which cannot lseek a
+	 * dmabuf the size comes from a GEM_OPEN by name, and the handle it
+	 * makes is closed right away. GEM_FLINK is not allowed on a render
+	 * node, and a descriptor gives the size.
+	 */
+	if (real_size == -1 && !bufmgr_vc4->render_node && !desc) {
+		struct drm_gem_open open_arg = {0, };
+		struct drm_gem_close close_arg = {0, };
+
+		VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+		name = _get_name(bufmgr_vc4->fd, gem);
+		if (!name) {
+			TBM_VC4_ERROR("bo:%p Cannot get name from gem:%d, fd:%d (%s)\n",
+				       bo, gem, key, strerror(errno));
+			goto fail;
+		}
+
+		open_arg.name = name;
+		VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+		if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_OPEN, &open_arg)) {
+			TBM_VC4_ERROR("Cannot open gem name=%d\n", name);
+			goto fail;
+		}
+
+		real_size = open_arg.size;
+
+		close_arg.handle = open_arg.handle;
+		VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+		if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_CLOSE, &close_arg)) {
+			TBM_VC4_ERROR("gem:%d fail to gem close.(%s)\n",
+				       open_arg.handle, strerror(errno));
+		}
+	}
+
+	/* the size given by the exporter is checked once, here */
+	if (desc) {
+		if (!_bo_desc_check(desc, real_size == -1 ? 0 : real_size)) {
+			TBM_VC4_ERROR("bo:%p invalid desc of fd:%d (size:%d, real_size:%d)\n",
+				       bo, key, desc->size, real_size);
+			goto fail;
+		}
+
+		if (real_size == -1)
+			real_size = desc->size;
+	}
+
+	if (real_size == -1) {
+		TBM_VC4_ERROR("bo:%p Cannot get the size of fd:%d (%s)\n",
+			       bo, key, strerror(errno));
+		goto fail;
+	}
+
+	bo_vc4 = priv;
+	bo_vc4->fd = bufmgr_vc4->fd;
+	bo_vc4->gem = gem;
+	bo_vc4->size = real_size;
+	bo_vc4->flags_tbm = 0;
+	bo_vc4->name = name;
+	bo_vc4->imported = 1;
+	bo_vc4->bo = bo;
+	bo_vc4->refs = 1;
+
+	if (desc) {
+		bo_vc4->desc = *desc;
+		bo_vc4->has_desc = 1;
+	}
+
+	if (!_bo_init_cache_state(bufmgr_vc4, bo_vc4, 1)) {
+		TBM_VC4_ERROR("fail init cache state(%d)\n", bo_vc4->name);
+		bo_vc4 = NULL;
+		goto fail;
+	}
+
+	/* add bo to hash. a concurrent import of the same object got the
+	 * same prime handle, its bo is looked up again if it came first.
+	 */
+	registered = _bo_register(bufmgr_vc4, bo_vc4);
+	if (!registered) {
+		bo_vc4 = NULL;
+		goto fail;
+	}
+	if (registered != bo_vc4) {
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		bo_vc4 = NULL;
+		goto retry;
+	}
+
+	if (has_st)
+		_bo_set_inode(bufmgr_vc4, bo_vc4, &st);
+
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+
+	priv = NULL;
+	VC4_STAT_ADD(bufmgr_vc4, import_bytes, bo_vc4->size);
+
+	TBM_VC4_DEBUG(" bo:%p, gem:%d(%d), fd:%d, key_fd:%d, flags:%d, size:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    key,
+	    bo_vc4->flags_tbm,
+	    bo_vc4->size);
+
+	return (void *)bo_vc4;
+
+fail:
+	/* the prime handle is closed unless a concurrent import of the same
+	 * dmabuf registered a bo on it in the meantime
+	 */
+	if (gem && !_registry_lookup(&bufmgr_vc4->bos, gem)) {
+		struct drm_gem_close close_arg = {0, };
+
+		close_arg.handle = gem;
+		if (drmIoctl(bufmgr_vc4->fd, DRM_IOCTL_GEM_CLOSE, &close_arg))
+			TBM_VC4_ERROR("gem:%d fail to gem close.(%s)\n",
+				       gem, strerror(errno));
+	}
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+done:
+	if (priv)
+		_bo_import_priv_free(bufmgr_vc4, priv);
+
+	if (!bo_vc4)
+		return NULL;
+
+	/* a known bo takes the new layout without the kernel */
+	if (desc && !_bo_set_desc(bufmgr_vc4, bo_vc4, desc)) {
+		TBM_VC4_ERROR("bo:%p invalid desc of fd:%d (size:%d, bo size:%d)\n",
+			       bo, key, desc->size, bo_vc4->size);
+		_bo_unref(bufmgr_vc4, bo_vc4);
+		return NULL;
+	}
+
+	_bo_lookup_done(bo_vc4, bo);
+
+	return (void *)bo_vc4;
+}
+
+static unsigned int
+tbm_vc4_bo_export(tbm_bo bo)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	/* a name would give access to the whole slab */
+	if (bo_vc4->slab) {
+		TBM_VC4_ERROR("Cannot export the bo of a slab(gem:%d)\n", bo_vc4->gem);
+		return 0;
+	}
+
+	if (!_bo_get_name(bufmgr_vc4, bo_vc4)) {
+		TBM_VC4_ERROR("Cannot get name\n");
+		return 0;
+	}
+
+	/* the name can be used by others, so the bo cannot be reused */
+	bo_vc4->reusable = 0;
+
+	TBM_VC4_DEBUG("    bo:%p, gem:%d(%d), fd:%d, flags:%d, size:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    bo_vc4->flags_tbm,
+	    bo_vc4->size);
+
+	return (unsigned int)bo_vc4->name;
+}
+
+/* export a dmabuf fd of the bo from its cached dmabuf. the fd is a dup of
+ * the cached one, or the cached one itself if transfer is set.
+ */
+static tbm_fd
+_bo_export_fd(tbm_bufmgr_vc4 bufmgr_vc4, tbm_bo_vc4 bo_vc4, int transfer)
+{
+	tbm_fd fd;
+
+	/* a dmabuf would give access to the whole slab */
+	if (bo_vc4->slab) {
+		TBM_VC4_ERROR("Cannot export the bo of a slab(gem:%d)\n", bo_vc4->gem);
+		return -1;
+	}
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	if (!_bo_open_dmabuf(bufmgr_vc4, bo_vc4)) {
+		pthread_mutex_unlock(&bufmgr_vc4->lock);
+		TBM_VC4_ERROR("Cannot dmabuf=%d (%s)\n", bo_vc4->gem, strerror(errno));
+		return -1;
+	}
+
+	/* the fd of a locked or mapped bo is still in use, and so is the one
+	 * given out by get_handle
+	 */
+	if (transfer && !bo_vc4->lock_cnt && !bo_vc4->map_cnt &&
+	    !bo_vc4->dmabuf_handle) {
+		/* the caller owns the fd now, the next export makes a new one */
+		fd = bo_vc4->dmabuf;
+
+		_list_del(&bo_vc4->dmabuf_link);
+		_bo_drop_inode(bufmgr_vc4, bo_vc4);
+		bo_vc4->dmabuf = 0;
+		VC4_STAT_SUB(bufmgr_vc4, dmabuf_count, 1);
+	} else {
+		fd = dup(bo_vc4->dmabuf);
+		if (fd < 0) {
+			TBM_VC4_ERROR("Cannot dup dmabuf=%d (%s)\n",
+				       bo_vc4->dmabuf, strerror(errno));
+			pthread_mutex_unlock(&bufmgr_vc4->lock);
+			return -1;
+		}
+	}
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	/* the fd can be used by others, so the bo cannot be reused */
+	bo_vc4->reusable = 0;
+
+	return fd;
+}
+
+tbm_fd
+tbm_vc4_bo_export_fd(tbm_bo bo)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, -1);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_fd fd;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, -1);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, -1);
+
+	fd = _bo_export_fd(bufmgr_vc4, bo_vc4, 0);
+	if (fd < 0) {
+		TBM_VC4_ERROR("bo:%p Cannot export gem:%d\n", bo, bo_vc4->gem);
+		return -1;
+	}
+
+	TBM_VC4_DEBUG(" bo:%p, gem:%d(%d), fd:%d, key_fd:%d, flags:%d, size:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    fd,
+	    bo_vc4->flags_tbm,
+	    bo_vc4->size);
+
+	return fd;
+}
+
+static tbm_bo_handle
+tbm_vc4_bo_get_handle(tbm_bo bo, int device)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+
+	tbm_bo_handle bo_handle;
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, (tbm_bo_handle)NULL);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, (tbm_bo_handle) NULL);
+
+	if (!bo_vc4->gem) {
+		TBM_VC4_ERROR("Cannot map gem=%d\n", bo_vc4->gem);
+		return (tbm_bo_handle) NULL;
+	}
+
+	TBM_VC4_DEBUG("bo:%p, gem:%d(%d), fd:%d, flags:%d, size:%d, %s\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    bo_vc4->flags_tbm,
+	    bo_vc4->size,
+	    STR_DEVICE[device]);
+
+	if (_bo_willneed(bufmgr_vc4, bo_vc4) < 0) {
+		TBM_VC4_ERROR("bo:%p was purged and cannot be restored\n", bo);
+		return (tbm_bo_handle) NULL;
+	}
+
+	/* the address is used without map, so it cannot be trimmed. it is
+	 * set before the mapping is looked at, see _bo_map_evict.
+	 */
+	if (device == TBM_DEVICE_CPU)
+		__sync_lock_test_and_set(&bo_vc4->cpu_handle, 1);
+
+	/*Get mapped bo_handle*/
+	bo_handle = _vc4_bo_handle(bufmgr_vc4, bo_vc4, device);
+	if (bo_handle.ptr == NULL) {
+		TBM_VC4_ERROR("Cannot get handle: gem:%d, device:%d\n",
+			bo_vc4->gem, device);
+		return (tbm_bo_handle) NULL;
+	}
+
+	return bo_handle;
+}
+
+static tbm_bo_handle
+tbm_vc4_bo_map(tbm_bo bo, int device, int opt)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+
+	tbm_bo_handle bo_handle;
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	unsigned int map_cnt;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, (tbm_bo_handle)NULL);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, (tbm_bo_handle) NULL);
+
+	if (!bo_vc4->gem) {
+		TBM_VC4_ERROR("Cannot map gem=%d\n", bo_vc4->gem);
+		return (tbm_bo_handle) NULL;
+	}
+
+	TBM_VC4_DEBUG("       bo:%p, gem:%d(%d), fd:%d, %s, %s\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf,
+	    STR_DEVICE[device],
+	    STR_OPT[opt]);
+
+	/* a purgeable bo must not be used by a device */
+	if (_bo_willneed(bufmgr_vc4, bo_vc4) < 0) {
+		TBM_VC4_ERROR("bo:%p was purged and cannot be restored\n", bo);
+		return (tbm_bo_handle) NULL;
+	}
+
+	/* the map count is taken before the mapping is looked at, see
+	 * _bo_map_evict.
+	 */
+	map_cnt = __sync_fetch_and_add(&bo_vc4->map_cnt, 1);
+
+	/*Get mapped bo_handle*/
+	bo_handle = _vc4_bo_handle(bufmgr_vc4, bo_vc4, device);
+	if (bo_handle.ptr == NULL) {
+		TBM_VC4_ERROR("Cannot get handle: gem:%d, device:%d, opt:%d\n",
+			       bo_vc4->gem, device, opt);
+		__sync_fetch_and_sub(&bo_vc4->map_cnt, 1);
+		return (tbm_bo_handle) NULL;
+	}
+
+	/* the cache state changes on the first map and the last unmap, which
+	 * may race on different threads.
+	 */
+	if (map_cnt == 0) {
+		pthread_mutex_lock(&bo_vc4->mutex);
+		_bo_set_cache_state(bufmgr_vc4, bo_vc4, device, opt);
+		pthread_mutex_unlock(&bo_vc4->mutex);
+	} else if (bo_vc4->win_size) {
+		/* the window of a range map is no longer the only map */
+		pthread_mutex_lock(&bo_vc4->mutex);
+		bo_vc4->win_size = 0;
+		pthread_mutex_unlock(&bo_vc4->mutex);
+	}
+
+	__sync_lock_test_and_set(&bo_vc4->last_map_device, device);
+
+	return bo_handle;
+}
+
+/* drop a map of the bo. returns 0 without a map to drop, an unmap too
+ * many would wrap map_cnt and keep the bo mapped for good.
+ */
+static int
+_bo_map_put(tbm_bo_vc4 bo_vc4, unsigned int *left)
+{
+	unsigned int map_cnt;
+
+	do {
+		map_cnt = bo_vc4->map_cnt;
+		if (map_cnt == 0)
+			return 0;
+	} while (!__sync_bool_compare_and_swap(&bo_vc4->map_cnt, map_cnt, map_cnt - 1));
+
+	*left = map_cnt - 1;
+
+	return 1;
+}
+
+static int
+tbm_vc4_bo_unmap(tbm_bo bo)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	unsigned int map_cnt;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+
+	if (!bo_vc4->gem)
+		return 0;
+
+	if (!_bo_map_put(bo_vc4, &map_cnt)) {
+		TBM_VC4_ERROR("bo:%p, gem:%d is not mapped\n", bo, bo_vc4->gem);
+		return 0;
+	}
+
+	if (map_cnt == 0) {
+		pthread_mutex_lock(&bo_vc4->mutex);
+		_bo_save_cache_state(bufmgr_vc4, bo_vc4);
+		pthread_mutex_unlock(&bo_vc4->mutex);
+
+		/* an uploaded bo is read by the devices only, its mapping is
+		 * the first one to go when TBM_VC4_MAP_BUDGET is reached.
+		 */
+		if (bo_vc4->access == TBM_VC4_ACCESS_UPLOAD_ONCE) {
+			pthread_mutex_lock(&bufmgr_vc4->lock);
+			if (!_list_empty(&bo_vc4->map_link)) {
+				_list_del(&bo_vc4->map_link);
+				_list_add_tail(&bo_vc4->map_link, bufmgr_vc4->map_lru.next);
+				bo_vc4->map_ref = 0;
+			}
+			pthread_mutex_unlock(&bufmgr_vc4->lock);
+		}
+	}
+
+	/* read and reset in one go, a map on another thread may set it */
+#ifdef ENABLE_CACHECRTL
+	if (__sync_lock_test_and_set(&bo_vc4->last_map_device, -1) == TBM_DEVICE_CPU)
+		_vc4_cache_flush(bufmgr_vc4, bo_vc4, TBM_VC4_CACHE_FLUSH_ALL);
+#else
+	__sync_lock_test_and_set(&bo_vc4->last_map_device, -1);
+#endif
+
+	TBM_VC4_DEBUG("     bo:%p, gem:%d(%d), fd:%d\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    bo_vc4->dmabuf);
+
+	return 1;
+}
+
+static int
+tbm_vc4_bo_lock(tbm_bo bo, int device, int opt)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+#ifndef ALWAYS_BACKEND_CTRL
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 bo_vc4;
+	struct dma_buf_fence fence;
+	struct flock filelock;
+	int dmabuf;
+	int ret = 0;
+
+	if (device != TBM_DEVICE_3D && device != TBM_DEVICE_CPU) {
+		TBM_VC4_DEBUG("Not support device type,\n");
+		return 0;
+	}
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	memset(&fence, 0, sizeof(struct dma_buf_fence));
+
+	/* Check if the given type is valid or not. */
+	if (opt & TBM_OPTION_WRITE) {
+		if (device == TBM_DEVICE_3D)
+			fence.type = DMA_BUF_ACCESS_WRITE | DMA_BUF_ACCESS_DMA;
+	} else if (opt & TBM_OPTION_READ) {
+		if (device == TBM_DEVICE_3D)
+			fence.type = DMA_BUF_ACCESS_READ | DMA_BUF_ACCESS_DMA;
+	} else {
+		TBM_VC4_ERROR("Invalid argument\n");
+		return 0;
+	}
+
+	/* Check if the tbm manager supports dma fence or not. */
+	if (!bufmgr_vc4->use_dma_fence) {
+		TBM_VC4_ERROR("Not support DMA FENCE(%s)\n", strerror(errno));
+		return 0;
+
+	}
+
+	/* pin the dmabuf before opening it so that neither the dmabuf lru
+	 * nor a trim can close it (and drop the lock with it) under us */
+	pthread_mutex_lock(&bo_vc4->mutex);
+	__sync_add_and_fetch(&bo_vc4->lock_cnt, 1);
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	if (!_bo_get_dmabuf(bufmgr_vc4, bo_vc4)) {
+		TBM_VC4_ERROR("Cannot get dmabuf(gem:%d)\n", bo_vc4->gem);
+		goto fail;
+	}
+
+	dmabuf = bo_vc4->dmabuf;
+
+	if (device == TBM_DEVICE_3D) {
+		ret = ioctl(dmabuf, DMABUF_IOCTL_GET_FENCE, &fence);
+		if (ret < 0) {
+			TBM_VC4_ERROR("Cannot set GET FENCE(%s)\n", strerror(errno));
+			goto fail;
+		}
+	} else {
+		if (opt & TBM_OPTION_WRITE)
+			filelock.l_type = F_WRLCK;
+		else
+			filelock.l_type = F_RDLCK;
+
+		filelock.l_whence = SEEK_CUR;
+		filelock.l_start = 0;
+		filelock.l_len = 0;
+
+		if (-1 == fcntl(dmabuf, F_SETLKW, &filelock))
+			goto fail;
+	}
+
+	pthread_mutex_lock(&bo_vc4->mutex);
+
+	if (device == TBM_DEVICE_3D) {
+		int i;
+
+		for (i = 0; i < DMA_FENCE_LIST_MAX; i++) {
+			if (bo_vc4->dma_fence[i].ctx == 0) {
+				bo_vc4->dma_fence[i].type = fence.type;
+				bo_vc4->dma_fence[i].ctx = fence.ctx;
+				break;
+			}
+		}
+
+		if (i == DMA_FENCE_LIST_MAX) {
+			/*TODO: if dma_fence list is full, it needs realloc. I will fix this. by minseok3.kim*/
+			TBM_VC4_ERROR("fence list is full\n");
+		}
+	}
+
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	TBM_VC4_DEBUG("DMABUF_IOCTL_GET_FENCE! bo:%p, gem:%d(%d), fd:%ds\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    dmabuf);
+#endif /* ALWAYS_BACKEND_CTRL */
+
+	return 1;
+
+#ifndef ALWAYS_BACKEND_CTRL
+fail:
+	pthread_mutex_lock(&bo_vc4->mutex);
+	if (bo_vc4->lock_cnt > 0)
+		__sync_sub_and_fetch(&bo_vc4->lock_cnt, 1);
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	return 0;
+#endif /* ALWAYS_BACKEND_CTRL */
+}
+
+static int
+tbm_vc4_bo_unlock(tbm_bo bo)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+#ifndef ALWAYS_BACKEND_CTRL
+	tbm_bo_vc4 bo_vc4;
+	struct dma_buf_fence fence;
+	struct flock filelock;
+	unsigned int dma_type = 0;
+	int dmabuf;
+	int ret = 0;
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	if (bo_vc4->dma_fence[0].type & DMA_BUF_ACCESS_DMA)
+		dma_type = 1;
+
+	if (!bo_vc4->dma_fence[0].ctx && dma_type) {
+		TBM_VC4_DEBUG("FENCE not support or ignored,\n");
+		return 0;
+	}
+
+	if (!bo_vc4->dma_fence[0].ctx && dma_type) {
+		TBM_VC4_DEBUG("device type is not 3D/CPU,\n");
+		return 0;
+	}
+
+	pthread_mutex_lock(&bo_vc4->mutex);
+
+	if (dma_type) {
+		fence.type = bo_vc4->dma_fence[0].type;
+		fence.ctx = bo_vc4->dma_fence[0].ctx;
+		int i;
+
+		for (i = 1; i < DMA_FENCE_LIST_MAX; i++) {
+			bo_vc4->dma_fence[i - 1].type = bo_vc4->dma_fence[i].type;
+			bo_vc4->dma_fence[i - 1].ctx = bo_vc4->dma_fence[i].ctx;
+		}
+		bo_vc4->dma_fence[DMA_FENCE_LIST_MAX - 1].type = 0;
+		bo_vc4->dma_fence[DMA_FENCE_LIST_MAX - 1].ctx = 0;
+	}
+
+	/* the dmabuf stays pinned by lock_cnt until the lock is released */
+	dmabuf = bo_vc4->dmabuf;
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	if (dma_type) {
+		ret = ioctl(dmabuf, DMABUF_IOCTL_PUT_FENCE, &fence);
+		if (ret < 0)
+			TBM_VC4_ERROR("Can not set PUT FENCE(%s)\n", strerror(errno));
+	} else {
+		filelock.l_type = F_UNLCK;
+		filelock.l_whence = SEEK_CUR;
+		filelock.l_start = 0;
+		filelock.l_len = 0;
+
+		ret = fcntl(dmabuf, F_SETLKW, &filelock);
+	}
+
+	pthread_mutex_lock(&bo_vc4->mutex);
+	if (bo_vc4->lock_cnt > 0)
+		__sync_sub_and_fetch(&bo_vc4->lock_cnt, 1);
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	if (ret < 0)
+		return 0;
+
+	TBM_VC4_DEBUG("DMABUF_IOCTL_PUT_FENCE! bo:%p, gem:%d(%d), fd:%ds\n",
+	    bo,
+	    bo_vc4->gem, bo_vc4->name,
+	    dmabuf);
+#endif /* ALWAYS_BACKEND_CTRL */
+
+	return 1;
+}
+
+static void *
+_bufmgr_pressure_monitor(void *data)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4 = (tbm_bufmgr_vc4)data;
+	struct pollfd fds[2];
+
+	fds[0].fd = bufmgr_vc4->pressure_fd;
+	fds[0].events = POLLPRI;
+	fds[1].fd = bufmgr_vc4->pressure_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			TBM_VC4_ERROR("fail to poll the memory pressure(%s)\n", strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (fds[0].revents & POLLERR) {
+			TBM_VC4_ERROR("the memory pressure trigger is gone\n");
+			break;
+		}
+
+		/* the trim is done by the thread of the next alloc/free */
+		if (fds[0].revents & POLLPRI)
+			__sync_lock_test_and_set(&bufmgr_vc4->pressure, 1);
+	}
+
+	return NULL;
+}
+
+/* watch the memory pressure of the system or of a cgroup with a psi
+ * trigger.
+ */
+static int
+_bufmgr_pressure_init(tbm_bufmgr_vc4 bufmgr_vc4, const char *file)
+{
+	bufmgr_vc4->pressure_fd = open(file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (bufmgr_vc4->pressure_fd < 0) {
+		TBM_VC4_ERROR("fail to open %s(%s)\n", file, strerror(errno));
+		return 0;
+	}
+
+	if (write(bufmgr_vc4->pressure_fd, PRESSURE_TRIGGER, strlen(PRESSURE_TRIGGER) + 1) < 0) {
+		TBM_VC4_ERROR("fail to set the trigger of %s(%s)\n", file, strerror(errno));
+		goto fail_trigger;
+	}
+
+	if (pipe2(bufmgr_vc4->pressure_pipe, O_CLOEXEC)) {
+		TBM_VC4_ERROR("fail to create the pipe(%s)\n", strerror(errno));
+		goto fail_trigger;
+	}
+
+	if (pthread_create(&bufmgr_vc4->pressure_thread, NULL,
+			   _bufmgr_pressure_monitor, bufmgr_vc4)) {
+		TBM_VC4_ERROR("fail to create the memory pressure monitor\n");
+		goto fail_thread;
+	}
+
+	return 1;
+
+fail_thread:
+	close(bufmgr_vc4->pressure_pipe[0]);
+	close(bufmgr_vc4->pressure_pipe[1]);
+fail_trigger:
+	close(bufmgr_vc4->pressure_fd);
+	bufmgr_vc4->pressure_fd = -1;
+	return 0;
+}
+
+static void
+_bufmgr_pressure_fini(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	if (bufmgr_vc4->pressure_fd < 0)
+		return;
+
+	if (write(bufmgr_vc4->pressure_pipe[1], "q", 1) != 1)
+		TBM_VC4_ERROR("fail to stop the memory pressure monitor\n");
+
+	pthread_join(bufmgr_vc4->pressure_thread, NULL);
+
+	close(bufmgr_vc4->pressure_pipe[0]);
+	close(bufmgr_vc4->pressure_pipe[1]);
+	close(bufmgr_vc4->pressure_fd);
+	bufmgr_vc4->pressure_fd = -1;
+}
+
+/* a request to the bo broker */
+struct _vc4_broker_req {
+	uint32_t type;        /* BROKER_REQ_* */
+	uint32_t count;       /* number of keys */
+	uint32_t keys[BROKER_KEYS_MAX];
+};
+
+/* the reply of the bo broker, the fds come along with SCM_RIGHTS */
+struct _vc4_broker_reply {
+	int32_t result;       /* 0 or an errno */
+	uint32_t count;       /* number of fds */
+};
+
+static int
+_broker_send(int sock, struct _vc4_broker_reply *reply, int *fds, int count)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * BROKER_KEYS_MAX)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { reply, sizeof(*reply) };
+	struct msghdr msg = {0, };
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (count > 0) {
+		struct cmsghdr *cmsg;
+
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(*reply)) {
+		TBM_VC4_ERROR("fail to send the broker reply(%s)\n", strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* returns the number of fds received, -1 on failure */
+static int
+_broker_recv(int sock, struct _vc4_broker_reply *reply, int *fds, int max)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * BROKER_KEYS_MAX)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { reply, sizeof(*reply) };
+	struct msghdr msg = {0, };
+	struct cmsghdr *cmsg;
+	int count = 0;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(*reply)) {
+		TBM_VC4_ERROR("fail to receive the broker reply(%s)\n", strerror(errno));
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int *data = (int *)CMSG_DATA(cmsg);
+		int n, i;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			if (count < max)
+				fds[count++] = data[i];
+			else
+				close(data[i]);
+		}
+	}
+
+	if (reply->result || count != (int)reply->count) {
+		TBM_VC4_ERROR("the broker failed(%s, fds:%d/%d)\n",
+			       strerror(reply->result), count, reply->count);
+		while (count > 0)
+			close(fds[--count]);
+		return -1;
+	}
+
+	return count;
+}
+
+/* send a request to the broker at path, one round-trip. returns the number
+ * of fds received, -1 on failure.
+ */
+static int
+_broker_call(const char *path, struct _vc4_broker_req *req, int *fds, int max)
+{
+	struct timeval tv = { BROKER_TIMEOUT, 0 };
+	struct sockaddr_un addr = {0, };
+	struct _vc4_broker_reply reply;
+	int sock, count;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		TBM_VC4_ERROR("the broker path is too long(%s)\n", path);
+		return -1;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		TBM_VC4_ERROR("fail to create the socket(%s)\n", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		TBM_VC4_DEBUG("fail to connect to the broker %s(%s)\n", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if (send(sock, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req)) {
+		TBM_VC4_ERROR("fail to send the broker request(%s)\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	count = _broker_recv(sock, &reply, fds, max);
+
+	close(sock);
+
+	return count;
+}
+
+/* open a drm fd authenticated by the master fd */
+static int
+_broker_open_drm(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	drm_magic_t magic;
+	int fd;
+
+	fd = open(bufmgr_vc4->device_name, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		TBM_VC4_ERROR("fail to open %s(%s)\n", bufmgr_vc4->device_name, strerror(errno));
+		return -1;
+	}
+
+	if (drmGetMagic(fd, &magic) || drmAuthMagic(bufmgr_vc4->fd, magic)) {
+		TBM_VC4_ERROR("fail to authenticate the drm fd\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+_broker_serve(tbm_bufmgr_vc4 bufmgr_vc4, int sock)
+{
+	struct _vc4_broker_req req;
+	struct _vc4_broker_reply reply = {0, };
+	int fds[BROKER_KEYS_MAX];
+	int count = 0;
+	int i;
+
+	if (recv(sock, &req, sizeof(req), MSG_WAITALL) != sizeof(req)) {
+		TBM_VC4_ERROR("fail to receive the broker request(%s)\n", strerror(errno));
+		return;
+	}
+
+	switch (req.type) {
+	case BROKER_REQ_DRM_FD:
+		fds[0] = _broker_open_drm(bufmgr_vc4);
+		if (fds[0] < 0)
+			reply.result = EACCES;
+		else
+			count = 1;
+		break;
+	case BROKER_REQ_DMABUF:
+		if (req.count == 0 || req.count > BROKER_KEYS_MAX) {
+			reply.result = EINVAL;
+			break;
+		}
+
+		/* the bos are not freed or destroyed meanwhile */
+		pthread_mutex_lock(&bufmgr_vc4->lock);
+		pthread_rwlock_rdlock(&bufmgr_vc4->handle_lock);
+
+		for (count = 0; count < (int)req.count; count++) {
+			tbm_bo_vc4 bo_vc4 = _registry_lookup(&bufmgr_vc4->names, req.keys[count]);
+
+			if (!bo_vc4 || bo_vc4->state != BO_STATE_LIVE) {
+				reply.result = ENOENT;
+				break;
+			}
+
+			fds[count] = _bo_export_fd(bufmgr_vc4, bo_vc4, 0);
+			if (fds[count] < 0) {
+				reply.result = EIO;
+				break;
+			}
+		}
+
+		pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+		pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+		if (reply.result) {
+			while (count > 0)
+				close(fds[--count]);
+		}
+		break;
+	default:
+		reply.result = EINVAL;
+		break;
+	}
+
+	reply.count = count;
+	_broker_send(sock, &reply, fds, count);
+
+	for (i = 0; i < count; i++)
+		close(fds[i]);
+}
+
+/* the peer runs as the user and group of the display server */
+static int
+_broker_peer_allowed(tbm_bufmgr_vc4 bufmgr_vc4, int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		TBM_VC4_ERROR("fail to get the broker peer(%s)\n", strerror(errno));
+		return 0;
+	}
+
+	if (cred.uid != bufmgr_vc4->broker_uid || cred.gid != bufmgr_vc4->broker_gid) {
+		TBM_VC4_ERROR("the broker refused pid:%d uid:%d gid:%d\n",
+			       cred.pid, cred.uid, cred.gid);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void *
+_bufmgr_broker_thread(void *data)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4 = (tbm_bufmgr_vc4)data;
+	struct timeval tv = { BROKER_TIMEOUT, 0 };
+	struct pollfd fds[2];
+
+	fds[0].fd = bufmgr_vc4->broker_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = bufmgr_vc4->broker_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		int sock;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			TBM_VC4_ERROR("fail to poll the broker(%s)\n", strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		sock = accept4(bufmgr_vc4->broker_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0)
+			continue;
+
+		/* a stuck client does not block the others for long */
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		if (_broker_peer_allowed(bufmgr_vc4, sock)) {
+			_broker_serve(bufmgr_vc4, sock);
+		} else {
+			struct _vc4_broker_reply reply = { EPERM, 0 };
+
+			_broker_send(sock, &reply, NULL, 0);
+		}
+
+		close(sock);
+	}
+
+	return NULL;
+}
+
+/* the directory of the socket belongs to the display server and nobody
+ * else may enter it, so the socket is not replaced between its bind and
+ * its chmod. it is created if missing.
+ */
+static int
+_broker_make_dir(const char *path)
+{
+	char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct stat st;
+	char *slash;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+
+	slash = strrchr(dir, '/');
+	if (!slash || slash == dir) {
+		TBM_VC4_ERROR("the broker needs a directory of its own(%s)\n", path);
+		return 0;
+	}
+	*slash = '\0';
+
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		TBM_VC4_ERROR("fail to create %s(%s)\n", dir, strerror(errno));
+		return 0;
+	}
+
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & 0077)) {
+		TBM_VC4_ERROR("the broker directory %s is not private\n", dir);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* remove the socket at path, anything else there is left alone */
+static int
+_broker_unlink(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st))
+		return errno == ENOENT;
+
+	if (!S_ISSOCK(st.st_mode)) {
+		TBM_VC4_ERROR("%s is not a socket, not removed\n", path);
+		return 0;
+	}
+
+	return unlink(path) == 0;
+}
+
+/* serve the authenticated drm fds and the dmabuf fds of the bos to the
+ * clients which are not wayland clients. the socket is only accessible to
+ * the user of the display server, and the peers of another user or group
+ * are refused.
+ */
+static int
+_bufmgr_broker_init(tbm_bufmgr_vc4 bufmgr_vc4, const char *path)
+{
+	struct sockaddr_un addr = {0, };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		TBM_VC4_ERROR("the broker path is too long(%s)\n", path);
+		return 0;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (!_broker_make_dir(path))
+		return 0;
+
+	/* the socket of a previous display server */
+	if (!_broker_unlink(path))
+		return 0;
+
+	bufmgr_vc4->broker_uid = geteuid();
+	bufmgr_vc4->broker_gid = getegid();
+
+	bufmgr_vc4->broker_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (bufmgr_vc4->broker_fd < 0) {
+		TBM_VC4_ERROR("fail to create the socket(%s)\n", strerror(errno));
+		return 0;
+	}
+
+	if (bind(bufmgr_vc4->broker_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		TBM_VC4_ERROR("fail to bind %s(%s)\n", path, strerror(errno));
+		goto fail_bind;
+	}
+
+	if (chmod(path, 0600) || listen(bufmgr_vc4->broker_fd, 16)) {
+		TBM_VC4_ERROR("fail to listen on %s(%s)\n", path, strerror(errno));
+		goto fail_listen;
+	}
+
+	if (pipe2(bufmgr_vc4->broker_pipe, O_CLOEXEC)) {
+		TBM_VC4_ERROR("fail to create the pipe(%s)\n", strerror(errno));
+		goto fail_listen;
+	}
+
+	bufmgr_vc4->broker_path = strdup(path);
+	if (!bufmgr_vc4->broker_path) {
+		TBM_VC4_ERROR("fail to allocate the broker path\n");
+		goto fail_path;
+	}
+
+	if (pthread_create(&bufmgr_vc4->broker_thread, NULL,
+			   _bufmgr_broker_thread, bufmgr_vc4)) {
+		TBM_VC4_ERROR("fail to create the broker\n");
+		goto fail_thread;
+	}
+
+	TBM_VC4_DEBUG("broker:%s\n", path);
+
+	return 1;
+
+fail_thread:
+	free(bufmgr_vc4->broker_path);
+	bufmgr_vc4->broker_path = NULL;
+fail_path:
+	close(bufmgr_vc4->broker_pipe[0]);
+	close(bufmgr_vc4->broker_pipe[1]);
+fail_listen:
+	_broker_unlink(path);
+fail_bind:
+	close(bufmgr_vc4->broker_fd);
+	bufmgr_vc4->broker_fd = -1;
+	return 0;
+}
+
+static void
+_bufmgr_broker_fini(tbm_bufmgr_vc4 bufmgr_vc4)
+{
+	if (bufmgr_vc4->broker_fd >= 0) {
+		if (write(bufmgr_vc4->broker_pipe[1], "q", 1) != 1)
+			TBM_VC4_ERROR("fail to stop the broker\n");
+
+		pthread_join(bufmgr_vc4->broker_thread, NULL);
+
+		close(bufmgr_vc4->broker_pipe[0]);
+		close(bufmgr_vc4->broker_pipe[1]);
+		close(bufmgr_vc4->broker_fd);
+		bufmgr_vc4->broker_fd = -1;
+
+		_broker_unlink(bufmgr_vc4->broker_path);
+	}
+
+	free(bufmgr_vc4->broker_path);
+	bufmgr_vc4->broker_path = NULL;
+}
+
+static void
+tbm_vc4_bufmgr_deinit(void *priv)
+{
+	VC4_RETURN_IF_FAIL(priv != NULL);
+
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)priv;
+
+	TBM_VC4_DEBUG("bo cache hits:%lu, misses:%lu, evictions:%lu\n",
+	    bufmgr_vc4->stats.cache_hits,
+	    bufmgr_vc4->stats.cache_misses,
+	    bufmgr_vc4->stats.cache_evictions);
+
+	_bufmgr_broker_fini(bufmgr_vc4);
+	_bufmgr_pressure_fini(bufmgr_vc4);
+	_bo_prewarm_fini(bufmgr_vc4);
+
+	_bo_cache_purge(bufmgr_vc4);
+
+	/* the gem of the slabs are closed with the drm fd */
+	while (!_list_empty(&bufmgr_vc4->slabs)) {
+		struct _vc4_slab *slab = vc4_container_of(bufmgr_vc4->slabs.next,
+						struct _vc4_slab, link);
+
+		_list_del(&slab->link);
+		free(slab);
+	}
+
+	/* the bos left are freed with their chunks, their gem with the fd */
+	TBM_VC4_DEBUG("bos left:%d\n", _registry_count(&bufmgr_vc4->bos));
+
+	_registry_fini(&bufmgr_vc4->bos);
+	_registry_fini(&bufmgr_vc4->names);
+	_registry_fini(&bufmgr_vc4->inodes);
+	pthread_rwlock_destroy(&bufmgr_vc4->handle_lock);
+
+	_bo_priv_fini(bufmgr_vc4);
+
+	_bufmgr_deinit_cache_state(bufmgr_vc4);
+
+	if (bufmgr_vc4->bind_display)
+		tbm_drm_helper_wl_auth_server_deinit();
+
+	if (bufmgr_vc4->device_name)
+		free(bufmgr_vc4->device_name);
+
+	if (tbm_backend_is_display_server())
+		tbm_drm_helper_unset_tbm_master_fd();
+	else
+		tbm_drm_helper_unset_fd();
+
+	close(bufmgr_vc4->fd);
+
+	pthread_mutex_destroy(&bufmgr_vc4->probe_lock);
+	pthread_mutex_destroy(&bufmgr_vc4->lock);
+
+	free(bufmgr_vc4);
+}
+
+int
+tbm_vc4_surface_supported_format(uint32_t **formats, uint32_t *num)
+{
+	uint32_t *color_formats = NULL;
+
+	color_formats = (uint32_t *)calloc(1,
+					   sizeof(uint32_t) * TBM_COLOR_FORMAT_COUNT);
+
+	if (color_formats == NULL)
+		return 0;
+
+	memcpy(color_formats, tbm_vc4_color_format_list,
+	       sizeof(uint32_t)*TBM_COLOR_FORMAT_COUNT);
+
+	*formats = color_formats;
+	*num = TBM_COLOR_FORMAT_COUNT;
+
+	TBM_VC4_DEBUG("tbm_vc4_surface_supported_format  count = %d\n", *num);
+
+	return 1;
+}
+
+static int
+_new_calc_plane_nv12(int width, int height)
+{
+	int mbX, mbY;
+
+	mbX = DIV_ROUND_UP(width, S5P_FIMV_NUM_PIXELS_IN_MB_ROW);
+	mbY = DIV_ROUND_UP(height, S5P_FIMV_NUM_PIXELS_IN_MB_COL);
+
+	if (width * height < S5P_FIMV_MAX_FRAME_SIZE)
+		mbY = (mbY + 1) / 2 * 2;
+
+	return ((mbX * S5P_FIMV_NUM_PIXELS_IN_MB_COL) * (mbY *
+			S5P_FIMV_NUM_PIXELS_IN_MB_ROW));
+}
+
+static int
+_calc_yplane_nv12(int width, int height)
+{
+	int mbX, mbY;
+
+	mbX = SIZE_ALIGN(width + 24, S5P_FIMV_NV12MT_HALIGN);
+	mbY = SIZE_ALIGN(height + 16, S5P_FIMV_NV12MT_VALIGN);
+
+	return SIZE_ALIGN(mbX * mbY, S5P_FIMV_DEC_BUF_ALIGN);
+}
+
+static int
+_calc_uvplane_nv12(int width, int height)
+{
+	int mbX, mbY;
+
+	mbX = SIZE_ALIGN(width + 16, S5P_FIMV_NV12MT_HALIGN);
+	mbY = SIZE_ALIGN(height + 4, S5P_FIMV_NV12MT_VALIGN);
+
+	return SIZE_ALIGN((mbX * mbY) >> 1, S5P_FIMV_DEC_BUF_ALIGN);
+}
+
+static int
+_new_calc_yplane_nv12(int width, int height)
+{
+	return SIZE_ALIGN(_new_calc_plane_nv12(width,
+						height) + S5P_FIMV_D_ALIGN_PLANE_SIZE,
+			   TBM_SURFACE_ALIGNMENT_PLANE_NV12);
+}
+
+static int
+_new_calc_uvplane_nv12(int width, int height)
+{
+	return SIZE_ALIGN((_new_calc_plane_nv12(width,
+						height) >> 1) + S5P_FIMV_D_ALIGN_PLANE_SIZE,
+			  TBM_SURFACE_ALIGNMENT_PLANE_NV12);
+}
+
+/**
+ * @brief get the plane data of the surface.
+ * @param[in] width : the width of the surface
+ * @param[in] height : the height of the surface
+ * @param[in] format : the format of the surface
+ * @param[in] plane_idx : the format of the surface
+ * @param[out] size : the size of the plane
+ * @param[out] offset : the offset of the plane
+ * @param[out] pitch : the pitch of the plane
+ * @param[out] padding : the padding of the plane
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_vc4_surface_get_plane_data(int width, int height,
+				  tbm_format format, int plane_idx, uint32_t *size, uint32_t *offset,
+				  uint32_t *pitch, int *bo_idx)
+{
+	int ret = 1;
+	int bpp;
+	int _offset = 0;
+	int _pitch = 0;
+	int _size = 0;
+	int _bo_idx = 0;
+
+	switch (format) {
+		/* 16 bpp RGB */
+	case TBM_FORMAT_XRGB4444:
+	case TBM_FORMAT_XBGR4444:
+	case TBM_FORMAT_RGBX4444:
+	case TBM_FORMAT_BGRX4444:
+	case TBM_FORMAT_ARGB4444:
+	case TBM_FORMAT_ABGR4444:
+	case TBM_FORMAT_RGBA4444:
+	case TBM_FORMAT_BGRA4444:
+	case TBM_FORMAT_XRGB1555:
+	case TBM_FORMAT_XBGR1555:
+	case TBM_FORMAT_RGBX5551:
+	case TBM_FORMAT_BGRX5551:
+	case TBM_FORMAT_ARGB1555:
+	case TBM_FORMAT_ABGR1555:
+	case TBM_FORMAT_RGBA5551:
+	case TBM_FORMAT_BGRA5551:
+	case TBM_FORMAT_RGB565:
+		bpp = 16;
+		_offset = 0;
+		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_RGB);
+		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+		_bo_idx = 0;
+		break;
+		/* 24 bpp RGB */
+	case TBM_FORMAT_RGB888:
+	case TBM_FORMAT_BGR888:
+		bpp = 24;
+		_offset = 0;
+		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_RGB);
+		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+		_bo_idx = 0;
+		break;
+		/* 32 bpp RGB */
+	case TBM_FORMAT_XRGB8888:
+	case TBM_FORMAT_XBGR8888:
+	case TBM_FORMAT_RGBX8888:
+	case TBM_FORMAT_BGRX8888:
+	case TBM_FORMAT_ARGB8888:
+	case TBM_FORMAT_ABGR8888:
+	case TBM_FORMAT_RGBA8888:
+	case TBM_FORMAT_BGRA8888:
+		bpp = 32;
+		_offset = 0;
+		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_RGB);
+		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+		_bo_idx = 0;
+		break;
+
+		/* packed YCbCr */
+	case TBM_FORMAT_YUYV:
+	case TBM_FORMAT_YVYU:
+	case TBM_FORMAT_UYVY:
+	case TBM_FORMAT_VYUY:
+	case TBM_FORMAT_AYUV:
+		bpp = 32;
+		_offset = 0;
+		_pitch = SIZE_ALIGN((width * bpp) >> 3, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+		_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+		_bo_idx = 0;
+		break;
+
+		/*
+		* 2 plane YCbCr
+		* index 0 = Y plane, [7:0] Y
+		* index 1 = Cr:Cb plane, [15:0] Cr:Cb little endian
+		* or
+		* index 1 = Cb:Cr plane, [15:0] Cb:Cr little endian
+		*/
+	case TBM_FORMAT_NV12:
+		bpp = 12;
+		if (plane_idx == 0) {
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = MAX(_calc_yplane_nv12(width, height), _new_calc_yplane_nv12(width,
+					height));
+			_bo_idx = 0;
+		} else if (plane_idx == 1) {
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = MAX(_calc_uvplane_nv12(width, height), _new_calc_uvplane_nv12(width,
+					height));
+			_bo_idx = 1;
+		}
+		break;
+	case TBM_FORMAT_NV21:
+		bpp = 12;
+		if (plane_idx == 0) {
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		} else if (plane_idx == 1) {
+			_offset = width * height;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = SIZE_ALIGN(_pitch * (height / 2), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		}
+		break;
+
+	case TBM_FORMAT_NV16:
+	case TBM_FORMAT_NV61:
+		bpp = 16;
+		/*if(plane_idx == 0)*/
+		{
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 0)
+				break;
+		}
+		/*else if( plane_idx ==1 )*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		}
+		break;
+
+		/*
+		* 3 plane YCbCr
+		* index 0: Y plane, [7:0] Y
+		* index 1: Cb plane, [7:0] Cb
+		* index 2: Cr plane, [7:0] Cr
+		* or
+		* index 1: Cr plane, [7:0] Cr
+		* index 2: Cb plane, [7:0] Cb
+		*/
+
+		/*
+		* NATIVE_BUFFER_FORMAT_YV12
+		* NATIVE_BUFFER_FORMAT_I420
+		*/
+	case TBM_FORMAT_YUV410:
+	case TBM_FORMAT_YVU410:
+		bpp = 9;
+		/*if(plane_idx == 0)*/
+		{
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 0)
+				break;
+		}
+		/*else if(plane_idx == 1)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width / 4, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 4);
+			_size = SIZE_ALIGN(_pitch * (height / 4), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 1)
+				break;
+		}
+		/*else if (plane_idx == 2)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width / 4, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 4);
+			_size = SIZE_ALIGN(_pitch * (height / 4), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		}
+		break;
+	case TBM_FORMAT_YUV411:
+	case TBM_FORMAT_YVU411:
+	case TBM_FORMAT_YUV420:
+	case TBM_FORMAT_YVU420:
+		bpp = 12;
+		/*if(plane_idx == 0)*/
+		{
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 0)
+				break;
+		}
+		/*else if(plane_idx == 1)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = SIZE_ALIGN(_pitch * (height / 2), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 1)
+				break;
+		}
+		/*else if (plane_idx == 2)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = SIZE_ALIGN(_pitch * (height / 2), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		}
+		break;
+	case TBM_FORMAT_YUV422:
+	case TBM_FORMAT_YVU422:
+		bpp = 16;
+		/*if(plane_idx == 0)*/
+		{
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 0)
+				break;
+		}
+		/*else if(plane_idx == 1)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = SIZE_ALIGN(_pitch * (height), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 1)
+				break;
+		}
+		/*else if (plane_idx == 2)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
+			_size = SIZE_ALIGN(_pitch * (height), TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		}
+		break;
+	case TBM_FORMAT_YUV444:
+	case TBM_FORMAT_YVU444:
+		bpp = 24;
+		/*if(plane_idx == 0)*/
+		{
+			_offset = 0;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 0)
+				break;
+		}
+		/*else if(plane_idx == 1)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+			if (plane_idx == 1)
+				break;
+		}
+		/*else if (plane_idx == 2)*/
+		{
+			_offset += _size;
+			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
+			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
+			_bo_idx = 0;
+		}
+		break;
+	default:
+		bpp = 0;
+		break;
+	}
+
+	*size = _size;
+	*offset = _offset;
+	*pitch = _pitch;
+	*bo_idx = _bo_idx;
+
+	return ret;
+}
+
+int
+tbm_vc4_bo_get_flags(tbm_bo bo)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bo_vc4 bo_vc4;
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	return bo_vc4->flags_tbm;
+}
+
+int
+tbm_vc4_bufmgr_bind_native_display(tbm_bufmgr bufmgr, void *native_display)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	if (!tbm_drm_helper_wl_auth_server_init(native_display, bufmgr_vc4->fd,
+					   bufmgr_vc4->device_name, 0)) {
+		TBM_VC4_ERROR("fail to tbm_drm_helper_wl_server_init\n");
+		return 0;
+	}
+
+	bufmgr_vc4->bind_display = native_display;
+
+	return 1;
+}
+
+int
+tbm_vc4_bufmgr_get_stats(tbm_bufmgr bufmgr, tbm_vc4_stats *stats)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	VC4_RETURN_VAL_IF_FAIL(stats != NULL, 0);
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	memcpy(stats, &bufmgr_vc4->stats, sizeof(tbm_vc4_stats));
+
+	return 1;
+}
+
+int
+tbm_vc4_bufmgr_get_label_stats(tbm_bufmgr bufmgr, tbm_vc4_label label,
+			       tbm_vc4_label_stats *stats)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	VC4_RETURN_VAL_IF_FAIL(label >= 0 && label < TBM_VC4_LABEL_MAX, 0);
+	VC4_RETURN_VAL_IF_FAIL(stats != NULL, 0);
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	memcpy(stats, &bufmgr_vc4->label_stats[label], sizeof(tbm_vc4_label_stats));
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return 1;
+}
+
+int
+tbm_vc4_bo_set_label(tbm_bo bo, tbm_vc4_label label)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(label >= 0 && label < TBM_VC4_LABEL_MAX, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	/* the owner of an imported bo labels it */
+	if (bo_vc4->imported) {
+		TBM_VC4_ERROR("bo:%p is imported, cannot be labeled\n", bo);
+		return 0;
+	}
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	_bo_label_del(bufmgr_vc4, bo_vc4);
+	_bo_label_add(bufmgr_vc4, bo_vc4, label);
+
+	bo_vc4->flags_tbm = (bo_vc4->flags_tbm & ~TBM_BO_VENDOR) | TBM_VC4_BO_LABEL(label);
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return 1;
+}
+
+int
+tbm_vc4_bo_export_fds(tbm_bo *bos, int count, int flags, tbm_fd *fds)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	int i;
+
+	VC4_RETURN_VAL_IF_FAIL(bos != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(count > 0, 0);
+	VC4_RETURN_VAL_IF_FAIL(fds != NULL, 0);
+
+	for (i = 0; i < count; i++) {
+		tbm_bo_vc4 bo_vc4 = NULL;
+
+		bufmgr_vc4 = NULL;
+		if (bos[i]) {
+			bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bos[i]);
+			bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bos[i]);
+		}
+
+		if (!bufmgr_vc4 || !bo_vc4) {
+			TBM_VC4_ERROR("invalid bo(%d/%d)\n", i, count);
+			goto fail_export;
+		}
+
+		fds[i] = _bo_export_fd(bufmgr_vc4, bo_vc4,
+				       flags & TBM_VC4_EXPORT_TRANSFER);
+		if (fds[i] < 0) {
+			TBM_VC4_ERROR("bo:%p Cannot export gem:%d(%d/%d)\n",
+				       bos[i], bo_vc4->gem, i, count);
+			goto fail_export;
+		}
+	}
+
+	TBM_VC4_DEBUG("bos:%d, flags:%d\n", count, flags);
+
+	return 1;
+
+fail_export:
+	while (i-- > 0) {
+		close(fds[i]);
+		fds[i] = -1;
+	}
+
+	return 0;
+}
+
+tbm_bo
+tbm_vc4_bo_import_fd_desc(tbm_bufmgr bufmgr, tbm_fd fd,
+			  const tbm_vc4_bo_desc *desc)
+{
+	tbm_bo bo;
+
+	VC4_RETURN_VAL_IF_FAIL(bufmgr != NULL, NULL);
+	VC4_RETURN_VAL_IF_FAIL(fd >= 0, NULL);
+	VC4_RETURN_VAL_IF_FAIL(desc != NULL, NULL);
+
+	if (!_bo_desc_check(desc, 0)) {
+		TBM_VC4_ERROR("invalid desc(size:%d, planes:%d)\n",
+			       desc->size, desc->num_planes);
+		return NULL;
+	}
+
+	if (_bo_import_busy())
+		return NULL;
+
+	import_desc = desc;
+	bo = tbm_bo_import_fd(bufmgr, fd);
+
+	/* not taken, libtbm gave the bo without the backend */
+	if (import_desc) {
+		import_desc = NULL;
+		if (bo) {
+			TBM_VC4_ERROR("fd:%d was not imported by the backend\n", fd);
+			tbm_bo_unref(bo);
+			bo = NULL;
+		}
+	}
+
+	return bo;
+}
+
+int
+tbm_vc4_bo_import_fds(tbm_bufmgr bufmgr, tbm_fd *fds, int count, tbm_bo *bos)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct _vc4_import_batch batch;
+	struct stat sts_planes[TBM_VC4_PLANE_MAX];
+	int has_st_planes[TBM_VC4_PLANE_MAX];
+	struct stat *sts = sts_planes;
+	int *has_st = has_st_planes;
+	int i, j;
+
+	VC4_RETURN_VAL_IF_FAIL(fds != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(count > 0, 0);
+	VC4_RETURN_VAL_IF_FAIL(bos != NULL, 0);
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	if (_bo_import_busy())
+		return 0;
+
+	/* the planes of a surface fit on the stack */
+	if (count > TBM_VC4_PLANE_MAX) {
+		sts = calloc(count, sizeof(struct stat) + sizeof(int));
+		if (!sts) {
+			TBM_VC4_ERROR("fail to allocate the stats(%d)\n", count);
+			return 0;
+		}
+		has_st = (int *)(sts + count);
+	}
+
+	for (i = 0; i < count; i++) {
+		VC4_STAT_ADD(bufmgr_vc4, import_syscalls, 1);
+		has_st[i] = (fstat(fds[i], &sts[i]) == 0);
+	}
+
+	/* the bo privates of the new bos are taken under one lock, on the
+	 * first dmabuf which is not known
+	 */
+	_list_init(&batch.privs);
+
+	import_batch = &batch;
+
+	for (i = 0; i < count; i++) {
+		/* the planes in the same dmabuf share its bo */
+		for (j = 0; has_st[i] && j < i; j++) {
+			if (has_st[j] && sts[j].st_dev == sts[i].st_dev &&
+			    sts[j].st_ino == sts[i].st_ino)
+				break;
+		}
+
+		if (has_st[i] && j < i) {
+			bos[i] = tbm_bo_ref(bos[j]);
+			continue;
+		}
+
+		batch.st = has_st[i] ? &sts[i] : NULL;
+		batch.want = count - i;
+
+		bos[i] = tbm_bo_import_fd(bufmgr, fds[i]);
+		if (!bos[i]) {
+			TBM_VC4_ERROR("fail to import fd:%d(%d/%d)\n", fds[i], i, count);
+			goto fail_import;
+		}
+	}
+
+	import_batch = NULL;
+
+	if (!_list_empty(&batch.privs)) {
+		pthread_mutex_lock(&bufmgr_vc4->lock);
+		while (!_list_empty(&batch.privs))
+			_bo_priv_free(bufmgr_vc4, _bo_priv_take(&batch.privs));
+		pthread_mutex_unlock(&bufmgr_vc4->lock);
+	}
+
+	if (sts != sts_planes)
+		free(sts);
+
+	TBM_VC4_DEBUG("fds:%d\n", count);
+
+	return 1;
+
+fail_import:
+	import_batch = NULL;
+
+	while (i-- > 0) {
+		tbm_bo_unref(bos[i]);
+		bos[i] = NULL;
+	}
+
+	if (!_list_empty(&batch.privs)) {
+		pthread_mutex_lock(&bufmgr_vc4->lock);
+		while (!_list_empty(&batch.privs))
+			_bo_priv_free(bufmgr_vc4, _bo_priv_take(&batch.privs));
+		pthread_mutex_unlock(&bufmgr_vc4->lock);
+	}
+
+	if (sts != sts_planes)
+		free(sts);
+
+	return 0;
+}
+
+int
+tbm_vc4_bo_get_desc(tbm_bo bo, tbm_vc4_bo_desc *desc)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(desc != NULL, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	int ret;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	ret = bo_vc4->has_desc;
+	if (ret)
+		*desc = bo_vc4->desc;
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return ret;
+}
+
+tbm_bo
+tbm_vc4_bufmgr_get_bo(tbm_bufmgr bufmgr, unsigned int handle)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo bo;
+
+	VC4_RETURN_VAL_IF_FAIL(handle != 0, NULL);
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, NULL);
+
+	/* libtbm refs the tbm_bo of the bo under its lock, which its frees
+	 * hold too. the tbm_bo cannot be read and refed from here safely.
+	 */
+	if (_bo_import_busy())
+		return NULL;
+
+	import_handle = 1;
+	bo = tbm_bo_import(bufmgr, handle);
+
+	/* not taken, libtbm gave the bo without the backend, by name */
+	if (import_handle) {
+		import_handle = 0;
+		if (bo) {
+			TBM_VC4_ERROR("handle:%d was not imported by the backend\n", handle);
+			tbm_bo_unref(bo);
+			bo = NULL;
+		}
+	}
+
+	return bo;
+}
+
+struct _vc4_foreach_data {
+	unsigned int *handles;
+	int count;
+	int size;
+	int failed;
+};
+
+static int
+_bo_foreach_collect(void *value, void *data)
+{
+	tbm_bo_vc4 bo_vc4 = value;
+	struct _vc4_foreach_data *foreach = data;
+
+	if (bo_vc4->state != BO_STATE_LIVE || !bo_vc4->bo)
+		return 1;
+
+	if (foreach->count == foreach->size) {
+		unsigned int *handles;
+
+		handles = realloc(foreach->handles,
+				  sizeof(unsigned int) * foreach->size * 2);
+		if (!handles) {
+			foreach->failed = 1;
+			return 0;
+		}
+
+		foreach->handles = handles;
+		foreach->size *= 2;
+	}
+
+	foreach->handles[foreach->count++] = bo_vc4->gem;
+
+	return 1;
+}
+
+int
+tbm_vc4_bufmgr_foreach_bo(tbm_bufmgr bufmgr, tbm_vc4_bo_func func,
+			  void *user_data)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct _vc4_foreach_data foreach;
+	int i, ret = 1;
+
+	VC4_RETURN_VAL_IF_FAIL(func != NULL, 0);
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	/* the handles of the live bos are taken under the shard locks, func
+	 * is called on each bo still alive afterwards without any lock.
+	 */
+	foreach.count = 0;
+	foreach.failed = 0;
+	foreach.size = _registry_count(&bufmgr_vc4->bos) + 16;
+	foreach.handles = malloc(sizeof(unsigned int) * foreach.size);
+	if (!foreach.handles) {
+		TBM_VC4_ERROR("fail to allocate the handles of %d bos\n", foreach.size);
+		return 0;
+	}
+
+	_registry_foreach(&bufmgr_vc4->bos, _bo_foreach_collect, &foreach);
+	if (foreach.failed) {
+		TBM_VC4_ERROR("fail to allocate the handles of %d bos\n", foreach.size * 2);
+		free(foreach.handles);
+		return 0;
+	}
+
+	for (i = 0; i < foreach.count && ret; i++) {
+		tbm_bo bo = tbm_vc4_bufmgr_get_bo(bufmgr, foreach.handles[i]);
+
+		if (!bo)
+			continue;
+
+		ret = func(bo, user_data);
+		tbm_bo_unref(bo);
+	}
+
+	free(foreach.handles);
+
+	return 1;
+}
+
+int
+tbm_vc4_bufmgr_broker_import(tbm_bufmgr bufmgr, unsigned int *keys, int count,
+			     tbm_bo *bos)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct _vc4_broker_req req = {0, };
+	int fds[BROKER_KEYS_MAX];
+	int ret, i;
+
+	VC4_RETURN_VAL_IF_FAIL(keys != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(count > 0 && count <= BROKER_KEYS_MAX, 0);
+	VC4_RETURN_VAL_IF_FAIL(bos != NULL, 0);
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	if (!bufmgr_vc4->broker_path || bufmgr_vc4->broker_fd >= 0) {
+		TBM_VC4_ERROR("no broker to import from\n");
+		return 0;
+	}
+
+	req.type = BROKER_REQ_DMABUF;
+	req.count = count;
+	memcpy(req.keys, keys, sizeof(unsigned int) * count);
+
+	if (_broker_call(bufmgr_vc4->broker_path, &req, fds, count) != count)
+		return 0;
+
+	ret = tbm_vc4_bo_import_fds(bufmgr, fds, count, bos);
+
+	for (i = 0; i < count; i++)
+		close(fds[i]);
+
+	return ret;
+}
+
+int
+tbm_vc4_bufmgr_trim(tbm_bufmgr bufmgr)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	_bufmgr_trim(bufmgr_vc4);
+
+	return 1;
+}
+
+int
+tbm_vc4_bo_set_access(tbm_bo bo, tbm_vc4_access access)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(access >= 0 && access < TBM_VC4_ACCESS_MAX, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	void *map;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	/* the bo mutex keeps the mapping from _bo_map_evict, the prefault of
+	 * a large bo does not hold the bufmgr lock up for the other bos.
+	 */
+	pthread_mutex_lock(&bo_vc4->mutex);
+
+	bo_vc4->access = access;
+
+	/* a bo already mapped is advised and prefaulted now */
+	map = bo_vc4->pBase;
+	if (map)
+		_bo_map_advise(bo_vc4, map, _bo_map_populate(bo_vc4));
+
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	TBM_VC4_DEBUG("bo:%p, gem:%d, access:%d\n", bo, bo_vc4->gem, access);
+
+	return 1;
+}
+
+void *
+tbm_vc4_bo_map_range(tbm_bo bo, int opt, unsigned int offset, unsigned int size)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
+	VC4_RETURN_VAL_IF_FAIL(size > 0, NULL);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	vc4_bo_range *range;
+	unsigned int map_cnt;
+	void *map;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, NULL);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, NULL);
+
+	if (offset > bo_vc4->size || size > bo_vc4->size - offset) {
+		TBM_VC4_ERROR("bo:%p, offset:%u, size:%u out of the bo size:%d\n",
+			      bo, offset, size, bo_vc4->size);
+		return NULL;
+	}
+
+	if (_bo_willneed(bufmgr_vc4, bo_vc4) < 0) {
+		TBM_VC4_ERROR("bo:%p was purged and cannot be restored\n", bo);
+		return NULL;
+	}
+
+	/* the map count keeps the mapping of the whole bo, see _bo_map_evict */
+	map_cnt = __sync_fetch_and_add(&bo_vc4->map_cnt, 1);
+
+	/* the window is in the mapping of the whole bo. vc4 clears the page
+	 * offset of a mapping, an mmap at a page of the gem object would map
+	 * it from its start.
+	 */
+	map = _bo_mmap(bufmgr_vc4, bo_vc4, 0);
+	if (!map) {
+		__sync_fetch_and_sub(&bo_vc4->map_cnt, 1);
+		return NULL;
+	}
+
+	range = calloc(1, sizeof(vc4_bo_range));
+	if (!range) {
+		TBM_VC4_ERROR("fail to allocate the range\n");
+		__sync_fetch_and_sub(&bo_vc4->map_cnt, 1);
+		return NULL;
+	}
+
+	range->ptr = (char *)map + offset;
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	_list_add_tail(&range->link, &bo_vc4->ranges);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	/* the cache ops are limited to the window while it is the only map,
+	 * another map covers the whole bo again.
+	 */
+	pthread_mutex_lock(&bo_vc4->mutex);
+	if (map_cnt == 0) {
+		bo_vc4->win_ptr = range->ptr;
+		bo_vc4->win_size = size;
+		_bo_set_cache_state(bufmgr_vc4, bo_vc4, TBM_DEVICE_CPU, opt);
+	} else {
+		bo_vc4->win_size = 0;
+	}
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	TBM_VC4_DEBUG("bo:%p, gem:%d, offset:%u, size:%u\n",
+		      bo, bo_vc4->gem, offset, size);
+
+	return range->ptr;
+}
+
+int
+tbm_vc4_bo_unmap_range(tbm_bo bo, void *ptr)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(ptr != NULL, 0);
+
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	vc4_bo_range *range = NULL;
+	vc4_list *item;
+	unsigned int map_cnt;
+	int ret = 1;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	for (item = bo_vc4->ranges.next; item != &bo_vc4->ranges; item = item->next) {
+		if (vc4_container_of(item, vc4_bo_range, link)->ptr == ptr) {
+			range = vc4_container_of(item, vc4_bo_range, link);
+			break;
+		}
+	}
+
+	if (!range) {
+		pthread_mutex_unlock(&bufmgr_vc4->lock);
+		TBM_VC4_ERROR("bo:%p, %p is not a mapped range\n", bo, ptr);
+		return 0;
+	}
+
+	/* no other thread can find the range once unlinked */
+	_list_del(&range->link);
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	pthread_mutex_lock(&bo_vc4->mutex);
+
+	/* the range holds a map, the count was dropped by an unmap too many.
+	 * the range goes anyway.
+	 */
+	if (!_bo_map_put(bo_vc4, &map_cnt)) {
+		TBM_VC4_ERROR("bo:%p, gem:%d the map of %p was dropped\n",
+			       bo, bo_vc4->gem, ptr);
+		ret = 0;
+	} else if (map_cnt == 0) {
+		_bo_save_cache_state(bufmgr_vc4, bo_vc4);
+	}
+
+#ifdef ENABLE_CACHECRTL
+	_vc4_cache_flush(bufmgr_vc4, bo_vc4,
+			 bo_vc4->win_size ? TBM_VC4_CACHE_FLUSH : TBM_VC4_CACHE_FLUSH_ALL);
+#endif
+
+	if (bo_vc4->win_ptr == ptr)
+		bo_vc4->win_size = 0;
+
+	pthread_mutex_unlock(&bo_vc4->mutex);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	_bo_range_release(bufmgr_vc4, range);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	return ret;
+}
+
+int
+tbm_vc4_bo_write(tbm_bo bo, unsigned int offset, const void *src, unsigned int size)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(src != NULL, 0);
+
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	void *ptr;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_WRITE, offset, size);
+	if (!ptr)
+		return 0;
+
+	bufmgr_vc4->copy_to(ptr, src, size);
+
+	return tbm_vc4_bo_unmap_range(bo, ptr);
+}
+
+int
+tbm_vc4_bo_read(tbm_bo bo, unsigned int offset, void *dst, unsigned int size)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	VC4_RETURN_VAL_IF_FAIL(dst != NULL, 0);
+
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	void *ptr;
+
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
+
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_READ, offset, size);
+	if (!ptr)
+		return 0;
+
+	bufmgr_vc4->copy_from(dst, ptr, size);
+
+	return tbm_vc4_bo_unmap_range(bo, ptr);
+}
+
+void *
+tbm_vc4_bo_map_plane(tbm_bo bo, int opt, int width, int height,
+		     tbm_format format, int plane_idx, uint32_t *pitch)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
+
+	uint32_t size, offset, _pitch;
+	int bo_idx;
+
+	if (!tbm_vc4_surface_get_plane_data(width, height, format, plane_idx,
+					    &size, &offset, &_pitch, &bo_idx)) {
+		TBM_VC4_ERROR("bo:%p, no plane:%d of format:0x%x\n", bo, plane_idx,
+			      format);
+		return NULL;
+	}
+
+	if (pitch)
+		*pitch = _pitch;
+
+	return tbm_vc4_bo_map_range(bo, opt, offset, size);
+}
+
+int
+tbm_vc4_bo_set_purgeable(tbm_bo bo, int purgeable)
+{
+	VC4_RETURN_VAL_IF_FAIL(bo != NULL, -1);
 
-		/*
-		* 3 plane YCbCr
-		* index 0: Y plane, [7:0] Y
-		* index 1: Cb plane, [7:0] Cb
-		* index 2: Cr plane, [7:0] Cr
-		* or
-		* index 1: Cr plane, [7:0] Cr
-		* index 2: Cb plane, [7:0] Cb
-		*/
+	tbm_bo_vc4 bo_vc4;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	int ret;
 
-		/*
-		* NATIVE_BUFFER_FORMAT_YV12
-		* NATIVE_BUFFER_FORMAT_I420
-		*/
-	case TBM_FORMAT_YUV410:
-	case TBM_FORMAT_YVU410:
-		bpp = 9;
-		/*if(plane_idx == 0)*/
-		{
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 0)
-				break;
-		}
-		/*else if(plane_idx == 1)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width / 4, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 4);
-			_size = SIZE_ALIGN(_pitch * (height / 4), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 1)
-				break;
-		}
-		/*else if (plane_idx == 2)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width / 4, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 4);
-			_size = SIZE_ALIGN(_pitch * (height / 4), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-		}
-		break;
-	case TBM_FORMAT_YUV411:
-	case TBM_FORMAT_YVU411:
-	case TBM_FORMAT_YUV420:
-	case TBM_FORMAT_YVU420:
-		bpp = 12;
-		/*if(plane_idx == 0)*/
-		{
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 0)
-				break;
-		}
-		/*else if(plane_idx == 1)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = SIZE_ALIGN(_pitch * (height / 2), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 1)
-				break;
-		}
-		/*else if (plane_idx == 2)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = SIZE_ALIGN(_pitch * (height / 2), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-		}
-		break;
-	case TBM_FORMAT_YUV422:
-	case TBM_FORMAT_YVU422:
-		bpp = 16;
-		/*if(plane_idx == 0)*/
-		{
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 0)
-				break;
-		}
-		/*else if(plane_idx == 1)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = SIZE_ALIGN(_pitch * (height), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 1)
-				break;
-		}
-		/*else if (plane_idx == 2)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width / 2, TBM_SURFACE_ALIGNMENT_PITCH_YUV / 2);
-			_size = SIZE_ALIGN(_pitch * (height), TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-		}
-		break;
-	case TBM_FORMAT_YUV444:
-	case TBM_FORMAT_YVU444:
-		bpp = 24;
-		/*if(plane_idx == 0)*/
-		{
-			_offset = 0;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 0)
-				break;
-		}
-		/*else if(plane_idx == 1)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
-			if (plane_idx == 1)
-				break;
-		}
-		/*else if (plane_idx == 2)*/
-		{
-			_offset += _size;
-			_pitch = SIZE_ALIGN(width, TBM_SURFACE_ALIGNMENT_PITCH_YUV);
-			_size = SIZE_ALIGN(_pitch * height, TBM_SURFACE_ALIGNMENT_PLANE);
-			_bo_idx = 0;
+	bufmgr_vc4 = (tbm_bufmgr_vc4)tbm_backend_get_bufmgr_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, -1);
+
+	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
+	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, -1);
+
+	/* the contents of a shared bo are needed by others */
+	if (!bo_vc4->reusable) {
+		TBM_VC4_ERROR("bo:%p is shared or in a slab, cannot be purged\n", bo);
+		return -1;
+	}
+
+	if (purgeable) {
+		/* the pages of the address or the dmabuf given out by
+		 * get_handle may be used at any time
+		 */
+		if (bo_vc4->map_cnt || bo_vc4->cpu_handle || bo_vc4->dmabuf_handle ||
+		    !_list_empty(&bo_vc4->ranges)) {
+			TBM_VC4_ERROR("bo:%p is mapped, cannot be purged\n", bo);
+			return -1;
 		}
-		break;
-	default:
-		bpp = 0;
-		break;
+
+		return _bo_madvise(bufmgr_vc4, bo_vc4, 0);
 	}
 
-	*size = _size;
-	*offset = _offset;
-	*pitch = _pitch;
-	*bo_idx = _bo_idx;
+	ret = _bo_willneed(bufmgr_vc4, bo_vc4);
+	if (ret < 0)
+		return -1;
+
+	TBM_VC4_DEBUG("bo:%p, gem:%d, retained:%d\n", bo, bo_vc4->gem, ret);
 
 	return ret;
 }
 
 int
-tbm_vc4_bo_get_flags(tbm_bo bo)
+tbm_vc4_bo_get_offset(tbm_bo bo)
 {
 	VC4_RETURN_VAL_IF_FAIL(bo != NULL, 0);
 
@@ -2070,26 +6435,95 @@ tbm_vc4_bo_get_flags(tbm_bo bo)
 	bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bo);
 	VC4_RETURN_VAL_IF_FAIL(bo_vc4 != NULL, 0);
 
-	return bo_vc4->flags_tbm;
+	return bo_vc4->offset;
 }
 
 int
-tbm_vc4_bufmgr_bind_native_display(tbm_bufmgr bufmgr, void *native_display)
+tbm_vc4_bo_alloc_batch(tbm_bufmgr bufmgr, int size, int flags, int count,
+		       int prefault, tbm_bo *bos)
 {
 	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct _vc4_bo_bucket *bucket;
+	unsigned int alloc_size;
+	vc4_list *item;
+	int missing;
+	int i;
+
+	VC4_RETURN_VAL_IF_FAIL(size > 0, 0);
+	VC4_RETURN_VAL_IF_FAIL(count > 0, 0);
+	VC4_RETURN_VAL_IF_FAIL(bos != NULL, 0);
 
 	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
 	VC4_RETURN_VAL_IF_FAIL(bufmgr_vc4 != NULL, 0);
 
-	if (!tbm_drm_helper_wl_auth_server_init(native_display, bufmgr_vc4->fd,
-					   bufmgr_vc4->device_name, 0)) {
-		TBM_VC4_ERROR("fail to tbm_drm_helper_wl_server_init\n");
-		return 0;
+	alloc_size = SIZE_ALIGN((unsigned int)size, TBM_VC4_PAGE_SIZE);
+
+	/* create the bos with their privates in one block and hand them to
+	 * tbm_bo_alloc through the bo cache.
+	 */
+	if (!_registry_reserve(&bufmgr_vc4->bos, count))
+		TBM_VC4_ERROR("fail to reserve the bo table(%d)\n", count);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+
+	bucket = _bo_cache_bucket_for_size(bufmgr_vc4, alloc_size);
+
+	/* the bos already in the bo cache are used first */
+	missing = count;
+	for (item = bucket ? bucket->head.next : NULL;
+	     item && item != &bucket->head && missing > 0; item = item->next) {
+		tbm_bo_vc4 bo_vc4 = vc4_container_of(item, struct _tbm_bo_vc4, cache_link);
+
+		if (bo_vc4->size >= alloc_size &&
+		    (bo_vc4->flags_tbm & ~TBM_BO_VENDOR) == (flags & ~TBM_BO_VENDOR))
+			missing--;
 	}
 
-	bufmgr_vc4->bind_display = native_display;
+	if (bucket && missing > 0 && _bo_priv_reserve(bufmgr_vc4, missing)) {
+		time_t time = _get_time();
+
+		if (bufmgr_vc4->use_bo_cache)
+			alloc_size = bucket->size;
+
+		for (i = 0; i < missing; i++) {
+			tbm_bo_vc4 bo_vc4 = _bo_create(bufmgr_vc4, alloc_size, flags);
+
+			if (!bo_vc4)
+				break;
+
+			_bo_cache_add(bufmgr_vc4, bucket, bo_vc4, time);
+		}
+	}
+
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+
+	for (i = 0; i < count; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, size, flags);
+		if (!bos[i]) {
+			TBM_VC4_ERROR("fail to allocate the bo(%d/%d)\n", i, count);
+			goto fail_alloc;
+		}
+
+		if (prefault) {
+			tbm_bo_vc4 bo_vc4 = (tbm_bo_vc4)tbm_backend_get_bo_priv(bos[i]);
+
+			if (bo_vc4)
+				_bo_mmap(bufmgr_vc4, bo_vc4, 1);
+		}
+	}
+
+	TBM_VC4_DEBUG("bos:%d, size:%d, flags:%d, prefault:%d\n",
+	    count, size, flags, prefault);
 
 	return 1;
+
+fail_alloc:
+	while (i-- > 0) {
+		tbm_bo_unref(bos[i]);
+		bos[i] = NULL;
+	}
+
+	return 0;
 }
 
 MODULEINITPPROTO(init_tbm_bufmgr_priv);
@@ -2107,6 +6541,7 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 {
 	tbm_bufmgr_backend bufmgr_backend;
 	tbm_bufmgr_vc4 bufmgr_vc4;
+	pthread_mutexattr_t attr;
 	int fp;
 
 	if (!bufmgr)
@@ -2118,6 +6553,22 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 		return 0;
 	}
 
+	bufmgr_vc4->broker_fd = -1;
+
+	_registry_init(&bufmgr_vc4->bos);
+	_registry_init(&bufmgr_vc4->names);
+	_registry_init(&bufmgr_vc4->inodes);
+	pthread_rwlock_init(&bufmgr_vc4->handle_lock, NULL);
+
+	/* the trim and the dmabuf export run with and without the lock */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&bufmgr_vc4->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	/* the inode index is decided by the first dmabufs, not probed here */
+	pthread_mutex_init(&bufmgr_vc4->probe_lock, NULL);
+
 	if (tbm_backend_is_display_server()) {
 		bufmgr_vc4->fd = tbm_drm_helper_get_master_fd();
 		if (bufmgr_vc4->fd < 0) {
@@ -2137,17 +6588,38 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 			tbm_drm_helper_unset_tbm_master_fd();
 			goto fail_get_device_name;
 		}
-		tbm_drm_helper_set_fd(bufmgr_bcm->fd);
+		tbm_drm_helper_set_fd(bufmgr_vc4->fd);
 	} else {
-		if (_check_render_node()) {
-			bufmgr_vc4->fd = _get_render_node();//TODO
+		if (_check_render_node() == 1) {
+			bufmgr_vc4->fd = _get_render_node();
 			if (bufmgr_vc4->fd < 0) {
 				TBM_VC4_ERROR("fail to get render node\n");
 				goto fail_get_render_node;
 			}
 			TBM_VC4_DEBUG("Use render node:%d\n", bufmgr_vc4->fd);
+
+			tbm_drm_helper_set_fd(bufmgr_vc4->fd);
 		} else {
-			if (!tbm_drm_helper_get_auth_info(&(bufmgr_vc4->fd), &(bufmgr_vc4->device_name), NULL)) {
+			char *broker = getenv("TBM_VC4_BROKER");
+
+			/* the broker of the display server gives an authenticated
+			 * fd in one round-trip, wayland is the fallback.
+			 */
+			bufmgr_vc4->fd = -1;
+			if (broker && broker[0]) {
+				struct _vc4_broker_req req = {0, };
+
+				req.type = BROKER_REQ_DRM_FD;
+				if (_broker_call(broker, &req, &bufmgr_vc4->fd, 1) != 1)
+					bufmgr_vc4->fd = -1;
+				else
+					bufmgr_vc4->device_name = drmGetDeviceNameFromFd(bufmgr_vc4->fd);
+
+				bufmgr_vc4->broker_path = strdup(broker);
+			}
+
+			if (bufmgr_vc4->fd < 0 &&
+			    !tbm_drm_helper_get_auth_info(&(bufmgr_vc4->fd), &(bufmgr_vc4->device_name), NULL)) {
 				TBM_VC4_ERROR("fail to get auth drm info!\n");
 				goto fail_get_auth_info;
 			}
@@ -2156,6 +6628,12 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 		}
 	}
 
+	/* the bos are shared by dmabuf only on a render node */
+	if (drmGetNodeTypeFromFd(bufmgr_vc4->fd) == DRM_NODE_RENDER) {
+		TBM_VC4_DEBUG("prime only mode\n");
+		bufmgr_vc4->render_node = 1;
+	}
+
 	//Check if the tbm manager supports dma fence or not.
 	fp = open("/sys/module/dmabuf_sync/parameters/enabled", O_RDONLY);
 	if (fp != -1) {
@@ -2173,8 +6651,126 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 		goto fail_init_cache_state;
 	}
 
-	/*Create Hash Table*/
-	bufmgr_vc4->hashBos = drmHashCreate();
+	_list_init(&bufmgr_vc4->priv_free);
+	_list_init(&bufmgr_vc4->slabs);
+
+	/* the tables grow on first insert */
+
+	/* the bo cache is enabled unless TBM_VC4_BO_CACHE=0 */
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_BO_CACHE");
+		if (!env || atoi(env))
+			bufmgr_vc4->use_bo_cache = 1;
+	}
+
+	_bo_cache_init(bufmgr_vc4);
+
+	/* the kernel bos are labeled while the kernel supports it */
+	bufmgr_vc4->use_label = 1;
+
+	/* the idle bos are marked purgeable unless TBM_VC4_MADVISE=0 */
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_MADVISE");
+		if (!env || atoi(env))
+			bufmgr_vc4->use_madvise = 1;
+	}
+
+	/* the number of dmabuf fds kept open is not limited unless
+	 * TBM_VC4_DMABUF_MAX is set.
+	 */
+	_list_init(&bufmgr_vc4->dmabuf_lru);
+	_list_init(&bufmgr_vc4->map_lru);
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_DMABUF_MAX");
+		if (env)
+			bufmgr_vc4->dmabuf_max = atoi(env);
+	}
+
+	/* the allocated bytes are not limited unless TBM_VC4_BUDGET_SOFT or
+	 * TBM_VC4_BUDGET_HARD is set. the sizes take a K, M or G suffix.
+	 */
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_BUDGET_SOFT");
+		if (env)
+			bufmgr_vc4->budget_soft = _parse_size(env);
+
+		env = getenv("TBM_VC4_BUDGET_HARD");
+		if (env)
+			bufmgr_vc4->budget_hard = _parse_size(env);
+	}
+
+	/* the bytes mapped to the cpu are not limited unless
+	 * TBM_VC4_MAP_BUDGET is set, the idle mappings are then unmapped and
+	 * mapped again on the next use.
+	 */
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_MAP_BUDGET");
+		if (env)
+			bufmgr_vc4->map_budget = _parse_size(env);
+	}
+
+	_bufmgr_copy_init(bufmgr_vc4);
+
+	/* trim on memory pressure if TBM_VC4_PRESSURE=1. TBM_VC4_PRESSURE_FILE
+	 * can point to the memory.pressure of a cgroup.
+	 */
+	bufmgr_vc4->pressure_fd = -1;
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_PRESSURE");
+		if (env && atoi(env)) {
+			char *file = getenv("TBM_VC4_PRESSURE_FILE");
+
+			_bufmgr_pressure_init(bufmgr_vc4, file ? file : PRESSURE_FILE);
+		}
+	}
+
+	/* the bos smaller than TBM_VC4_SLAB_THRESHOLD bytes are carved out of
+	 * shared slabs. the slab mode is disabled by default.
+	 */
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_SLAB_THRESHOLD");
+		if (env && atoi(env) > 0) {
+			bufmgr_vc4->slab_threshold = (unsigned int)atoi(env);
+			if (bufmgr_vc4->slab_threshold > SLAB_SIZE)
+				bufmgr_vc4->slab_threshold = SLAB_SIZE;
+		}
+	}
+
+	/* TBM_VC4_PREWARM lists the bos to create in the background so that
+	 * the first allocations are served by the bo cache.
+	 */
+	{
+		char *env;
+
+		env = getenv("TBM_VC4_PREWARM");
+		if (env && env[0])
+			_bo_prewarm_init(bufmgr_vc4, env);
+	}
+
+	/* the display server serves drm and dmabuf fds on the unix socket
+	 * TBM_VC4_BROKER, the clients with the same TBM_VC4_BROKER use it.
+	 */
+	if (tbm_backend_is_display_server() && !bufmgr_vc4->render_node) {
+		char *env;
+
+		env = getenv("TBM_VC4_BROKER");
+		if (env && env[0])
+			_bufmgr_broker_init(bufmgr_vc4, env);
+	}
 
 	bufmgr_backend = tbm_backend_alloc();
 	if (!bufmgr_backend) {
@@ -2200,7 +6796,7 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 	bufmgr_backend->bo_lock = tbm_vc4_bo_lock;
 	bufmgr_backend->bo_unlock = tbm_vc4_bo_unlock;
 
-	if (tbm_backend_is_display_server() && !_check_render_node())
+	if (tbm_backend_is_display_server() && !bufmgr_vc4->render_node)
 		bufmgr_backend->bufmgr_bind_native_display = tbm_vc4_bufmgr_bind_native_display;
 
 	if (!tbm_backend_init(bufmgr, bufmgr_backend)) {
@@ -2228,8 +6824,11 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 fail_init_backend:
 	tbm_backend_free(bufmgr_backend);
 fail_alloc_backend:
-	if (bufmgr_vc4->hashBos)
-		drmHashDestroy(bufmgr_vc4->hashBos);
+	_bufmgr_broker_fini(bufmgr_vc4);
+	_bufmgr_pressure_fini(bufmgr_vc4);
+	_bo_prewarm_fini(bufmgr_vc4);
+	_bo_cache_purge(bufmgr_vc4);
+	_bo_priv_fini(bufmgr_vc4);
 	_bufmgr_deinit_cache_state(bufmgr_vc4);
 fail_init_cache_state:
 	if (tbm_backend_is_display_server())
@@ -2238,9 +6837,17 @@ fail_init_cache_state:
 		tbm_drm_helper_unset_fd();
 fail_get_device_name:
 	close(bufmgr_vc4->fd);
+	free(bufmgr_vc4->device_name);
 fail_get_auth_info:
+	free(bufmgr_vc4->broker_path);
 fail_get_render_node:
 fail_open_drm:
+	_registry_fini(&bufmgr_vc4->bos);
+	_registry_fini(&bufmgr_vc4->names);
+	_registry_fini(&bufmgr_vc4->inodes);
+	pthread_rwlock_destroy(&bufmgr_vc4->handle_lock);
+	pthread_mutex_destroy(&bufmgr_vc4->probe_lock);
+	pthread_mutex_destroy(&bufmgr_vc4->lock);
 	free(bufmgr_vc4);
 	return 0;
 }
@@ -0,0 +1,396 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifndef __TBM_BUFMGR_VC4_H__
+#define __TBM_BUFMGR_VC4_H__
+
+#include <tbm_bufmgr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief usage labels of the bos.
+ * @details the label of a bo is given at allocation in the TBM_BO_VENDOR
+ * bits of the flags with TBM_VC4_BO_LABEL(), e.g.
+ * tbm_bo_alloc(bufmgr, size, TBM_BO_SCANOUT | TBM_VC4_BO_LABEL(TBM_VC4_LABEL_SCANOUT)).
+ * the kernel bo is labeled with DRM_IOCTL_VC4_LABEL_BO.
+ */
+typedef enum {
+	TBM_VC4_LABEL_NONE = 0,
+	TBM_VC4_LABEL_SCANOUT,
+	TBM_VC4_LABEL_VIDEO,
+	TBM_VC4_LABEL_TEXTURE,
+	TBM_VC4_LABEL_CURSOR,
+	TBM_VC4_LABEL_MAX
+} tbm_vc4_label;
+
+#define TBM_VC4_BO_LABEL(label)		(((label) & 0xff) << 16)
+#define TBM_VC4_BO_LABEL_GET(flags)	(((flags) >> 16) & 0xff)
+
+/**
+ * @brief the bos allocated by this process with a label.
+ */
+typedef struct _tbm_vc4_label_stats {
+	unsigned long count;           /**< bos currently allocated with the label */
+	unsigned long bytes;           /**< bytes of these bos */
+} tbm_vc4_label_stats;
+
+/**
+ * @brief statistics of the vc4 backend.
+ */
+typedef struct _tbm_vc4_stats {
+	unsigned long cache_hits;      /**< allocations served by the bo cache */
+	unsigned long cache_misses;    /**< allocations that went to the kernel */
+	unsigned long cache_evictions; /**< cached bos released to the kernel */
+	unsigned long cache_count;     /**< bos currently held by the bo cache */
+	unsigned long cache_bytes;     /**< bytes currently held by the bo cache */
+	unsigned long dmabuf_count;    /**< dmabuf fds currently kept open */
+	unsigned long dmabuf_evictions; /**< dmabuf fds closed to stay under the limit */
+	unsigned long slab_count;      /**< slabs currently allocated */
+	unsigned long slab_bos;        /**< bos currently carved out of the slabs */
+	unsigned long purgeable_marked; /**< times a bo was marked purgeable */
+	unsigned long purged;          /**< purgeable bos found purged by the kernel */
+	unsigned long alloc_bytes;     /**< bytes of the bos allocated by this process */
+	unsigned long import_bytes;    /**< bytes of the bos imported from others */
+	unsigned long map_bytes;       /**< bytes currently mapped to the cpu */
+	unsigned long map_evictions;   /**< idle mappings unmapped by TBM_VC4_MAP_BUDGET */
+	unsigned long remaps;          /**< bos mapped again after an eviction */
+	unsigned long budget_failures; /**< allocations refused by TBM_VC4_BUDGET_HARD */
+	unsigned long kernel_failures; /**< allocations refused by the kernel */
+	unsigned long trims;           /**< times the unused memory was released */
+	unsigned long prewarmed;       /**< bos put in the bo cache by TBM_VC4_PREWARM */
+	unsigned long import_calls;    /**< imports of a dmabuf fd */
+	unsigned long import_fast;     /**< imports of a known dmabuf found by its inode */
+	unsigned long import_syscalls; /**< syscalls made by the imports of a dmabuf fd */
+} tbm_vc4_stats;
+
+/**
+ * @brief get the statistics of the vc4 backend.
+ * @param[in] bufmgr : the buffer manager
+ * @param[out] stats : the statistics
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bufmgr_get_stats(tbm_bufmgr bufmgr, tbm_vc4_stats *stats);
+
+/**
+ * @brief get the statistics of the bos allocated with a label.
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] label : the label
+ * @param[out] stats : the statistics of the label
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bufmgr_get_label_stats(tbm_bufmgr bufmgr, tbm_vc4_label label,
+				   tbm_vc4_label_stats *stats);
+
+/**
+ * @brief change the label of a bo allocated by this process.
+ * @param[in] bo : the bo
+ * @param[in] label : the new label
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bo_set_label(tbm_bo bo, tbm_vc4_label label);
+
+/**
+ * @brief the exported fd is the one the bo keeps, see tbm_vc4_bo_export_fds().
+ */
+#define TBM_VC4_EXPORT_TRANSFER		(1 << 0)
+
+/**
+ * @brief export the dmabuf fds of several bos in one call.
+ * @details the fds are dups of the dmabuf fd each bo keeps. with
+ * TBM_VC4_EXPORT_TRANSFER the kept fd itself is handed out, which saves the
+ * dup when the fd is sent and closed right away. the fd of a bo which is
+ * locked, mapped or whose fd was given out by get_handle is still dupped.
+ * the caller closes the fds.
+ * @param[in] bos : the array of count bos
+ * @param[in] count : the number of bos
+ * @param[in] flags : 0 or TBM_VC4_EXPORT_TRANSFER
+ * @param[out] fds : the array of count fds
+ * @return 1 if this function succeeds, otherwise 0. on failure no fd is
+ * exported.
+ */
+int tbm_vc4_bo_export_fds(tbm_bo *bos, int count, int flags, tbm_fd *fds);
+
+#define TBM_VC4_PLANE_MAX		4
+
+/**
+ * @brief the layout of a shared bo, sent along with its dmabuf fd.
+ */
+typedef struct _tbm_vc4_bo_desc {
+	unsigned int size;             /**< size of the bo */
+	tbm_format format;             /**< format of the surface */
+	int num_planes;                /**< number of planes in the bo */
+	unsigned int offsets[TBM_VC4_PLANE_MAX]; /**< offset of each plane */
+	unsigned int pitches[TBM_VC4_PLANE_MAX]; /**< pitch of each plane */
+	uint64_t modifier;             /**< layout modifier of the surface */
+	unsigned int height;           /**< rows of the first plane, 0 if not known */
+} tbm_vc4_bo_desc;
+
+/**
+ * @brief import a dmabuf fd with the layout given by its exporter.
+ * @details the size of the descriptor is checked against the kernel once,
+ * when the dmabuf is imported for the first time, and replaces the probing
+ * of the size. each plane has to fit in the size with its pitch and its
+ * rows, which follow from the height and the format. the descriptor is kept
+ * by the bo, a later import of the same dmabuf with a new descriptor
+ * replaces it without the kernel. it imports through tbm_bo_import_fd()
+ * and fails when called within another import of the thread.
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] fd : the dmabuf fd
+ * @param[in] desc : the layout of the bo
+ * @return the bo if this function succeeds, otherwise NULL.
+ */
+tbm_bo tbm_vc4_bo_import_fd_desc(tbm_bufmgr bufmgr, tbm_fd fd,
+				 const tbm_vc4_bo_desc *desc);
+
+/**
+ * @brief import the dmabuf fds of a multi-plane surface in one call.
+ * @details the fds which refer to the same dmabuf get the same bo, with a
+ * reference for each of them. it fails when called within another import
+ * of the thread, like tbm_vc4_bo_import_fd_desc().
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] fds : the array of count dmabuf fds
+ * @param[in] count : the number of fds
+ * @param[out] bos : the array of count bos, unref each of them
+ * @return 1 if this function succeeds, otherwise 0. on failure no bo is
+ * imported.
+ */
+int tbm_vc4_bo_import_fds(tbm_bufmgr bufmgr, tbm_fd *fds, int count,
+			  tbm_bo *bos);
+
+/**
+ * @brief get the layout a bo was imported with.
+ * @param[in] bo : the bo
+ * @param[out] desc : the layout of the bo
+ * @return 1 if the bo has a layout, otherwise 0.
+ */
+int tbm_vc4_bo_get_desc(tbm_bo bo, tbm_vc4_bo_desc *desc);
+
+/**
+ * @brief find the bo which owns a gem handle.
+ * @details the handle is the TBM_DEVICE_DEFAULT/2D handle of the bo. the
+ * gem handle of a slab is not owned by a bo, see tbm_vc4_bo_get_offset().
+ * it fails when called within another import of the thread, like
+ * tbm_vc4_bo_import_fd_desc().
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] handle : the gem handle
+ * @return the bo with a reference if it is alive, otherwise NULL. the
+ * caller drops the reference with tbm_bo_unref().
+ */
+tbm_bo tbm_vc4_bufmgr_get_bo(tbm_bufmgr bufmgr, unsigned int handle);
+
+/**
+ * @brief the function called on each bo by tbm_vc4_bufmgr_foreach_bo().
+ * @return 0 to stop, otherwise 1.
+ */
+typedef int (*tbm_vc4_bo_func)(tbm_bo bo, void *user_data);
+
+/**
+ * @brief call a function on each live bo of the buffer manager.
+ * @details the function is called without the locks of the backend and
+ * may use the buffer manager. the bo is held by a reference during the
+ * call, the bos freed meanwhile are skipped.
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] func : the function
+ * @param[in] user_data : the data given to the function
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bufmgr_foreach_bo(tbm_bufmgr bufmgr, tbm_vc4_bo_func func,
+			      void *user_data);
+
+/**
+ * @brief import bos of the display server by their keys through its broker.
+ * @details with TBM_VC4_BROKER set to the path of a unix socket, the display
+ * server serves authenticated drm fds and the dmabuf fds of its bos on it.
+ * the other processes with the same TBM_VC4_BROKER get their drm fd from
+ * it at init instead of the wayland authentication, and may import the
+ * bos of the display server with this function, in one round-trip. the
+ * socket is created 0600 in a directory of the display server that only
+ * it may access, and only the processes of its user and group are served.
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] keys : the array of count keys, given by tbm_bo_export()
+ * @param[in] count : the number of keys, up to 16
+ * @param[out] bos : the array of count bos
+ * @return 1 if this function succeeds, otherwise 0. on failure no bo is
+ * imported.
+ */
+int tbm_vc4_bufmgr_broker_import(tbm_bufmgr bufmgr, unsigned int *keys,
+				 int count, tbm_bo *bos);
+
+/**
+ * @brief release the memory the backend keeps but does not use.
+ * @details the bo cache is emptied, and the dmabuf fds and the cpu mappings
+ * of the idle bos are closed. this is also done on memory pressure if
+ * TBM_VC4_PRESSURE=1.
+ * @param[in] bufmgr : the buffer manager
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bufmgr_trim(tbm_bufmgr bufmgr);
+
+/**
+ * @brief how the cpu mapping of a bo is accessed, see tbm_vc4_bo_set_access().
+ */
+typedef enum {
+	TBM_VC4_ACCESS_NONE = 0,         /**< no hint, pages fault in on first touch */
+	TBM_VC4_ACCESS_SEQUENTIAL_WRITE, /**< written front to back, e.g. a decoded frame */
+	TBM_VC4_ACCESS_RANDOM_READ,      /**< read at random, no readahead */
+	TBM_VC4_ACCESS_UPLOAD_ONCE,      /**< written once, then only used by the devices */
+	TBM_VC4_ACCESS_MAX
+} tbm_vc4_access;
+
+/**
+ * @brief give a hint on the cpu access of a bo.
+ * @details the sequential write and upload once bos are mapped with their
+ * pages faulted in, and the mapping of an upload once bo is the first one
+ * unmapped when TBM_VC4_MAP_BUDGET is reached. the hint of a bo already
+ * mapped applies right away. the hint is reset when the bo is freed. the
+ * prefault saves nothing on the cma bos, whose pages are all mapped at
+ * mmap time.
+ * @param[in] bo : the bo
+ * @param[in] access : the access hint
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bo_set_access(tbm_bo bo, tbm_vc4_access access);
+
+/**
+ * @brief map a window of a bo to the cpu.
+ * @details the window is in the cpu mapping of the whole bo, which is made
+ * if needed. with the cache control of the backend (ENABLE_CACHECRTL, not
+ * built by default), the cache maintenance is limited to the window while
+ * it is the only map of the bo. the window is unmapped with
+ * tbm_vc4_bo_unmap_range(), or when the bo is freed.
+ * @param[in] bo : the bo
+ * @param[in] opt : TBM_OPTION_READ and/or TBM_OPTION_WRITE
+ * @param[in] offset : the offset of the window in the bo
+ * @param[in] size : the size of the window
+ * @return the address of the window if this function succeeds, otherwise NULL.
+ */
+void *tbm_vc4_bo_map_range(tbm_bo bo, int opt, unsigned int offset,
+			   unsigned int size);
+
+/**
+ * @brief unmap a window mapped by tbm_vc4_bo_map_range().
+ * @param[in] bo : the bo
+ * @param[in] ptr : the address returned by tbm_vc4_bo_map_range()
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bo_unmap_range(tbm_bo bo, void *ptr);
+
+/**
+ * @brief write to a bo with the copy kernel of the cpu.
+ * @details the cpu mappings of the bos are write-combined, the data is
+ * written in aligned bursts, with streaming or neon stores when the cpu
+ * has them. TBM_VC4_COPY=scalar forces the fallback kernel.
+ * @param[in] bo : the bo
+ * @param[in] offset : the offset in the bo
+ * @param[in] src : the data to write
+ * @param[in] size : the size of the data
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bo_write(tbm_bo bo, unsigned int offset, const void *src,
+		     unsigned int size);
+
+/**
+ * @brief read from a bo with the copy kernel of the cpu.
+ * @details the reads of the write-combined mapping are not cached, the
+ * data is read in large vector loads, the streaming ones of SSE4.1 on x86,
+ * through a cached bounce buffer.
+ * @param[in] bo : the bo
+ * @param[in] offset : the offset in the bo
+ * @param[out] dst : the buffer to read to
+ * @param[in] size : the size of the data
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int tbm_vc4_bo_read(tbm_bo bo, unsigned int offset, void *dst,
+		    unsigned int size);
+
+/**
+ * @brief map one plane of a surface to the cpu.
+ * @details the window of the plane is the one given by
+ * tbm_vc4_surface_get_plane_data(), the bo is the bo of the plane. the
+ * plane is unmapped with tbm_vc4_bo_unmap_range().
+ * @param[in] bo : the bo of the plane
+ * @param[in] opt : TBM_OPTION_READ and/or TBM_OPTION_WRITE
+ * @param[in] width : the width of the surface
+ * @param[in] height : the height of the surface
+ * @param[in] format : the format of the surface
+ * @param[in] plane_idx : the index of the plane
+ * @param[out] pitch : the pitch of the plane, may be NULL
+ * @return the address of the plane if this function succeeds, otherwise NULL.
+ */
+void *tbm_vc4_bo_map_plane(tbm_bo bo, int opt, int width, int height,
+			   tbm_format format, int plane_idx, uint32_t *pitch);
+
+/**
+ * @brief mark a bo purgeable or not.
+ * @details the kernel may reclaim the pages of a purgeable bo. the bo must
+ * be marked not purgeable before it is used again. if the kernel purged it,
+ * the bo gets new pages and its contents are lost. shared bos cannot be
+ * marked purgeable.
+ * @param[in] bo : the bo
+ * @param[in] purgeable : 1 to mark the bo purgeable, 0 to use it again
+ * @return 1 if the contents of the bo are retained, 0 if they were purged,
+ * -1 on error.
+ */
+int tbm_vc4_bo_set_purgeable(tbm_bo bo, int purgeable);
+
+/**
+ * @brief get the offset of the bo in its gem object.
+ * @details a bo smaller than TBM_VC4_SLAB_THRESHOLD is carved out of a gem
+ * object shared with other bos, and starts at this offset in it. only the
+ * TBM_DEVICE_CPU handle of such a bo can be taken, it already points to
+ * the bo. its TBM_DEVICE_DEFAULT/2D/3D/MM handles are refused and it
+ * cannot be exported, they would give access to the whole gem object.
+ * @param[in] bo : the bo
+ * @return the offset of the bo, 0 for a bo which has its own gem object.
+ */
+int tbm_vc4_bo_get_offset(tbm_bo bo);
+
+/**
+ * @brief allocate count bos of the same size and flags in one call.
+ * @param[in] bufmgr : the buffer manager
+ * @param[in] size : the size of each bo
+ * @param[in] flags : the flags of each bo
+ * @param[in] count : the number of bos
+ * @param[in] prefault : if not 0, the cpu mappings of the bos are prefaulted
+ * @param[out] bos : the array of count bos
+ * @return 1 if this function succeeds, otherwise 0. on failure no bo is
+ * allocated.
+ */
+int tbm_vc4_bo_alloc_batch(tbm_bufmgr bufmgr, int size, int flags, int count,
+			   int prefault, tbm_bo *bos);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TBM_BUFMGR_VC4_H__ */
@@ -0,0 +1,657 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <xf86drm.h>
+#include <vc4_drm.h>
+
+#include "fake_drm.h"
+
+#define FAKE_APERTURE	(1ULL << 36)
+#define FAKE_OBJ_MAX	(1 << 18)
+#define FAKE_PAGE	4096
+#define FAKE_INO_SLOTS	(FAKE_OBJ_MAX * 2)
+
+#ifndef KCMP_FILE
+#define KCMP_FILE	0
+#endif
+
+typedef struct _fake_obj {
+	int used;
+	uint32_t size;
+	uint64_t offset;      /* in the aperture */
+	uint32_t name;        /* flink name, 0 if none */
+	int handles;          /* handles of the object */
+	int prime;            /* the handle given back by FD_TO_PRIME, 0 if none */
+	int dmabuf;           /* the dmabuf file, dups are given out, -1 if none */
+	dev_t dev;            /* identity of the dmabuf once closed here */
+	ino_t ino;
+	int madv;
+	int purged;
+	int foreign;          /* made by another device */
+} fake_obj;
+
+static struct {
+	pthread_mutex_t lock;
+	fake_drm_config config;
+	int fd;               /* the drm fd, a memfd of the aperture */
+	ino_t ino;
+	uint64_t top;         /* first free offset of the aperture */
+	uint32_t next_name;
+	fake_obj *objs;       /* indexed by the object id */
+	int num_objs;
+	int *handles;         /* handle to object id + 1, 0 if free */
+	int *inodes;          /* open addressing by dmabuf inode, object id + 1 */
+	int next_handle;
+	unsigned long counts[FAKE_COUNT_MAX];
+	int fails[FAKE_COUNT_MAX];
+	int errors;
+	void (*hook)(unsigned long request, void *arg);
+} fake = { PTHREAD_MUTEX_INITIALIZER, };
+
+static int
+_fake_memfd(const char *name, uint64_t size)
+{
+	int fd = syscall(__NR_memfd_create, name, 0);
+
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+_fake_same_file(int fd, struct stat *st, fake_obj *obj)
+{
+	pid_t pid = getpid();
+
+	if (!obj->dev || st->st_dev != obj->dev || st->st_ino != obj->ino)
+		return 0;
+
+	if (obj->dmabuf >= 0)
+		return syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd, obj->dmabuf) == 0;
+
+	/* closed here, only the per-bo inodes tell the files apart */
+	return !fake.config.shared_inode;
+}
+
+static int
+_fake_ino_slot(ino_t ino)
+{
+	return (int)((ino * 2654435761u) % FAKE_INO_SLOTS);
+}
+
+static int
+_fake_new_handle(int id)
+{
+	int h, i;
+
+	for (i = 1; i < FAKE_OBJ_MAX; i++) {
+		h = (fake.next_handle + i) % FAKE_OBJ_MAX;
+		if (h && !fake.handles[h]) {
+			fake.handles[h] = id + 1;
+			fake.objs[id].handles++;
+			fake.next_handle = h;
+			return h;
+		}
+	}
+
+	return 0;
+}
+
+static fake_obj *
+_fake_lookup(uint32_t handle)
+{
+	if (handle == 0 || handle >= FAKE_OBJ_MAX || !fake.handles[handle]) {
+		fake.errors++;
+		return NULL;
+	}
+
+	return &fake.objs[fake.handles[handle] - 1];
+}
+
+static int
+_fake_new_obj(uint32_t size)
+{
+	int id;
+
+	if (fake.num_objs == FAKE_OBJ_MAX)
+		return -1;
+
+	size = (size + FAKE_PAGE - 1) & ~(FAKE_PAGE - 1);
+	if (fake.top + size > FAKE_APERTURE)
+		return -1;
+
+	id = fake.num_objs++;
+	memset(&fake.objs[id], 0, sizeof(fake_obj));
+	fake.objs[id].used = 1;
+	fake.objs[id].size = size;
+	fake.objs[id].offset = fake.top;
+	fake.objs[id].dmabuf = -1;
+	fake.top += size;
+
+	return id;
+}
+
+static void
+_fake_punch(fake_obj *obj)
+{
+	fallocate(fake.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  obj->offset, obj->size);
+}
+
+static int
+_fake_export(fake_obj *obj, uint32_t flags)
+{
+	struct stat st;
+
+	if (obj->dmabuf < 0) {
+		if (fake.config.shared_inode)
+			obj->dmabuf = eventfd(0, EFD_CLOEXEC);
+		else
+			obj->dmabuf = _fake_memfd("fake-dmabuf", obj->size);
+		if (obj->dmabuf < 0)
+			return -1;
+
+		/* an object keeps its file, the inode is indexed once */
+		if (!obj->dev) {
+			int slot;
+
+			fstat(obj->dmabuf, &st);
+			obj->dev = st.st_dev;
+			obj->ino = st.st_ino;
+
+			slot = _fake_ino_slot(obj->ino);
+			while (fake.inodes[slot])
+				slot = (slot + 1) % FAKE_INO_SLOTS;
+			fake.inodes[slot] = obj - fake.objs + 1;
+		}
+	}
+
+	return fcntl(obj->dmabuf, (flags & DRM_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+}
+
+static void
+_fake_close_handle(uint32_t handle)
+{
+	fake_obj *obj = _fake_lookup(handle);
+
+	if (!obj)
+		return;
+
+	fake.handles[handle] = 0;
+	if (obj->prime == (int)handle)
+		obj->prime = 0;
+	if (--obj->handles > 0)
+		return;
+
+	/* the dmabufs given out keep the object, it is found again by the
+	 * inode of the file
+	 */
+	if (obj->dmabuf >= 0) {
+		close(obj->dmabuf);
+		obj->dmabuf = -1;
+	}
+	if (!obj->dev) {
+		_fake_punch(obj);
+		obj->used = 0;
+	}
+}
+
+static int
+_fake_index(unsigned long request)
+{
+	switch (request) {
+	case DRM_IOCTL_VC4_CREATE_BO:
+		return FAKE_CREATE_BO;
+	case DRM_IOCTL_VC4_MMAP_BO:
+		return FAKE_MMAP_BO;
+	case DRM_IOCTL_VC4_GEM_MADVISE:
+		return FAKE_MADVISE;
+	case DRM_IOCTL_VC4_LABEL_BO:
+		return FAKE_LABEL_BO;
+	case DRM_IOCTL_GEM_CLOSE:
+		return FAKE_GEM_CLOSE;
+	case DRM_IOCTL_GEM_FLINK:
+		return FAKE_GEM_FLINK;
+	case DRM_IOCTL_GEM_OPEN:
+		return FAKE_GEM_OPEN;
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+		return FAKE_PRIME_TO_FD;
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+		return FAKE_FD_TO_PRIME;
+	}
+
+	return -1;
+}
+
+int
+drmIoctl(int fd, unsigned long request, void *arg)
+{
+	int ret = 0;
+	int err = 0;
+	fake_obj *obj;
+	int i;
+
+	if (fake.hook)
+		fake.hook(request, arg);
+
+	pthread_mutex_lock(&fake.lock);
+
+	i = _fake_index(request);
+	if (i >= 0) {
+		fake.counts[i]++;
+		if (fake.fails[i] > 0) {
+			fake.fails[i]--;
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	if (request == DRM_IOCTL_VC4_CREATE_BO) {
+		struct drm_vc4_create_bo *a = arg;
+		int id;
+
+		id = a->size ? _fake_new_obj(a->size) : -1;
+		if (id < 0 || !(a->handle = _fake_new_handle(id)))
+			err = id < 0 ? ENOMEM : EMFILE;
+	} else if (request == DRM_IOCTL_VC4_MMAP_BO) {
+		struct drm_vc4_mmap_bo *a = arg;
+
+		obj = _fake_lookup(a->handle);
+		if (obj)
+			a->offset = obj->offset;
+		else
+			err = EINVAL;
+	} else if (request == DRM_IOCTL_VC4_GEM_MADVISE) {
+		struct drm_vc4_gem_madvise *a = arg;
+
+		obj = fake.config.no_madvise ? NULL : _fake_lookup(a->handle);
+		if (fake.config.no_madvise) {
+			err = ENOTTY;
+		} else if (!obj || obj->foreign) {
+			err = EINVAL;
+		} else {
+			a->retained = !obj->purged;
+			if (!obj->purged)
+				obj->madv = a->madv;
+		}
+	} else if (request == DRM_IOCTL_VC4_LABEL_BO) {
+		struct drm_vc4_label_bo *a = arg;
+
+		if (fake.config.no_label)
+			err = ENOTTY;
+		else if (!_fake_lookup(a->handle))
+			err = ENOENT;
+	} else if (request == DRM_IOCTL_GEM_CLOSE) {
+		struct drm_gem_close *a = arg;
+
+		if (_fake_lookup(a->handle))
+			_fake_close_handle(a->handle);
+		else
+			err = EINVAL;
+	} else if (request == DRM_IOCTL_GEM_FLINK) {
+		struct drm_gem_flink *a = arg;
+
+		obj = fake.config.render_node ? NULL : _fake_lookup(a->handle);
+		if (fake.config.render_node) {
+			err = EACCES;
+		} else if (!obj) {
+			err = ENOENT;
+		} else {
+			if (!obj->name)
+				obj->name = ++fake.next_name;
+			a->name = obj->name;
+		}
+	} else if (request == DRM_IOCTL_GEM_OPEN) {
+		struct drm_gem_open *a = arg;
+
+		err = ENOENT;
+		for (i = 0; i < fake.num_objs; i++) {
+			obj = &fake.objs[i];
+			if (obj->used && obj->handles && a->name && obj->name == a->name) {
+				a->handle = _fake_new_handle(i);
+				a->size = obj->size;
+				err = a->handle ? 0 : EMFILE;
+				break;
+			}
+		}
+	} else if (request == DRM_IOCTL_PRIME_HANDLE_TO_FD) {
+		struct drm_prime_handle *a = arg;
+
+		obj = _fake_lookup(a->handle);
+		if (!obj || (a->fd = _fake_export(obj, a->flags)) < 0)
+			err = obj ? EMFILE : ENOENT;
+		else if (!obj->prime)
+			obj->prime = a->handle;
+	} else if (request == DRM_IOCTL_PRIME_FD_TO_HANDLE) {
+		struct drm_prime_handle *a = arg;
+		struct stat st;
+		int slot;
+
+		/* a file already imported gives back the same handle */
+		err = EBADF;
+		slot = fstat(a->fd, &st) == 0 ? _fake_ino_slot(st.st_ino) : -1;
+		for (; slot >= 0 && fake.inodes[slot]; slot = (slot + 1) % FAKE_INO_SLOTS) {
+			i = fake.inodes[slot] - 1;
+			obj = &fake.objs[i];
+			if (!obj->used || !_fake_same_file(a->fd, &st, obj))
+				continue;
+
+			err = 0;
+			if (!obj->prime) {
+				obj->prime = _fake_new_handle(i);
+				if (obj->dmabuf < 0)
+					obj->dmabuf = fcntl(a->fd, F_DUPFD_CLOEXEC, 0);
+			}
+			a->handle = obj->prime;
+			break;
+		}
+	} else {
+		err = ENOTTY;
+	}
+
+out:
+	pthread_mutex_unlock(&fake.lock);
+
+	if (err) {
+		errno = err;
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int
+drmOpen(const char *name, const char *busid)
+{
+	return fcntl(fake.fd, F_DUPFD_CLOEXEC, 0);
+}
+
+int
+drmGetMagic(int fd, drm_magic_t *magic)
+{
+	static drm_magic_t next;
+
+	*magic = __sync_add_and_fetch(&next, 1);
+
+	return 0;
+}
+
+int
+drmAuthMagic(int fd, drm_magic_t magic)
+{
+	return magic ? 0 : -EINVAL;
+}
+
+int
+drmGetNodeTypeFromFd(int fd)
+{
+	return fake.config.render_node ? DRM_NODE_RENDER : DRM_NODE_PRIMARY;
+}
+
+char *
+drmGetDeviceNameFromFd(int fd)
+{
+	return strdup(fake.config.render_node ? "/dev/dri/renderD128" : "/dev/dri/card0");
+}
+
+#ifdef __LP64__
+/* the kernels before the partial mmap support of vc4 map a bo from its
+ * start whatever the offset into it.
+ */
+void *
+mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	struct stat st;
+
+	if (fake.config.mmap_whole && fd >= 0 && fstat(fd, &st) == 0 &&
+	    st.st_ino == fake.ino) {
+		int i;
+
+		pthread_mutex_lock(&fake.lock);
+		for (i = 0; i < fake.num_objs; i++) {
+			fake_obj *obj = &fake.objs[i];
+
+			if (obj->used && (uint64_t)offset >= obj->offset &&
+			    (uint64_t)offset < obj->offset + obj->size) {
+				offset = obj->offset;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&fake.lock);
+	}
+
+	return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+#endif
+
+int
+fake_drm_open(const fake_drm_config *config)
+{
+	struct stat st;
+
+	pthread_mutex_lock(&fake.lock);
+
+	memset(fake.counts, 0, sizeof(fake.counts));
+	memset(fake.fails, 0, sizeof(fake.fails));
+	if (config)
+		fake.config = *config;
+	else
+		memset(&fake.config, 0, sizeof(fake.config));
+
+	free(fake.objs);
+	free(fake.handles);
+	free(fake.inodes);
+	fake.objs = calloc(FAKE_OBJ_MAX, sizeof(fake_obj));
+	fake.handles = calloc(FAKE_OBJ_MAX, sizeof(int));
+	fake.inodes = calloc(FAKE_INO_SLOTS, sizeof(int));
+	fake.fd = _fake_memfd("fake-vc4", FAKE_APERTURE);
+	if (!fake.objs || !fake.handles || !fake.inodes || fake.fd < 0) {
+		free(fake.objs);
+		free(fake.handles);
+		free(fake.inodes);
+		fake.objs = NULL;
+		fake.handles = NULL;
+		fake.inodes = NULL;
+		pthread_mutex_unlock(&fake.lock);
+		return -1;
+	}
+
+	fstat(fake.fd, &st);
+	fake.ino = st.st_ino;
+	fake.top = FAKE_PAGE;
+	fake.next_handle = 0;
+	fake.num_objs = 0;
+	fake.errors = 0;
+	fake.hook = NULL;
+
+	pthread_mutex_unlock(&fake.lock);
+
+	return fake.fd;
+}
+
+void
+fake_drm_close(void)
+{
+	int i;
+
+	pthread_mutex_lock(&fake.lock);
+
+	/* the objects are kept until the next open to look for leaks */
+	for (i = 0; i < fake.num_objs; i++) {
+		if (fake.objs[i].dmabuf >= 0)
+			close(fake.objs[i].dmabuf);
+		fake.objs[i].dmabuf = -1;
+	}
+	close(fake.fd);
+	fake.fd = -1;
+
+	pthread_mutex_unlock(&fake.lock);
+}
+
+unsigned long
+fake_drm_count(int request)
+{
+	return fake.counts[request];
+}
+
+unsigned long
+fake_drm_count_all(void)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i < FAKE_COUNT_MAX; i++)
+		n += fake.counts[i];
+
+	return n;
+}
+
+void
+fake_drm_reset_counts(void)
+{
+	pthread_mutex_lock(&fake.lock);
+	memset(fake.counts, 0, sizeof(fake.counts));
+	pthread_mutex_unlock(&fake.lock);
+}
+
+int
+fake_drm_objects(void)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&fake.lock);
+	for (i = 0; i < fake.num_objs; i++) {
+		if (fake.objs[i].used && fake.objs[i].handles)
+			n++;
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	return n;
+}
+
+int
+fake_drm_handles(void)
+{
+	int h, n = 0;
+
+	pthread_mutex_lock(&fake.lock);
+	for (h = 1; h < FAKE_OBJ_MAX; h++) {
+		if (fake.handles[h])
+			n++;
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	return n;
+}
+
+int
+fake_drm_errors(void)
+{
+	return fake.errors;
+}
+
+int
+fake_drm_purge(void)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&fake.lock);
+	for (i = 0; i < fake.num_objs; i++) {
+		fake_obj *obj = &fake.objs[i];
+
+		if (obj->used && obj->handles && obj->madv == VC4_MADV_DONTNEED &&
+		    !obj->purged) {
+			_fake_punch(obj);
+			obj->purged = 1;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	return n;
+}
+
+int
+fake_drm_foreign_dmabuf(uint32_t size)
+{
+	int id, fd = -1;
+
+	pthread_mutex_lock(&fake.lock);
+	id = _fake_new_obj(size);
+	if (id >= 0) {
+		fake.objs[id].foreign = 1;
+		fd = _fake_export(&fake.objs[id], DRM_CLOEXEC);
+		/* only the dmabuf holds it until it is imported. the files of
+		 * one shared inode are told apart by the one kept here.
+		 */
+		if (!fake.config.shared_inode) {
+			close(fake.objs[id].dmabuf);
+			fake.objs[id].dmabuf = -1;
+		}
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	return fd;
+}
+
+void
+fake_drm_fail(int request, int count)
+{
+	pthread_mutex_lock(&fake.lock);
+	fake.fails[request] = count;
+	pthread_mutex_unlock(&fake.lock);
+}
+
+void
+fake_drm_set_hook(void (*hook)(unsigned long request, void *arg))
+{
+	fake.hook = hook;
+}
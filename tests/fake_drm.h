@@ -0,0 +1,95 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifndef __FAKE_DRM_H__
+#define __FAKE_DRM_H__
+
+#include <stdint.h>
+
+/* a vc4 device emulated in the process. the bos live in a sparse memfd
+ * which is also the drm fd, so the MMAP_BO offsets can be mmapped for
+ * real. the dmabufs are memfds of the size of their bo, one inode per bo,
+ * or eventfds sharing one inode like the kernels older than 5.3.
+ */
+
+/* the requests counted by fake_drm_count() */
+enum {
+	FAKE_CREATE_BO,
+	FAKE_MMAP_BO,
+	FAKE_MADVISE,
+	FAKE_LABEL_BO,
+	FAKE_GEM_CLOSE,
+	FAKE_GEM_FLINK,
+	FAKE_GEM_OPEN,
+	FAKE_PRIME_TO_FD,
+	FAKE_FD_TO_PRIME,
+	FAKE_COUNT_MAX
+};
+
+/* behaviour of the device, set before fake_drm_open() */
+typedef struct _fake_drm_config {
+	int shared_inode;      /* all the dmabufs share one inode */
+	int render_node;       /* the drm fd is a render node, no flink */
+	int no_madvise;        /* GEM_MADVISE is not supported */
+	int no_label;          /* LABEL_BO is not supported */
+	int mmap_whole;        /* MMAP_BO offsets only map from the start of the bo */
+} fake_drm_config;
+
+/* open the device, dups of the fd are given out as the drm fds. the
+ * objects are kept after the close until the next open.
+ */
+int fake_drm_open(const fake_drm_config *config);
+void fake_drm_close(void);
+
+/* number of ioctls of a request since the last reset */
+unsigned long fake_drm_count(int request);
+unsigned long fake_drm_count_all(void);
+void fake_drm_reset_counts(void);
+
+/* number of live gem objects and handles, and of the requests on unknown
+ * handles, which are bugs of the backend
+ */
+int fake_drm_objects(void);
+int fake_drm_handles(void);
+int fake_drm_errors(void);
+
+/* purge the contents of the bos marked DONTNEED, return their number */
+int fake_drm_purge(void);
+
+/* a dmabuf of another device, GEM_MADVISE fails with EINVAL on its bo */
+int fake_drm_foreign_dmabuf(uint32_t size);
+
+/* fail the next count requests of a type with ENOMEM */
+void fake_drm_fail(int request, int count);
+
+/* called before each ioctl, outside of the device lock */
+void fake_drm_set_hook(void (*hook)(unsigned long request, void *arg));
+
+#endif /* __FAKE_DRM_H__ */
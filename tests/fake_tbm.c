@@ -0,0 +1,469 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <xf86drm.h>
+#include <tbm_bufmgr.h>
+#include <tbm_bufmgr_backend.h>
+#include <tbm_drm_helper.h>
+
+#include "fake_tbm.h"
+
+#define BO_HASH_SIZE	4096
+
+struct _tbm_bufmgr {
+	tbm_bufmgr_backend backend;
+	pthread_rwlock_t bo_lock;     /* the imports against the frees */
+	pthread_mutex_t list_lock;
+	struct _tbm_bo *list;
+	/* the bos by priv. libtbm walks the list, which would dominate the
+	 * benchmarks of the imports.
+	 */
+	struct _tbm_bo *hash[BO_HASH_SIZE];
+	int count;
+};
+
+struct _tbm_bo {
+	tbm_bufmgr bufmgr;
+	void *priv;
+	int ref_cnt;
+	struct _tbm_bo *prev, *next;
+	struct _tbm_bo *hash_next;
+};
+
+#define BO_HASH(priv)	((((uintptr_t)(priv)) >> 6) % BO_HASH_SIZE)
+
+extern TBMModuleData tbmModuleData;
+
+static int display_server = 1;
+static int master_fd = -1;
+static int init_fails;
+
+/* the backend side */
+
+tbm_bufmgr_backend
+tbm_backend_alloc(void)
+{
+	return calloc(1, sizeof(struct _tbm_bufmgr_backend));
+}
+
+void
+tbm_backend_free(tbm_bufmgr_backend backend)
+{
+	free(backend);
+}
+
+int
+tbm_backend_init(tbm_bufmgr bufmgr, tbm_bufmgr_backend backend)
+{
+	if (init_fails > 0) {
+		init_fails--;
+		return 0;
+	}
+
+	bufmgr->backend = backend;
+
+	return 1;
+}
+
+void *
+tbm_backend_get_bufmgr_priv(tbm_bo bo)
+{
+	return bo->bufmgr->backend->priv;
+}
+
+void *
+tbm_backend_get_bo_priv(tbm_bo bo)
+{
+	return bo->priv;
+}
+
+void *
+tbm_backend_get_priv_from_bufmgr(tbm_bufmgr bufmgr)
+{
+	return bufmgr->backend->priv;
+}
+
+int
+tbm_backend_is_display_server(void)
+{
+	return display_server;
+}
+
+int
+tbm_drm_helper_wl_auth_server_init(void *wl_display, int fd,
+				   const char *device_name, uint32_t flags)
+{
+	return 1;
+}
+
+void
+tbm_drm_helper_wl_auth_server_deinit(void)
+{
+}
+
+int
+tbm_drm_helper_get_master_fd(void)
+{
+	return master_fd >= 0 ? fcntl(master_fd, F_DUPFD_CLOEXEC, 0) : -1;
+}
+
+void
+tbm_drm_helper_set_tbm_master_fd(int fd)
+{
+}
+
+void
+tbm_drm_helper_unset_tbm_master_fd(void)
+{
+}
+
+int
+tbm_drm_helper_get_auth_info(int *auth_fd, char **device, uint32_t *capabilities)
+{
+	if (master_fd < 0)
+		return 0;
+
+	*auth_fd = fcntl(master_fd, F_DUPFD_CLOEXEC, 0);
+	if (device)
+		*device = drmGetDeviceNameFromFd(*auth_fd);
+	if (capabilities)
+		*capabilities = 0;
+
+	return 1;
+}
+
+void
+tbm_drm_helper_set_fd(int fd)
+{
+}
+
+void
+tbm_drm_helper_unset_fd(void)
+{
+}
+
+/* the libtbm side */
+
+static void
+_bo_link(tbm_bufmgr bufmgr, tbm_bo bo)
+{
+	bo->hash_next = bufmgr->hash[BO_HASH(bo->priv)];
+	bufmgr->hash[BO_HASH(bo->priv)] = bo;
+
+	bo->prev = NULL;
+	bo->next = bufmgr->list;
+	if (bufmgr->list)
+		bufmgr->list->prev = bo;
+	bufmgr->list = bo;
+	bufmgr->count++;
+}
+
+static void
+_bo_unlink(tbm_bufmgr bufmgr, tbm_bo bo)
+{
+	tbm_bo *link = &bufmgr->hash[BO_HASH(bo->priv)];
+
+	while (*link != bo)
+		link = &(*link)->hash_next;
+	*link = bo->hash_next;
+
+	if (bo->prev)
+		bo->prev->next = bo->next;
+	else
+		bufmgr->list = bo->next;
+	if (bo->next)
+		bo->next->prev = bo->prev;
+	bufmgr->count--;
+}
+
+/* an import of a bo already in the list refs the bo of the list */
+static tbm_bo
+_bo_fold(tbm_bufmgr bufmgr, tbm_bo bo, void *priv)
+{
+	tbm_bo bo2;
+
+	pthread_mutex_lock(&bufmgr->list_lock);
+	for (bo2 = bufmgr->hash[BO_HASH(priv)]; bo2; bo2 = bo2->hash_next) {
+		if (bo2->priv == priv) {
+			__sync_add_and_fetch(&bo2->ref_cnt, 1);
+			pthread_mutex_unlock(&bufmgr->list_lock);
+			free(bo);
+			return bo2;
+		}
+	}
+
+	bo->priv = priv;
+	bo->ref_cnt = 1;
+	_bo_link(bufmgr, bo);
+	pthread_mutex_unlock(&bufmgr->list_lock);
+
+	return bo;
+}
+
+tbm_bufmgr
+tbm_bufmgr_init(int fd)
+{
+	tbm_bufmgr bufmgr;
+
+	bufmgr = calloc(1, sizeof(struct _tbm_bufmgr));
+	if (!bufmgr)
+		return NULL;
+
+	pthread_rwlock_init(&bufmgr->bo_lock, NULL);
+	pthread_mutex_init(&bufmgr->list_lock, NULL);
+
+	if (!tbmModuleData.init(bufmgr, fd)) {
+		free(bufmgr);
+		return NULL;
+	}
+
+	return bufmgr;
+}
+
+void
+tbm_bufmgr_deinit(tbm_bufmgr bufmgr)
+{
+	while (bufmgr->list) {
+		tbm_bo bo = bufmgr->list;
+
+		_bo_unlink(bufmgr, bo);
+		bufmgr->backend->bo_free(bo);
+		free(bo);
+	}
+
+	bufmgr->backend->bufmgr_deinit(bufmgr->backend->priv);
+	tbm_backend_free(bufmgr->backend);
+	free(bufmgr);
+}
+
+tbm_bo
+tbm_bo_alloc(tbm_bufmgr bufmgr, int size, int flags)
+{
+	tbm_bo bo;
+	void *priv;
+
+	bo = calloc(1, sizeof(struct _tbm_bo));
+	if (!bo)
+		return NULL;
+
+	bo->bufmgr = bufmgr;
+	priv = bufmgr->backend->bo_alloc(bo, size, flags);
+	if (!priv) {
+		free(bo);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&bufmgr->list_lock);
+	bo->priv = priv;
+	bo->ref_cnt = 1;
+	_bo_link(bufmgr, bo);
+	pthread_mutex_unlock(&bufmgr->list_lock);
+
+	return bo;
+}
+
+tbm_bo
+tbm_bo_ref(tbm_bo bo)
+{
+	__sync_add_and_fetch(&bo->ref_cnt, 1);
+
+	return bo;
+}
+
+void
+tbm_bo_unref(tbm_bo bo)
+{
+	tbm_bufmgr bufmgr = bo->bufmgr;
+
+	pthread_rwlock_wrlock(&bufmgr->bo_lock);
+	if (__sync_sub_and_fetch(&bo->ref_cnt, 1) > 0) {
+		pthread_rwlock_unlock(&bufmgr->bo_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&bufmgr->list_lock);
+	_bo_unlink(bufmgr, bo);
+	pthread_mutex_unlock(&bufmgr->list_lock);
+
+	bufmgr->backend->bo_free(bo);
+	pthread_rwlock_unlock(&bufmgr->bo_lock);
+
+	free(bo);
+}
+
+static tbm_bo
+_bo_import(tbm_bufmgr bufmgr, tbm_key key, tbm_fd fd)
+{
+	tbm_bo bo;
+	void *priv;
+
+	bo = calloc(1, sizeof(struct _tbm_bo));
+	if (!bo)
+		return NULL;
+
+	bo->bufmgr = bufmgr;
+
+	pthread_rwlock_rdlock(&bufmgr->bo_lock);
+	if (fd >= 0)
+		priv = bufmgr->backend->bo_import_fd(bo, fd);
+	else
+		priv = bufmgr->backend->bo_import(bo, key);
+	if (!priv) {
+		pthread_rwlock_unlock(&bufmgr->bo_lock);
+		free(bo);
+		return NULL;
+	}
+
+	bo = _bo_fold(bufmgr, bo, priv);
+	pthread_rwlock_unlock(&bufmgr->bo_lock);
+
+	return bo;
+}
+
+tbm_bo
+tbm_bo_import(tbm_bufmgr bufmgr, tbm_key key)
+{
+	return _bo_import(bufmgr, key, -1);
+}
+
+tbm_bo
+tbm_bo_import_fd(tbm_bufmgr bufmgr, tbm_fd fd)
+{
+	if (fd < 0)
+		return NULL;
+
+	return _bo_import(bufmgr, 0, fd);
+}
+
+tbm_key
+tbm_bo_export(tbm_bo bo)
+{
+	return bo->bufmgr->backend->bo_export(bo);
+}
+
+tbm_fd
+tbm_bo_export_fd(tbm_bo bo)
+{
+	return bo->bufmgr->backend->bo_export_fd(bo);
+}
+
+tbm_bo_handle
+tbm_bo_get_handle(tbm_bo bo, int device)
+{
+	return bo->bufmgr->backend->bo_get_handle(bo, device);
+}
+
+tbm_bo_handle
+tbm_bo_map(tbm_bo bo, int device, int opt)
+{
+	return bo->bufmgr->backend->bo_map(bo, device, opt);
+}
+
+int
+tbm_bo_unmap(tbm_bo bo)
+{
+	return bo->bufmgr->backend->bo_unmap(bo);
+}
+
+int
+tbm_bo_size(tbm_bo bo)
+{
+	return bo->bufmgr->backend->bo_size(bo);
+}
+
+/* the tests side */
+
+tbm_bufmgr
+fake_tbm_init(const fake_drm_config *config, int client)
+{
+	tbm_bufmgr bufmgr;
+	int fd;
+
+	fd = fake_drm_open(config);
+	if (fd < 0)
+		return NULL;
+
+	master_fd = fd;
+	display_server = !client;
+
+	bufmgr = tbm_bufmgr_init(-1);
+	if (!bufmgr) {
+		fake_drm_close();
+		master_fd = -1;
+		return NULL;
+	}
+
+	/* the probes of the init are not counted */
+	fake_drm_reset_counts();
+
+	return bufmgr;
+}
+
+void
+fake_tbm_fail_init(int count)
+{
+	init_fails = count;
+}
+
+void
+fake_tbm_deinit(tbm_bufmgr bufmgr)
+{
+	tbm_bufmgr_deinit(bufmgr);
+	fake_drm_close();
+	master_fd = -1;
+}
+
+int
+fake_tbm_bo_count(tbm_bufmgr bufmgr)
+{
+	int count;
+
+	pthread_mutex_lock(&bufmgr->list_lock);
+	count = bufmgr->count;
+	pthread_mutex_unlock(&bufmgr->list_lock);
+
+	return count;
+}
+
+int
+fake_tbm_bo_refs(tbm_bo bo)
+{
+	return bo->ref_cnt;
+}
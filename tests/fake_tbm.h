@@ -0,0 +1,55 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifndef __FAKE_TBM_H__
+#define __FAKE_TBM_H__
+
+#include <tbm_bufmgr.h>
+#include "fake_drm.h"
+
+/* the part of libtbm used by the backend and by the tests. the bufmgr
+ * loads the backend linked in the test, an import found in the bo list
+ * refs the bo of the list like libtbm does.
+ */
+
+/* open the fake device and init a bufmgr on it, in the display server
+ * unless client is set. the ioctls are counted from the end of the init.
+ */
+tbm_bufmgr fake_tbm_init(const fake_drm_config *config, int client);
+void fake_tbm_deinit(tbm_bufmgr bufmgr);
+
+/* fail the next count tbm_backend_init() at the end of the backend init */
+void fake_tbm_fail_init(int count);
+
+/* number of tbm_bo of the bufmgr and reference count of a bo */
+int fake_tbm_bo_count(tbm_bufmgr bufmgr);
+int fake_tbm_bo_refs(tbm_bo bo);
+
+#endif /* __FAKE_TBM_H__ */
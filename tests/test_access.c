@@ -0,0 +1,180 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the locks of the bufmgr are only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define BO_SIZE		(4 * 1024 * 1024)
+#define BENCH_LOOPS	50
+
+struct set_access {
+	tbm_bo bo;
+	tbm_vc4_access access;
+	volatile int done;
+};
+
+static void *
+set_access_thread(void *data)
+{
+	struct set_access *arg = data;
+
+	CHECK(tbm_vc4_bo_set_access(arg->bo, arg->access) == 1);
+	arg->done = 1;
+
+	return NULL;
+}
+
+static int
+resident_pages(void *map, size_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char vec[BO_SIZE / 4096];
+	int i, n = 0;
+
+	CHECK(size / page <= sizeof(vec));
+	CHECK(mincore(map, size, vec) == 0);
+
+	for (i = 0; i < (int)(size / page); i++)
+		n += vec[i] & 1;
+
+	return n;
+}
+
+/* the hint of a mapped bo prefaults it without the bufmgr lock */
+static void
+test_set_access_unlocked(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct set_access arg = {0, };
+	tbm_bo_handle handle;
+	pthread_t thread;
+	int i;
+
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	arg.bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(arg.bo);
+	arg.access = TBM_VC4_ACCESS_SEQUENTIAL_WRITE;
+
+	handle = tbm_bo_map(arg.bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	CHECK(handle.ptr);
+	CHECK(resident_pages(handle.ptr, BO_SIZE) == 0);
+
+	pthread_mutex_lock(&bufmgr_vc4->lock);
+	CHECK(pthread_create(&thread, NULL, set_access_thread, &arg) == 0);
+	for (i = 0; i < 5000 && !arg.done; i++)
+		usleep(1000);
+	CHECK(arg.done);
+	pthread_mutex_unlock(&bufmgr_vc4->lock);
+	pthread_join(thread, NULL);
+
+#ifdef MADV_POPULATE_WRITE
+	/* the pages of the fake are shmem ones, faulted in by the hint */
+	if (madvise(handle.ptr, 4096, MADV_POPULATE_WRITE) == 0)
+		CHECK(resident_pages(handle.ptr, BO_SIZE) == BO_SIZE / 4096);
+#endif
+
+	tbm_bo_unmap(arg.bo);
+	tbm_bo_unref(arg.bo);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* map a new bo and write one byte per page, with the hint given before
+ * the map, after the map or not at all
+ */
+static void
+bench_first_touch(tbm_vc4_access access, int after_map)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	long page = sysconf(_SC_PAGESIZE);
+	double hint_us = 0, touch_us = 0, t;
+	char name[64];
+	int i, loop;
+
+	CHECK(bufmgr);
+
+	for (loop = 0; loop < BENCH_LOOPS; loop++) {
+		tbm_bo_handle handle;
+		tbm_bo bo;
+
+		bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(bo);
+
+		t = test_now_us();
+		if (!after_map)
+			CHECK(tbm_vc4_bo_set_access(bo, access) == 1);
+		handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+		CHECK(handle.ptr);
+		if (after_map)
+			CHECK(tbm_vc4_bo_set_access(bo, access) == 1);
+		hint_us += test_now_us() - t;
+
+		t = test_now_us();
+		for (i = 0; i < BO_SIZE; i += page)
+			((volatile char *)handle.ptr)[i] = 1;
+		touch_us += test_now_us() - t;
+
+		tbm_bo_unmap(bo);
+		tbm_bo_unref(bo);
+
+		/* the next bo gets new pages */
+		tbm_vc4_bufmgr_trim(bufmgr);
+	}
+
+	snprintf(name, sizeof(name), "4M %s, map%s",
+		 access ? "sequential write" : "no hint",
+		 access ? (after_map ? " then hint" : " after hint") : "");
+	BENCH(name, BENCH_LOOPS, hint_us);
+	snprintf(name, sizeof(name), "4M %s, first touch",
+		 access ? "sequential write" : "no hint");
+	BENCH(name, BENCH_LOOPS, touch_us);
+
+	fake_tbm_deinit(bufmgr);
+}
+
+int
+main(void)
+{
+	test_set_access_unlocked();
+
+	bench_first_touch(TBM_VC4_ACCESS_NONE, 0);
+	bench_first_touch(TBM_VC4_ACCESS_SEQUENTIAL_WRITE, 0);
+	bench_first_touch(TBM_VC4_ACCESS_SEQUENTIAL_WRITE, 1);
+
+	return 0;
+}
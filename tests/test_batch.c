@@ -0,0 +1,129 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "test_common.h"
+
+#define NV12_SIZE(w, h)	((w) * (h) * 3 / 2)
+#define POOL_SIZE	32
+#define BENCH_LOOPS	50
+
+static void
+test_batch(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_vc4_stats stats;
+	tbm_bo bos[16];
+	int size = NV12_SIZE(1920, 1088);
+	int i, j;
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	CHECK(tbm_vc4_bo_alloc_batch(bufmgr, size, TBM_BO_DEFAULT, 16, 1, bos));
+	CHECK(fake_drm_count(FAKE_CREATE_BO) == 16);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.cache_count == 0);
+	CHECK(stats.map_bytes >= 16UL * size);
+
+	for (i = 0; i < 16; i++) {
+		CHECK(bos[i]);
+		CHECK(tbm_bo_size(bos[i]) >= size);
+		for (j = 0; j < i; j++)
+			CHECK(bos[i] != bos[j]);
+		memset(tbm_bo_get_handle(bos[i], TBM_DEVICE_CPU).ptr, i, size);
+	}
+	CHECK(fake_drm_count(FAKE_MMAP_BO) == 16);
+
+	for (i = 0; i < 16; i++)
+		tbm_bo_unref(bos[i]);
+	CHECK(test_stats(bufmgr).cache_count == 16);
+
+	/* served by the cache */
+	fake_drm_reset_counts();
+	CHECK(tbm_vc4_bo_alloc_batch(bufmgr, size, TBM_BO_DEFAULT, 16, 0, bos));
+	CHECK(fake_drm_count(FAKE_CREATE_BO) == 0);
+	for (i = 0; i < 16; i++)
+		tbm_bo_unref(bos[i]);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+bench_pool(const char *name, int batch)
+{
+	tbm_bo bos[POOL_SIZE];
+	double us = 0;
+	int size = NV12_SIZE(3840, 2160);
+	int loop, i;
+
+	for (loop = 0; loop < BENCH_LOOPS; loop++) {
+		tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+		double start;
+
+		CHECK(bufmgr);
+
+		start = test_now_us();
+		if (batch) {
+			CHECK(tbm_vc4_bo_alloc_batch(bufmgr, size, TBM_BO_DEFAULT,
+						     POOL_SIZE, 0, bos));
+		} else {
+			for (i = 0; i < POOL_SIZE; i++) {
+				bos[i] = tbm_bo_alloc(bufmgr, size, TBM_BO_DEFAULT);
+				CHECK(bos[i]);
+			}
+		}
+		us += test_now_us() - start;
+
+		for (i = 0; i < POOL_SIZE; i++)
+			tbm_bo_unref(bos[i]);
+		fake_tbm_deinit(bufmgr);
+	}
+
+	BENCH(name, BENCH_LOOPS, us);
+}
+
+int
+main(void)
+{
+	test_batch();
+
+	bench_pool("4k nv12 pool of 32, tbm_bo_alloc", 0);
+	bench_pool("4k nv12 pool of 32, batch", 1);
+
+	return 0;
+}
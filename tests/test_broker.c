@@ -0,0 +1,241 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the broker protocol is only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "test_common.h"
+
+#define BO_SIZE	(64 * 1024)
+
+static char base[] = "/tmp/tbm-vc4-broker-XXXXXX";
+static char dir[64];
+static char path[64];
+
+static tbm_bufmgr
+init_broker(void)
+{
+	setenv("TBM_VC4_BROKER", path, 1);
+
+	return fake_tbm_init(NULL, 0);
+}
+
+static void
+deinit_broker(tbm_bufmgr bufmgr)
+{
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+
+	unsetenv("TBM_VC4_BROKER");
+}
+
+static int
+call(uint32_t type, unsigned int key, int *fd)
+{
+	struct _vc4_broker_req req = {0, };
+
+	req.type = type;
+	req.count = type == BROKER_REQ_DMABUF;
+	req.keys[0] = key;
+
+	return _broker_call(path, &req, fd, 1);
+}
+
+static ino_t
+fd_ino(int fd)
+{
+	struct stat st;
+
+	CHECK(fstat(fd, &st) == 0);
+
+	return st.st_ino;
+}
+
+static void
+test_socket(void)
+{
+	tbm_bufmgr bufmgr = init_broker();
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct stat st;
+
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	CHECK(bufmgr_vc4->broker_fd >= 0);
+
+	/* the directory is made private, the socket is for the user only */
+	CHECK(lstat(dir, &st) == 0);
+	CHECK(S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0700);
+	CHECK(lstat(path, &st) == 0);
+	CHECK(S_ISSOCK(st.st_mode) && (st.st_mode & 0777) == 0600);
+
+	deinit_broker(bufmgr);
+
+	/* and removed at deinit */
+	CHECK(lstat(path, &st) && errno == ENOENT);
+}
+
+static void
+test_serve(void)
+{
+	tbm_bufmgr bufmgr = init_broker();
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo bo;
+	int fd, dmabuf;
+
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	/* the fake device opens through the fd of the master */
+	free(bufmgr_vc4->device_name);
+	CHECK(asprintf(&bufmgr_vc4->device_name, "/proc/self/fd/%d", bufmgr_vc4->fd) > 0);
+
+	CHECK(call(BROKER_REQ_DRM_FD, 0, &fd) == 1);
+	CHECK(fd != bufmgr_vc4->fd);
+	CHECK(fd_ino(fd) == fd_ino(bufmgr_vc4->fd));
+	close(fd);
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+
+	CHECK(call(BROKER_REQ_DMABUF, tbm_bo_export(bo), &fd) == 1);
+	dmabuf = tbm_bo_export_fd(bo);
+	CHECK(dmabuf >= 0);
+	CHECK(fd_ino(fd) == fd_ino(dmabuf));
+	close(dmabuf);
+	close(fd);
+
+	/* an unknown key fails without fds */
+	fd = -1;
+	CHECK(call(BROKER_REQ_DMABUF, tbm_bo_export(bo) + 1000, &fd) == -1);
+	CHECK(fd == -1);
+
+	tbm_bo_unref(bo);
+	deinit_broker(bufmgr);
+}
+
+static void
+test_peer_refused(void)
+{
+	tbm_bufmgr bufmgr = init_broker();
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo bo;
+	unsigned int key;
+	int fd = -1;
+
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	key = tbm_bo_export(bo);
+
+	/* the test is a peer of another user, then of another group */
+	bufmgr_vc4->broker_uid = geteuid() + 1;
+	CHECK(call(BROKER_REQ_DMABUF, key, &fd) == -1);
+	CHECK(fd == -1);
+
+	bufmgr_vc4->broker_uid = geteuid();
+	bufmgr_vc4->broker_gid = getegid() + 1;
+	CHECK(call(BROKER_REQ_DMABUF, key, &fd) == -1);
+	CHECK(fd == -1);
+
+	bufmgr_vc4->broker_gid = getegid();
+	CHECK(call(BROKER_REQ_DMABUF, key, &fd) == 1);
+	close(fd);
+
+	tbm_bo_unref(bo);
+	deinit_broker(bufmgr);
+}
+
+static void
+test_not_socket(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	struct stat st;
+	int fd;
+
+	/* a file at the path of the socket is kept */
+	fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+	CHECK(fd >= 0);
+	CHECK(write(fd, "x", 1) == 1);
+	close(fd);
+
+	bufmgr = init_broker();
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	CHECK(bufmgr_vc4->broker_fd < 0);
+	deinit_broker(bufmgr);
+
+	CHECK(lstat(path, &st) == 0);
+	CHECK(S_ISREG(st.st_mode) && st.st_size == 1);
+	CHECK(unlink(path) == 0);
+}
+
+static void
+test_open_dir(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+
+	/* a directory others may enter is refused */
+	CHECK(chmod(dir, 0755) == 0);
+
+	bufmgr = init_broker();
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	CHECK(bufmgr_vc4->broker_fd < 0);
+	deinit_broker(bufmgr);
+
+	CHECK(access(path, F_OK) && errno == ENOENT);
+	CHECK(chmod(dir, 0700) == 0);
+}
+
+int
+main(void)
+{
+	CHECK(mkdtemp(base));
+	snprintf(dir, sizeof(dir), "%s/run", base);
+	snprintf(path, sizeof(path), "%s/run/broker", base);
+
+	test_socket();
+	test_serve();
+	test_peer_refused();
+	test_not_socket();
+	test_open_dir();
+
+	rmdir(dir);
+	rmdir(base);
+
+	return 0;
+}
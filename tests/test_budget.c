@@ -0,0 +1,281 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+/* the budgets are checked against the allocated bytes from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define BO_SIZE		(64 * 1024)
+#define THREADS_MAX	4
+#define BUDGET_BOS	16
+
+static tbm_bufmgr
+init_budget(const char *soft, const char *hard)
+{
+	tbm_bufmgr bufmgr;
+
+	if (soft)
+		setenv("TBM_VC4_BUDGET_SOFT", soft, 1);
+	if (hard)
+		setenv("TBM_VC4_BUDGET_HARD", hard, 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_BUDGET_SOFT");
+	unsetenv("TBM_VC4_BUDGET_HARD");
+	CHECK(bufmgr);
+
+	return bufmgr;
+}
+
+static void
+deinit_budget(tbm_bufmgr bufmgr)
+{
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the hard budget fails the allocations past it, after a trim */
+static void
+test_hard(void)
+{
+	tbm_bufmgr bufmgr = init_budget(NULL, "256K");
+	tbm_bo bos[4], bo;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+	}
+	CHECK(test_stats(bufmgr).alloc_bytes == 4 * BO_SIZE);
+
+	errno = 0;
+	CHECK(!tbm_bo_alloc(bufmgr, BO_SIZE * 2, TBM_BO_DEFAULT));
+	CHECK(errno == ENOSPC);
+	CHECK(test_stats(bufmgr).trims == 1);
+	CHECK(test_stats(bufmgr).budget_failures == 1);
+	CHECK(test_stats(bufmgr).alloc_bytes == 4 * BO_SIZE);
+
+	/* the cached bos are counted until the trim drops them */
+	tbm_bo_unref(bos[0]);
+	tbm_bo_unref(bos[1]);
+	CHECK(test_stats(bufmgr).cache_count == 2);
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE * 2, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(test_stats(bufmgr).cache_count == 0);
+	CHECK(test_stats(bufmgr).trims == 2);
+	CHECK(test_stats(bufmgr).budget_failures == 1);
+	CHECK(test_stats(bufmgr).alloc_bytes == 4 * BO_SIZE);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bos[2]);
+	tbm_bo_unref(bos[3]);
+	deinit_budget(bufmgr);
+}
+
+/* the soft budget drops the bo cache */
+static void
+test_soft(void)
+{
+	tbm_bufmgr bufmgr = init_budget("128K", NULL);
+	tbm_bo bo, bo2;
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	bo2 = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo && bo2);
+	tbm_bo_unref(bo2);
+	CHECK(test_stats(bufmgr).cache_count == 1);
+
+	bo2 = tbm_bo_alloc(bufmgr, BO_SIZE * 2, TBM_BO_DEFAULT);
+	CHECK(bo2);
+	CHECK(test_stats(bufmgr).cache_count == 0);
+	CHECK(test_stats(bufmgr).alloc_bytes == 3 * BO_SIZE);
+	CHECK(test_stats(bufmgr).budget_failures == 0);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bo2);
+	deinit_budget(bufmgr);
+}
+
+/* a failed creation gives its bytes and its handle back */
+static void
+test_create_fails(void)
+{
+	tbm_bufmgr bufmgr = init_budget(NULL, "256K");
+	tbm_bufmgr_vc4 bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	struct _tbm_bo_vc4 other;
+	tbm_bo_vc4 bo_vc4;
+	unsigned int gem;
+	tbm_bo bo;
+
+	fake_drm_fail(FAKE_CREATE_BO, 1);
+	CHECK(!tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT));
+	CHECK(test_stats(bufmgr).kernel_failures == 1);
+	CHECK(test_stats(bufmgr).alloc_bytes == 0);
+
+	/* another bo holds the next handle of the fake device */
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	bo_vc4 = tbm_backend_get_bo_priv(bo);
+	gem = bo_vc4->gem + 1;
+	CHECK(_registry_insert(&bufmgr_vc4->bos, gem, &other) == &other);
+
+	fake_drm_reset_counts();
+	CHECK(!tbm_bo_alloc(bufmgr, BO_SIZE * 2, TBM_BO_DEFAULT));
+	CHECK(fake_drm_count(FAKE_GEM_CLOSE) == 1);
+	CHECK(fake_drm_handles() == 1);
+	CHECK(test_stats(bufmgr).alloc_bytes == BO_SIZE);
+
+	_registry_delete(&bufmgr_vc4->bos, gem, &other);
+
+	tbm_bo_unref(bo);
+	deinit_budget(bufmgr);
+}
+
+static tbm_bufmgr race_bufmgr;
+static int race_allocs;
+
+static void
+race_hook(unsigned long request, void *arg)
+{
+	(void)arg;
+
+	/* the other allocations get in between the check and the create */
+	if (request == DRM_IOCTL_VC4_CREATE_BO)
+		sched_yield();
+}
+
+static void *
+race_thread(void *data)
+{
+	tbm_bo *bos = data;
+	int n = 0;
+
+	(void)data;
+
+	while (n < BUDGET_BOS) {
+		bos[n] = tbm_bo_alloc(race_bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		if (!bos[n])
+			break;
+		n++;
+	}
+	__sync_fetch_and_add(&race_allocs, n);
+
+	return NULL;
+}
+
+/* the concurrent allocations cannot pass the hard budget together */
+static void
+test_race(void)
+{
+	static tbm_bo bos[THREADS_MAX][BUDGET_BOS];
+	pthread_t threads[THREADS_MAX];
+	char hard[32];
+	int i, j;
+
+	snprintf(hard, sizeof(hard), "%d", BUDGET_BOS * BO_SIZE);
+	setenv("TBM_VC4_BO_CACHE", "0", 1);
+	race_bufmgr = init_budget(NULL, hard);
+	unsetenv("TBM_VC4_BO_CACHE");
+	race_allocs = 0;
+	memset(bos, 0, sizeof(bos));
+
+	fake_drm_set_hook(race_hook);
+	for (i = 0; i < THREADS_MAX; i++)
+		CHECK(pthread_create(&threads[i], NULL, race_thread, bos[i]) == 0);
+	for (i = 0; i < THREADS_MAX; i++)
+		pthread_join(threads[i], NULL);
+	fake_drm_set_hook(NULL);
+
+	CHECK(race_allocs == BUDGET_BOS);
+	CHECK(test_stats(race_bufmgr).alloc_bytes == BUDGET_BOS * BO_SIZE);
+	CHECK(test_stats(race_bufmgr).budget_failures == THREADS_MAX);
+	CHECK(fake_drm_objects() == BUDGET_BOS);
+
+	for (i = 0; i < THREADS_MAX; i++)
+		for (j = 0; j < BUDGET_BOS && bos[i][j]; j++)
+			tbm_bo_unref(bos[i][j]);
+	deinit_budget(race_bufmgr);
+}
+
+/* the memory pressure trims on the next allocation */
+static void
+test_pressure(void)
+{
+	char file[] = "/tmp/test_budget.XXXXXX";
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bufmgr bufmgr;
+	tbm_bo bo;
+	int fd;
+
+	/* a plain file never signals, the monitor only has to start */
+	fd = mkstemp(file);
+	CHECK(fd >= 0);
+	close(fd);
+	setenv("TBM_VC4_PRESSURE", "1", 1);
+	setenv("TBM_VC4_PRESSURE_FILE", file, 1);
+	bufmgr = init_budget(NULL, NULL);
+	unsetenv("TBM_VC4_PRESSURE");
+	unsetenv("TBM_VC4_PRESSURE_FILE");
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	CHECK(bufmgr_vc4->pressure_fd >= 0);
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	tbm_bo_unref(bo);
+	CHECK(test_stats(bufmgr).cache_count == 1);
+	CHECK(test_stats(bufmgr).trims == 0);
+
+	/* as the monitor does on POLLPRI */
+	__sync_lock_test_and_set(&bufmgr_vc4->pressure, 1);
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE * 2, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(test_stats(bufmgr).trims == 1);
+	CHECK(test_stats(bufmgr).cache_count == 0);
+	CHECK(bufmgr_vc4->pressure == 0);
+
+	tbm_bo_unref(bo);
+	deinit_budget(bufmgr);
+	unlink(file);
+}
+
+int
+main(void)
+{
+	test_hard();
+	test_soft();
+	test_create_fails();
+	test_race();
+	test_pressure();
+
+	return 0;
+}
@@ -0,0 +1,224 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define BENCH_LOOPS	100000
+
+static void
+test_hit_miss(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_vc4_stats stats;
+	tbm_bo_handle handle;
+	tbm_bo bo;
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	/* a free keeps the bo and its mapping for the next alloc */
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	CHECK(handle.ptr);
+	memset(handle.ptr, 0x5a, 64 * 1024);
+	tbm_bo_unmap(bo);
+	tbm_bo_unref(bo);
+
+	fake_drm_reset_counts();
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024 - 100, TBM_BO_DEFAULT);
+	CHECK(bo);
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ);
+	CHECK(handle.ptr);
+	tbm_bo_unmap(bo);
+	CHECK(fake_drm_count(FAKE_CREATE_BO) == 0);
+	CHECK(fake_drm_count(FAKE_MMAP_BO) == 0);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.cache_hits == 1);
+	CHECK(stats.cache_misses == 1);
+	CHECK(stats.cache_count == 0);
+
+	/* another bucket goes to the kernel */
+	tbm_bo_unref(bo);
+	bo = tbm_bo_alloc(bufmgr, 1024 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(fake_drm_count(FAKE_CREATE_BO) == 1);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.cache_misses == 2);
+	CHECK(stats.cache_count == 1);
+	CHECK(stats.cache_bytes == 64 * 1024);
+	tbm_bo_unref(bo);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+test_disabled(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_vc4_stats stats;
+	tbm_bo bo;
+	int i;
+
+	setenv("TBM_VC4_BO_CACHE", "0", 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_BO_CACHE");
+	CHECK(bufmgr);
+
+	for (i = 0; i < 4; i++) {
+		bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+		CHECK(bo);
+		tbm_bo_unref(bo);
+	}
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.cache_hits == 0);
+	CHECK(stats.cache_count == 0);
+	CHECK(fake_drm_count(FAKE_CREATE_BO) == 4);
+	CHECK(fake_drm_objects() == 0);
+
+	fake_tbm_deinit(bufmgr);
+}
+
+static void
+test_aging(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_vc4_stats stats;
+	tbm_bo bo;
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	tbm_bo_unref(bo);
+
+	/* the next free releases the bos idle for more than the timeout */
+	sleep(3);
+	bo = tbm_bo_alloc(bufmgr, 256 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	tbm_bo_unref(bo);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.cache_evictions == 1);
+	CHECK(stats.cache_count == 1);
+	CHECK(fake_drm_objects() == 1);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+test_import_cached(void)
+{
+	tbm_vc4_label_stats label;
+	tbm_bufmgr bufmgr;
+	tbm_fd fd;
+	tbm_bo bo;
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	/* the dmabuf given out by get_handle stays open in the bo cache */
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024,
+			  TBM_BO_DEFAULT | TBM_VC4_BO_LABEL(TBM_VC4_LABEL_VIDEO));
+	CHECK(bo);
+	fd = tbm_bo_get_handle(bo, TBM_DEVICE_MM).u32;
+	CHECK(fd > 0);
+	tbm_bo_unref(bo);
+	CHECK(test_stats(bufmgr).cache_count == 1);
+
+	/* the import of a cached bo takes it back with its label */
+	bo = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo);
+	CHECK(fake_drm_objects() == 1);
+	CHECK(tbm_vc4_bufmgr_get_label_stats(bufmgr, TBM_VC4_LABEL_VIDEO, &label));
+	CHECK(label.count == 1);
+	CHECK(label.bytes == 64 * 1024);
+
+	tbm_bo_unref(bo);
+	CHECK(tbm_vc4_bufmgr_get_label_stats(bufmgr, TBM_VC4_LABEL_VIDEO, &label));
+	CHECK(label.count == 0);
+	CHECK(label.bytes == 0);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+bench_alloc_free(const char *name, int cache)
+{
+	tbm_bufmgr bufmgr;
+	double start;
+	tbm_bo bo;
+	int i;
+
+	if (!cache)
+		setenv("TBM_VC4_BO_CACHE", "0", 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_BO_CACHE");
+	CHECK(bufmgr);
+
+	start = test_now_us();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		bo = tbm_bo_alloc(bufmgr, (64 + (i & 3) * 16) * 1024, TBM_BO_DEFAULT);
+		CHECK(bo);
+		tbm_bo_get_handle(bo, TBM_DEVICE_CPU);
+		tbm_bo_unref(bo);
+	}
+	BENCH(name, BENCH_LOOPS, test_now_us() - start);
+
+	fake_tbm_deinit(bufmgr);
+}
+
+int
+main(void)
+{
+	test_hit_miss();
+	test_disabled();
+	test_aging();
+	test_import_cached();
+
+	bench_alloc_free("alloc/map/free, bo cache", 1);
+	bench_alloc_free("alloc/map/free, no bo cache", 0);
+
+	return 0;
+}
@@ -0,0 +1,160 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the copy kernels are only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <sys/mman.h>
+
+#include "test_common.h"
+
+#define BUF_SIZE	(8 * 1024 * 1024)
+#define BENCH_BYTES	(256 * 1024 * 1024)
+
+typedef void (*copy_func)(void *dst, const void *src, size_t size);
+
+/* the kernels of the cpu and the fallback ones, as picked at init */
+static void
+get_kernels(int simd, copy_func *copy_to, copy_func *copy_from)
+{
+	struct _tbm_bufmgr_vc4 bufmgr_vc4;
+
+	memset(&bufmgr_vc4, 0, sizeof(bufmgr_vc4));
+	if (simd)
+		unsetenv("TBM_VC4_COPY");
+	else
+		setenv("TBM_VC4_COPY", "scalar", 1);
+
+	_bufmgr_copy_init(&bufmgr_vc4);
+	unsetenv("TBM_VC4_COPY");
+
+	*copy_to = bufmgr_vc4.copy_to;
+	*copy_from = bufmgr_vc4.copy_from;
+}
+
+static void *
+map_buf(void)
+{
+	void *buf = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	CHECK(buf != MAP_FAILED);
+	memset(buf, 0, BUF_SIZE);
+
+	return buf;
+}
+
+static void
+copy_memcpy(void *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+/* every alignment of both ends, the bytes around the copy are kept */
+static void
+test_kernel(copy_func copy)
+{
+	uint8_t *src = map_buf(), *dst = map_buf();
+	size_t sizes[] = { 0, 1, 15, 16, 63, 64, 65, 1000, 4095, 4096, 4097,
+			   3 * 4096 + 77, 65536 };
+	size_t i, s, so, doff;
+
+	for (i = 0; i < 65536 + 256; i++)
+		src[i] = i * 7 + 3;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (so = 0; so < 64; so += 7) {
+			for (doff = 0; doff < 64; doff += 5) {
+				memset(dst, 0xee, sizes[s] + 256);
+				copy(dst + doff + 64, src + so, sizes[s]);
+
+				CHECK(!memcmp(dst + doff + 64, src + so, sizes[s]));
+				CHECK(dst[doff + 63] == 0xee);
+				CHECK(dst[doff + 64 + sizes[s]] == 0xee);
+			}
+		}
+	}
+
+	munmap(src, BUF_SIZE);
+	munmap(dst, BUF_SIZE);
+}
+
+/* the kernels on the cached anonymous memory of the host, which tells
+ * their overhead. the gain of the bursts and of the streaming loads is on
+ * the write-combined mappings of the device only.
+ */
+static void
+bench_kernel(const char *name, copy_func copy, size_t size)
+{
+	uint8_t *src = map_buf(), *dst = map_buf();
+	size_t loops = BENCH_BYTES / size, i;
+	char label[64];
+	double t;
+
+	memset(src, 0x5a, BUF_SIZE);
+
+	copy(dst, src, size);
+	t = test_now_us();
+	for (i = 0; i < loops; i++)
+		copy(dst, src, size);
+	t = test_now_us() - t;
+
+	snprintf(label, sizeof(label), "%s %zuK (%.0f MB/s)", name, size / 1024,
+		 loops * size / t);
+	BENCH(label, loops, t);
+
+	munmap(src, BUF_SIZE);
+	munmap(dst, BUF_SIZE);
+}
+
+int
+main(void)
+{
+	copy_func to_scalar, from_scalar, to_simd, from_simd;
+	size_t sizes[] = { 4096, 65536, 1024 * 1024, BUF_SIZE };
+	size_t i;
+
+	get_kernels(0, &to_scalar, &from_scalar);
+	get_kernels(1, &to_simd, &from_simd);
+
+	test_kernel(to_scalar);
+	test_kernel(from_scalar);
+	test_kernel(to_simd);
+	test_kernel(from_simd);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench_kernel("memcpy", copy_memcpy, sizes[i]);
+		bench_kernel("write scalar", to_scalar, sizes[i]);
+		bench_kernel("write simd", to_simd, sizes[i]);
+		bench_kernel("read scalar", from_scalar, sizes[i]);
+		bench_kernel("read simd", from_simd, sizes[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,418 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+/* the locks need the dma fence of the bufmgr, set from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test_common.h"
+
+static int
+fd_valid(int fd)
+{
+	return fcntl(fd, F_GETFD) != -1;
+}
+
+/* the dmabuf fd given out by get_handle stays open as long as the bo */
+static void
+test_handle_kept(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_bo_handle handle;
+	tbm_bo bo, bo2;
+	tbm_fd fd, fds[1];
+
+	setenv("TBM_VC4_DMABUF_MAX", "1", 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_DMABUF_MAX");
+	CHECK(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	bo2 = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo && bo2);
+
+	handle = tbm_bo_get_handle(bo, TBM_DEVICE_MM);
+	CHECK(handle.s32 > 0);
+	CHECK(fcntl(handle.s32, F_GETFD) & FD_CLOEXEC);
+
+	/* over the dmabuf limit */
+	fd = tbm_bo_export_fd(bo2);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(fd_valid(handle.s32));
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_3D).s32 == handle.s32);
+
+	/* trimmed */
+	CHECK(tbm_vc4_bufmgr_trim(bufmgr));
+	CHECK(fd_valid(handle.s32));
+
+	/* the transfer hands out a dup */
+	CHECK(tbm_vc4_bo_export_fds(&bo, 1, TBM_VC4_EXPORT_TRANSFER, fds));
+	CHECK(fds[0] != handle.s32);
+	close(fds[0]);
+	CHECK(fd_valid(handle.s32));
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_MM).s32 == handle.s32);
+
+	/* without get_handle the kept fd itself is transferred */
+	fd = tbm_bo_export_fd(bo2);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(tbm_vc4_bo_export_fds(&bo2, 1, TBM_VC4_EXPORT_TRANSFER, fds));
+	CHECK(fd_valid(fds[0]));
+	close(fds[0]);
+	CHECK(test_stats(bufmgr).dmabuf_count == 1);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bo2);
+	CHECK(!fd_valid(handle.s32));
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* a bo back from the bo cache starts without the marks of get_handle */
+static void
+test_handle_cached(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_bo_handle handle;
+	tbm_bo bo, bo2;
+	tbm_fd fds[1];
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	handle = tbm_bo_get_handle(bo, TBM_DEVICE_MM);
+	CHECK(handle.s32 > 0);
+	tbm_bo_unref(bo);
+
+	bo2 = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo2);
+	CHECK(test_stats(bufmgr).cache_hits == 1);
+	CHECK(tbm_vc4_bo_export_fds(&bo2, 1, TBM_VC4_EXPORT_TRANSFER, fds));
+	CHECK(fds[0] == handle.s32);
+	close(fds[0]);
+	CHECK(test_stats(bufmgr).dmabuf_count == 0);
+
+	tbm_bo_unref(bo2);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the imports find a known dmabuf by its inode only if the inodes of the
+ * dmabufs of two objects differ, the init does not probe them
+ */
+static void
+test_inode_probe(int shared_inode)
+{
+	fake_drm_config config = {0, };
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bufmgr bufmgr;
+	tbm_bo bo, bo2, bo3;
+	tbm_fd fd;
+
+	config.shared_inode = shared_inode;
+	bufmgr = fake_tbm_init(&config, 0);
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	CHECK(bufmgr_vc4->use_inode == 0);
+	CHECK(fake_drm_handles() == 0);
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	bo2 = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo && bo2);
+	fd = tbm_bo_export_fd(bo);
+	CHECK(fd >= 0);
+	close(fd);
+	fd = tbm_bo_export_fd(bo);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(bufmgr_vc4->use_inode == 0);
+	fd = tbm_bo_export_fd(bo2);
+	CHECK(fd >= 0);
+	CHECK(bufmgr_vc4->use_inode == (shared_inode ? -1 : 1));
+
+	fake_drm_reset_counts();
+	bo3 = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo3 == bo2);
+	CHECK(fake_tbm_bo_refs(bo2) == 2);
+	CHECK(test_stats(bufmgr).import_fast == (shared_inode ? 0 : 1));
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == (shared_inode ? 1 : 0));
+	close(fd);
+
+	tbm_bo_unref(bo3);
+	tbm_bo_unref(bo2);
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the inode of a dmabuf closed here is not looked up until an import of
+ * the dmabuf indexes it again
+ */
+static void
+test_inode_dropped(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_bo bo, bo2;
+	tbm_fd fd, fds[1];
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	/* the dmabuf of another object turns the inode index on */
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	fd = tbm_bo_export_fd(bo);
+	CHECK(fd >= 0);
+	close(fd);
+	tbm_bo_unref(bo);
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo);
+	fd = tbm_bo_export_fd(bo);
+	CHECK(fd >= 0);
+	CHECK(tbm_vc4_bo_export_fds(&bo, 1, TBM_VC4_EXPORT_TRANSFER, fds));
+	close(fds[0]);
+
+	fake_drm_reset_counts();
+	bo2 = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo2 == bo);
+	CHECK(test_stats(bufmgr).import_fast == 0);
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == 1);
+	tbm_bo_unref(bo2);
+
+	bo2 = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo2 == bo);
+	CHECK(test_stats(bufmgr).import_fast == 1);
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == 1);
+	tbm_bo_unref(bo2);
+	close(fd);
+
+	/* so is the one of a trimmed dmabuf */
+	fd = tbm_bo_export_fd(bo);
+	CHECK(fd >= 0);
+	CHECK(tbm_vc4_bufmgr_trim(bufmgr));
+	CHECK(test_stats(bufmgr).dmabuf_count == 0);
+	fake_drm_reset_counts();
+	bo2 = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo2 == bo);
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == 1);
+	tbm_bo_unref(bo2);
+	close(fd);
+
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the keys of a render node are made up, unique and found by the imports
+ * of the process, whatever the inodes of the dmabufs
+ */
+static void
+test_render_node_keys(int shared_inode)
+{
+	fake_drm_config config = {0, };
+	tbm_bufmgr bufmgr;
+	tbm_bo bo, bo2, bo3;
+	tbm_key key, key2;
+
+	config.render_node = 1;
+	config.shared_inode = shared_inode;
+	bufmgr = fake_tbm_init(&config, 0);
+	CHECK(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	bo2 = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo && bo2);
+	key = tbm_bo_export(bo);
+	key2 = tbm_bo_export(bo2);
+	CHECK(key && key2 && key != key2);
+	CHECK(tbm_bo_export(bo) == key);
+	CHECK(fake_drm_count(FAKE_GEM_FLINK) == 0);
+
+	bo3 = tbm_bo_import(bufmgr, key2);
+	CHECK(bo3 == bo2);
+	tbm_bo_unref(bo3);
+
+	tbm_bo_unref(bo2);
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+#ifndef ALWAYS_BACKEND_CTRL
+#define CHURN_LOOPS	2000
+
+static volatile int churn_stop;
+
+/* the exports over the dmabuf limit and the trims close the lru dmabufs */
+static void *
+churn(void *data)
+{
+	tbm_bufmgr bufmgr = data;
+
+	while (!churn_stop) {
+		tbm_bo bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+		tbm_fd fd;
+
+		if (!bo)
+			continue;
+		fd = tbm_bo_export_fd(bo);
+		if (fd >= 0)
+			close(fd);
+		tbm_bo_unref(bo);
+		tbm_vc4_bufmgr_trim(bufmgr);
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+/* the lock is held in another process only as long as the fd is open */
+static int
+lock_held(int fd)
+{
+	pid_t pid = fork();
+	int status;
+
+	if (pid == 0) {
+		struct flock filelock;
+
+		memset(&filelock, 0, sizeof(filelock));
+		filelock.l_type = F_WRLCK;
+		filelock.l_whence = SEEK_SET;
+		if (fcntl(fd, F_GETLK, &filelock) == -1)
+			_exit(2);
+		_exit(filelock.l_type == F_UNLCK);
+	}
+
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+
+	return WEXITSTATUS(status) == 0;
+}
+
+/* a locked bo keeps its dmabuf, and the lock with it, over the limit of
+ * the dmabufs and the trims
+ */
+static void
+test_lock_pinned(void)
+{
+	tbm_bufmgr bufmgr;
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 bo_vc4;
+	pthread_t thread;
+	tbm_bo bo, bo2;
+	tbm_fd fd;
+	int dmabuf, i;
+
+	setenv("TBM_VC4_DMABUF_MAX", "1", 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_DMABUF_MAX");
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	bufmgr_vc4->use_dma_fence = 1;
+
+	bo = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	bo2 = tbm_bo_alloc(bufmgr, 64 * 1024, TBM_BO_DEFAULT);
+	CHECK(bo && bo2);
+	bo_vc4 = tbm_backend_get_bo_priv(bo);
+
+	CHECK(tbm_vc4_bo_lock(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE));
+	dmabuf = bo_vc4->dmabuf;
+	CHECK(dmabuf > 0);
+	CHECK(lock_held(dmabuf) == 1);
+
+	/* over the dmabuf limit, then trimmed */
+	fd = tbm_bo_export_fd(bo2);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(tbm_vc4_bufmgr_trim(bufmgr));
+	CHECK(bo_vc4->dmabuf == dmabuf);
+	CHECK(fd_valid(dmabuf));
+	CHECK(lock_held(dmabuf) == 1);
+
+	CHECK(tbm_vc4_bo_unlock(bo));
+	CHECK(bo_vc4->lock_cnt == 0);
+	CHECK(lock_held(dmabuf) == 0);
+
+	/* unpinned again */
+	CHECK(tbm_vc4_bufmgr_trim(bufmgr));
+	CHECK(bo_vc4->dmabuf == 0);
+
+	/* a failed lock leaves no pin behind */
+	fake_drm_fail(FAKE_PRIME_TO_FD, 1);
+	CHECK(!tbm_vc4_bo_lock(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE));
+	CHECK(bo_vc4->lock_cnt == 0);
+
+	/* under churn */
+	churn_stop = 0;
+	CHECK(pthread_create(&thread, NULL, churn, bufmgr) == 0);
+	for (i = 0; i < CHURN_LOOPS; i++) {
+		CHECK(tbm_vc4_bo_lock(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE));
+		dmabuf = bo_vc4->dmabuf;
+		sched_yield();
+		CHECK(bo_vc4->dmabuf == dmabuf);
+		CHECK(fd_valid(dmabuf));
+		CHECK(tbm_vc4_bo_unlock(bo));
+	}
+	churn_stop = 1;
+	pthread_join(thread, NULL);
+	CHECK(bo_vc4->lock_cnt == 0);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bo2);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+#endif /* ALWAYS_BACKEND_CTRL */
+
+int
+main(void)
+{
+	test_handle_kept();
+	test_handle_cached();
+	test_inode_probe(0);
+	test_inode_probe(1);
+	test_inode_dropped();
+	test_render_node_keys(0);
+	test_render_node_keys(1);
+#ifndef ALWAYS_BACKEND_CTRL
+	test_lock_pinned();
+#endif
+
+	return 0;
+}
@@ -0,0 +1,694 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the refs of the imports are only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define BO_SIZE		(64 * 1024)
+#define STRESS_FDS	16
+#define STRESS_LOOPS	2000
+#define BENCH_LOOPS	100000
+#define THREADS_MAX	8
+
+/* a bo found by an import outlives the free of its tbm_bo, the import
+ * takes it over
+ */
+static void
+test_ref_across_free(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 bo_vc4, found;
+	tbm_bo bo;
+
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	bo_vc4 = tbm_backend_get_bo_priv(bo);
+	CHECK(bo_vc4->refs == 1);
+
+	pthread_rwlock_rdlock(&bufmgr_vc4->handle_lock);
+	CHECK(_bo_lookup_import(bufmgr_vc4, &bufmgr_vc4->bos, bo_vc4->gem,
+				NULL, &found) == 1);
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+	CHECK(found == bo_vc4);
+	CHECK(bo_vc4->refs == 2);
+
+	/* the free of the tbm_bo leaves the bo to the import */
+	tbm_bo_unref(bo);
+	CHECK(bo_vc4->state == BO_STATE_LIVE);
+	CHECK(test_stats(bufmgr).cache_count == 0);
+	CHECK(fake_drm_objects() == 1);
+
+	_bo_lookup_done(bo_vc4, NULL);
+	CHECK(bo_vc4->refs == 1);
+
+	/* the free of the import caches it */
+	_bo_unref(bufmgr_vc4, bo_vc4);
+	CHECK(bo_vc4->state == BO_STATE_CACHED);
+	CHECK(test_stats(bufmgr).cache_count == 1);
+
+	/* a cached bo is found without a tbm_bo, the import gets it alone */
+	pthread_rwlock_rdlock(&bufmgr_vc4->handle_lock);
+	CHECK(_bo_lookup_import(bufmgr_vc4, &bufmgr_vc4->bos, bo_vc4->gem,
+				NULL, &found) == 1);
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+	CHECK(found == bo_vc4);
+	CHECK(bo_vc4->state == BO_STATE_LIVE);
+	_bo_lookup_done(bo_vc4, NULL);
+	CHECK(bo_vc4->refs == 1);
+	_bo_unref(bufmgr_vc4, bo_vc4);
+	CHECK(fake_drm_objects() == 0);
+
+	/* a bo whose last ref is gone is looked up again */
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	bo_vc4 = tbm_backend_get_bo_priv(bo);
+	bo_vc4->refs = 0;
+	pthread_rwlock_rdlock(&bufmgr_vc4->handle_lock);
+	CHECK(_bo_lookup_import(bufmgr_vc4, &bufmgr_vc4->bos, bo_vc4->gem,
+				NULL, &found) == -1);
+	pthread_rwlock_unlock(&bufmgr_vc4->handle_lock);
+	bo_vc4->refs = 1;
+	tbm_bo_unref(bo);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* a new dmabuf costs one PRIME import and gets one handle. without the
+ * lseek of the shared inode dmabufs, the handle of the GEM_OPEN which
+ * gives the size is closed at once.
+ */
+static void
+test_import_fd_ioctls(int shared_inode)
+{
+	fake_drm_config config = {0, };
+	tbm_bufmgr bufmgr;
+	tbm_bo bo, bo2, local;
+	int fd, handles;
+
+	config.shared_inode = shared_inode;
+	bufmgr = fake_tbm_init(&config, 0);
+	CHECK(bufmgr);
+
+	/* the inode index is decided by the dmabuf of a second object */
+	local = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(local);
+	fd = tbm_bo_export_fd(local);
+	CHECK(fd >= 0);
+	close(fd);
+
+	fd = fake_drm_foreign_dmabuf(BO_SIZE);
+	CHECK(fd >= 0);
+	handles = fake_drm_handles();
+
+	fake_drm_reset_counts();
+	bo = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo);
+	CHECK(tbm_bo_size(bo) == BO_SIZE);
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == 1);
+	/* the name is only needed by the size fallback of an unseekable fd */
+	CHECK(fake_drm_count(FAKE_GEM_FLINK) == (unsigned long)shared_inode);
+	CHECK(fake_drm_count(FAKE_GEM_OPEN) == (unsigned long)shared_inode);
+	CHECK(fake_drm_count(FAKE_GEM_CLOSE) == (unsigned long)shared_inode);
+	CHECK(fake_drm_handles() == handles + 1);
+
+	/* the known dmabuf is found by its inode or by its prime handle */
+	fake_drm_reset_counts();
+	bo2 = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo2 == bo);
+	CHECK(fake_drm_count(FAKE_GEM_OPEN) == 0);
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == (unsigned long)shared_inode);
+	CHECK(fake_drm_handles() == handles + 1);
+	tbm_bo_unref(bo2);
+
+	/* otherwise the export names the bo */
+	fake_drm_reset_counts();
+	CHECK(tbm_bo_export(bo) != 0);
+	CHECK(fake_drm_count(FAKE_GEM_FLINK) == (unsigned long)!shared_inode);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(local);
+	close(fd);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+nv12_desc(tbm_vc4_bo_desc *desc, unsigned int pitch)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->size = BO_SIZE;
+	desc->format = TBM_FORMAT_NV12;
+	desc->num_planes = 2;
+	desc->height = 64;
+	desc->pitches[0] = pitch;
+	desc->pitches[1] = pitch;
+	desc->offsets[1] = pitch * 64;
+}
+
+/* the layout comes with the first import of a dmabuf and is replaced by
+ * the next ones, a bad layout leaves no handle behind
+ */
+static void
+test_import_fd_desc(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_vc4_bo_desc desc, got;
+	tbm_bo bo, bo2;
+	int fd, handles;
+
+	CHECK(bufmgr);
+	fd = fake_drm_foreign_dmabuf(BO_SIZE);
+	CHECK(fd >= 0);
+	handles = fake_drm_handles();
+
+	/* larger than the dmabuf */
+	nv12_desc(&desc, 512);
+	desc.size = 2 * BO_SIZE;
+	desc.offsets[1] = BO_SIZE;
+	CHECK(!tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc));
+	CHECK(fake_drm_handles() == handles);
+
+	/* the chroma plane ends past the bo with its rows, not with one */
+	nv12_desc(&desc, 768);
+	CHECK(!tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc));
+	desc.height = 0;
+	bo = tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc);
+	CHECK(bo);
+	tbm_bo_unref(bo);
+	CHECK(fake_drm_handles() == handles);
+
+	/* no planes */
+	nv12_desc(&desc, 512);
+	desc.num_planes = 0;
+	CHECK(!tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc));
+
+	nv12_desc(&desc, 512);
+	fake_drm_reset_counts();
+	bo = tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc);
+	CHECK(bo);
+	CHECK(tbm_bo_size(bo) == BO_SIZE);
+	CHECK(fake_drm_count(FAKE_GEM_FLINK) == 0);
+	CHECK(tbm_vc4_bo_get_desc(bo, &got));
+	CHECK(memcmp(&got, &desc, sizeof(desc)) == 0);
+
+	/* replaced */
+	nv12_desc(&desc, 256);
+	bo2 = tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc);
+	CHECK(bo2 == bo);
+	CHECK(tbm_vc4_bo_get_desc(bo, &got));
+	CHECK(got.pitches[0] == 256 && got.offsets[1] == 256 * 64);
+	tbm_bo_unref(bo2);
+
+	/* a bad one is refused and the bo keeps its layout */
+	desc.size = 2 * BO_SIZE;
+	desc.offsets[1] = BO_SIZE;
+	CHECK(!tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc));
+	CHECK(fake_tbm_bo_refs(bo) == 1);
+	CHECK(tbm_vc4_bo_get_desc(bo, &got));
+	CHECK(got.pitches[0] == 256 && got.size == BO_SIZE);
+
+	tbm_bo_unref(bo);
+
+	/* a plain import has no layout */
+	bo = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo);
+	CHECK(!tbm_vc4_bo_get_desc(bo, &got));
+	tbm_bo_unref(bo);
+
+	close(fd);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* get_bo gives the tbm_bo of a live bo with a reference */
+static void
+test_get_bo(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	unsigned int handle;
+	tbm_bo bo, bo2;
+
+	CHECK(bufmgr);
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	handle = tbm_bo_get_handle(bo, TBM_DEVICE_DEFAULT).u32;
+
+	bo2 = tbm_vc4_bufmgr_get_bo(bufmgr, handle);
+	CHECK(bo2 == bo);
+	CHECK(fake_tbm_bo_refs(bo) == 2);
+	tbm_bo_unref(bo2);
+	CHECK(fake_tbm_bo_refs(bo) == 1);
+
+	/* a cached bo is not given out, and stays cached */
+	tbm_bo_unref(bo);
+	CHECK(test_stats(bufmgr).cache_count == 1);
+	CHECK(!tbm_vc4_bufmgr_get_bo(bufmgr, handle));
+	CHECK(test_stats(bufmgr).cache_count == 1);
+	CHECK(fake_tbm_bo_count(bufmgr) == 0);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+#define FOREACH_BOS	4
+
+struct foreach {
+	tbm_bufmgr bufmgr;
+	tbm_bo bos[FOREACH_BOS];
+	int calls;
+};
+
+/* the callback allocates, refs and frees bos */
+static int
+foreach_alloc(tbm_bo bo, void *data)
+{
+	struct foreach *foreach = data;
+	tbm_bo bo2;
+
+	CHECK(fake_tbm_bo_refs(bo) == 2);
+
+	bo2 = tbm_bo_alloc(foreach->bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo2);
+	tbm_bo_unref(bo2);
+
+	foreach->calls++;
+
+	return 1;
+}
+
+static int
+foreach_free(tbm_bo bo, void *data)
+{
+	struct foreach *foreach = data;
+	int i;
+
+	for (i = 0; i < FOREACH_BOS; i++) {
+		if (foreach->bos[i])
+			tbm_bo_unref(foreach->bos[i]);
+		foreach->bos[i] = NULL;
+	}
+
+	foreach->calls++;
+
+	return 1;
+}
+
+static void
+test_foreach(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	struct foreach foreach = {0, };
+	int i;
+
+	CHECK(bufmgr);
+	foreach.bufmgr = bufmgr;
+
+	for (i = 0; i < FOREACH_BOS; i++) {
+		foreach.bos[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(foreach.bos[i]);
+	}
+
+	CHECK(tbm_vc4_bufmgr_foreach_bo(bufmgr, foreach_alloc, &foreach));
+	CHECK(foreach.calls == FOREACH_BOS);
+	for (i = 0; i < FOREACH_BOS; i++)
+		CHECK(fake_tbm_bo_refs(foreach.bos[i]) == 1);
+
+	/* the bos freed by the callback are skipped */
+	foreach.calls = 0;
+	CHECK(tbm_vc4_bufmgr_foreach_bo(bufmgr, foreach_free, &foreach));
+	CHECK(foreach.calls == 1);
+	CHECK(fake_tbm_bo_count(bufmgr) == 0);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the planes of a surface are imported together, a failure imports none */
+static void
+test_import_fds(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo planes[2], bos[3];
+	tbm_fd fds[3];
+	int i;
+
+	CHECK(bufmgr);
+
+	for (i = 0; i < 2; i++) {
+		planes[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(planes[i]);
+		fds[i] = tbm_bo_export_fd(planes[i]);
+		CHECK(fds[i] >= 0);
+		tbm_bo_unref(planes[i]);
+	}
+
+	/* the same dmabuf twice gets one bo with a reference each */
+	fds[2] = dup(fds[0]);
+	fake_drm_reset_counts();
+	CHECK(tbm_vc4_bo_import_fds(bufmgr, fds, 3, bos));
+	CHECK(bos[0] && bos[1] && bos[0] != bos[1]);
+	CHECK(bos[2] == bos[0]);
+	CHECK(fake_tbm_bo_refs(bos[0]) == 2);
+	CHECK(fake_drm_count(FAKE_FD_TO_PRIME) == 2);
+	for (i = 0; i < 3; i++)
+		tbm_bo_unref(bos[i]);
+	CHECK(fake_tbm_bo_count(bufmgr) == 0);
+
+	close(fds[2]);
+	fds[2] = -1;
+	CHECK(!tbm_vc4_bo_import_fds(bufmgr, fds, 3, bos));
+	CHECK(fake_tbm_bo_count(bufmgr) == 0);
+	CHECK(fake_drm_handles() == 0);
+
+	for (i = 0; i < 2; i++)
+		close(fds[i]);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the side-band of an import reaches only its own bo, the imports called
+ * within it are refused
+ */
+static struct {
+	tbm_bufmgr bufmgr;
+	tbm_fd fd;
+	unsigned int handle;
+	int calls;
+} nested;
+
+static void
+nested_hook(unsigned long request, void *arg)
+{
+	tbm_vc4_bo_desc desc;
+	tbm_bo bos[1];
+
+	if (request != DRM_IOCTL_PRIME_FD_TO_HANDLE)
+		return;
+
+	nested.calls++;
+
+	/* the single ones are taken by the backend, the batch is not */
+	CHECK(!import_desc && !import_handle);
+	if (!import_batch)
+		return;
+
+	nv12_desc(&desc, 512);
+	CHECK(!tbm_vc4_bo_import_fd_desc(nested.bufmgr, nested.fd, &desc));
+	CHECK(!tbm_vc4_bo_import_fds(nested.bufmgr, &nested.fd, 1, bos));
+	CHECK(!tbm_vc4_bufmgr_get_bo(nested.bufmgr, nested.handle));
+}
+
+static void
+test_import_nested(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_vc4_bo_desc desc, got;
+	tbm_bo live, bo, bos[1];
+	tbm_fd fd;
+
+	CHECK(bufmgr);
+	live = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(live);
+	fd = fake_drm_foreign_dmabuf(BO_SIZE);
+	CHECK(fd >= 0);
+
+	nested.bufmgr = bufmgr;
+	nested.fd = fd;
+	nested.handle = tbm_bo_get_handle(live, TBM_DEVICE_DEFAULT).u32;
+	nested.calls = 0;
+	fake_drm_set_hook(nested_hook);
+
+	nv12_desc(&desc, 512);
+	bo = tbm_vc4_bo_import_fd_desc(bufmgr, fd, &desc);
+	CHECK(bo);
+	CHECK(tbm_vc4_bo_get_desc(bo, &got));
+	tbm_bo_unref(bo);
+	CHECK(nested.calls == 1);
+
+	CHECK(tbm_vc4_bo_import_fds(bufmgr, &fd, 1, bos));
+	CHECK(nested.calls == 2);
+	tbm_bo_unref(bos[0]);
+
+	fake_drm_set_hook(NULL);
+	CHECK(!import_batch && !import_handle && !import_desc);
+
+	/* nothing is left for the next ones */
+	bo = tbm_vc4_bufmgr_get_bo(bufmgr, nested.handle);
+	CHECK(bo == live);
+	tbm_bo_unref(bo);
+	bo = tbm_bo_import_fd(bufmgr, fd);
+	CHECK(bo);
+	CHECK(!tbm_vc4_bo_get_desc(bo, &got));
+	tbm_bo_unref(bo);
+
+	tbm_bo_unref(live);
+	close(fd);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the import of the two planes of a NV12 frame, together or one by one */
+static void
+bench_import_frame(int batch, int known)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo planes[2], bos[2];
+	tbm_fd fds[2];
+	char name[64];
+	double start;
+	int i, j;
+
+	CHECK(bufmgr);
+
+	for (i = 0; i < 2; i++) {
+		planes[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(planes[i]);
+		fds[i] = tbm_bo_export_fd(planes[i]);
+		CHECK(fds[i] >= 0);
+		if (!known) {
+			tbm_bo_unref(planes[i]);
+			planes[i] = NULL;
+		}
+	}
+
+	start = test_now_us();
+	for (i = 0; i < BENCH_LOOPS / 10; i++) {
+		if (batch) {
+			CHECK(tbm_vc4_bo_import_fds(bufmgr, fds, 2, bos));
+		} else {
+			for (j = 0; j < 2; j++)
+				CHECK((bos[j] = tbm_bo_import_fd(bufmgr, fds[j])));
+		}
+		for (j = 0; j < 2; j++)
+			tbm_bo_unref(bos[j]);
+	}
+	snprintf(name, sizeof(name), "NV12 import %s, %s dmabufs",
+		 batch ? "import_fds" : "import_fd x2", known ? "known" : "new");
+	BENCH(name, BENCH_LOOPS / 10, test_now_us() - start);
+
+	for (i = 0; i < 2; i++) {
+		close(fds[i]);
+		if (planes[i])
+			tbm_bo_unref(planes[i]);
+	}
+
+	fake_tbm_deinit(bufmgr);
+}
+
+struct stress {
+	tbm_bufmgr bufmgr;
+	tbm_fd *fds;
+	int count;
+	int loops;
+	int seed;
+};
+
+static void *
+stress_import(void *data)
+{
+	struct stress *stress = data;
+	unsigned int seed = stress->seed;
+	int i;
+
+	for (i = 0; i < stress->loops; i++) {
+		tbm_bo bo = tbm_bo_import_fd(stress->bufmgr,
+					     stress->fds[rand_r(&seed) % stress->count]);
+
+		CHECK(bo);
+		CHECK(tbm_bo_size(bo) == BO_SIZE);
+		tbm_bo_unref(bo);
+	}
+
+	return NULL;
+}
+
+static void *
+stress_alloc(void *data)
+{
+	struct stress *stress = data;
+	int i;
+
+	for (i = 0; i < stress->loops; i++) {
+		tbm_bo bo = tbm_bo_alloc(stress->bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+
+		CHECK(bo);
+		tbm_bo_unref(bo);
+	}
+
+	return NULL;
+}
+
+/* the imports of the same dmabufs race with each other, with the frees of
+ * their bos and with the allocs of the bo cache
+ */
+static void
+test_stress(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	struct stress stress[THREADS_MAX];
+	pthread_t threads[THREADS_MAX];
+	tbm_fd fds[STRESS_FDS];
+	int i;
+
+	CHECK(bufmgr);
+
+	for (i = 0; i < STRESS_FDS; i++) {
+		tbm_bo bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+
+		CHECK(bo);
+		fds[i] = tbm_bo_export_fd(bo);
+		CHECK(fds[i] >= 0);
+		tbm_bo_unref(bo);
+	}
+
+	for (i = 0; i < THREADS_MAX; i++) {
+		stress[i].bufmgr = bufmgr;
+		stress[i].fds = fds;
+		stress[i].count = STRESS_FDS;
+		stress[i].loops = STRESS_LOOPS;
+		stress[i].seed = i;
+		CHECK(pthread_create(&threads[i], NULL,
+				     i ? stress_import : stress_alloc, &stress[i]) == 0);
+	}
+	for (i = 0; i < THREADS_MAX; i++)
+		pthread_join(threads[i], NULL);
+
+	CHECK(fake_tbm_bo_count(bufmgr) == 0);
+
+	for (i = 0; i < STRESS_FDS; i++)
+		close(fds[i]);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_handles() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* imports of known dmabufs by several threads */
+static void
+bench_import(int threads)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	struct stress stress[THREADS_MAX];
+	pthread_t ids[THREADS_MAX];
+	tbm_bo bos[STRESS_FDS];
+	tbm_fd fds[STRESS_FDS];
+	char name[64];
+	double start;
+	int i;
+
+	CHECK(bufmgr);
+
+	for (i = 0; i < STRESS_FDS; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+		fds[i] = tbm_bo_export_fd(bos[i]);
+		CHECK(fds[i] >= 0);
+	}
+
+	start = test_now_us();
+	for (i = 0; i < threads; i++) {
+		stress[i].bufmgr = bufmgr;
+		stress[i].fds = fds;
+		stress[i].count = STRESS_FDS;
+		stress[i].loops = BENCH_LOOPS / threads;
+		stress[i].seed = i;
+		CHECK(pthread_create(&ids[i], NULL, stress_import, &stress[i]) == 0);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	snprintf(name, sizeof(name), "import_fd/unref, %d threads", threads);
+	BENCH(name, BENCH_LOOPS / threads * threads, test_now_us() - start);
+
+	for (i = 0; i < STRESS_FDS; i++) {
+		close(fds[i]);
+		tbm_bo_unref(bos[i]);
+	}
+
+	fake_tbm_deinit(bufmgr);
+}
+
+int
+main(void)
+{
+	test_ref_across_free();
+	test_import_fd_ioctls(0);
+	test_import_fd_ioctls(1);
+	test_import_fd_desc();
+	test_get_bo();
+	test_foreach();
+	test_import_fds();
+	test_import_nested();
+	test_stress();
+
+	bench_import(1);
+	bench_import(2);
+	bench_import(4);
+
+	bench_import_frame(0, 1);
+	bench_import_frame(1, 1);
+	bench_import_frame(0, 0);
+	bench_import_frame(1, 0);
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+/* the layout of the bo private is only seen from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include "test_common.h"
+
+#define NUM_BOS		10000
+#define NUM_EXPORTED	400
+#define BENCH_LOOPS	1000000
+
+static void
+test_layout(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bo_vc4 bo_vc4[2];
+	tbm_bo bo[2];
+	int i;
+
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	/* the fields of get_handle and map are on the first cache line */
+	CHECK(offsetof(struct _tbm_bo_vc4, state) + sizeof(int) <= TBM_VC4_CACHE_LINE);
+	CHECK(offsetof(struct _tbm_bo_vc4, mutex) == TBM_VC4_CACHE_LINE);
+	CHECK(sizeof(struct _tbm_bo_vc4) % TBM_VC4_CACHE_LINE == 0);
+
+	/* the privates come from one block, each on its own lines */
+	for (i = 0; i < 2; i++) {
+		bo[i] = tbm_bo_alloc(bufmgr, 4096, TBM_BO_DEFAULT);
+		CHECK(bo[i]);
+		bo_vc4[i] = tbm_backend_get_bo_priv(bo[i]);
+		CHECK(((uintptr_t)bo_vc4[i] % TBM_VC4_CACHE_LINE) == 0);
+	}
+	CHECK(bufmgr_vc4->priv_chunks && !bufmgr_vc4->priv_chunks->next);
+	CHECK(bo_vc4[0] >= bufmgr_vc4->priv_chunks->bos &&
+	      bo_vc4[1] < bufmgr_vc4->priv_chunks->bos + BO_PRIV_CHUNK);
+
+	/* the registry entry is the private */
+	CHECK(_registry_lookup(&bufmgr_vc4->bos, bo_vc4[0]->gem) == bo_vc4[0]);
+
+	for (i = 0; i < 2; i++)
+		tbm_bo_unref(bo[i]);
+	fake_tbm_deinit(bufmgr);
+}
+
+static unsigned int
+next_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return *seed >> 8;
+}
+
+static void
+bench_lookups(int num_bos)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo *bos;
+	tbm_fd *fds;
+	unsigned int seed = 1;
+	char name[64];
+	double start;
+	int i;
+
+	CHECK(bufmgr);
+	bos = calloc(num_bos, sizeof(tbm_bo));
+	fds = calloc(NUM_EXPORTED, sizeof(tbm_fd));
+	CHECK(bos && fds);
+
+	for (i = 0; i < num_bos; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, 4096, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+		tbm_bo_map(bos[i], TBM_DEVICE_CPU, TBM_OPTION_READ);
+		tbm_bo_unmap(bos[i]);
+	}
+
+	start = test_now_us();
+	for (i = 0; i < BENCH_LOOPS; i++)
+		tbm_bo_get_handle(bos[next_rand(&seed) % num_bos], TBM_DEVICE_2D);
+	snprintf(name, sizeof(name), "get_handle of %d bos", num_bos);
+	BENCH(name, BENCH_LOOPS, test_now_us() - start);
+
+	start = test_now_us();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		tbm_bo bo = bos[next_rand(&seed) % num_bos];
+
+		tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ);
+		tbm_bo_unmap(bo);
+	}
+	snprintf(name, sizeof(name), "map/unmap of %d bos", num_bos);
+	BENCH(name, BENCH_LOOPS, test_now_us() - start);
+
+	/* the imports of known dmabufs are registry lookups */
+	for (i = 0; i < NUM_EXPORTED && i < num_bos; i++) {
+		fds[i] = tbm_bo_export_fd(bos[i]);
+		CHECK(fds[i] >= 0);
+	}
+
+	start = test_now_us();
+	for (i = 0; i < BENCH_LOOPS / 10; i++) {
+		int n = next_rand(&seed) % (NUM_EXPORTED < num_bos ? NUM_EXPORTED : num_bos);
+		tbm_bo bo = tbm_bo_import_fd(bufmgr, fds[n]);
+
+		CHECK(bo == bos[n]);
+		tbm_bo_unref(bo);
+	}
+	snprintf(name, sizeof(name), "import of known fds, %d bos", num_bos);
+	BENCH(name, BENCH_LOOPS / 10, test_now_us() - start);
+
+	for (i = 0; i < NUM_EXPORTED && i < num_bos; i++)
+		close(fds[i]);
+	for (i = 0; i < num_bos; i++)
+		tbm_bo_unref(bos[i]);
+	free(bos);
+	free(fds);
+	fake_tbm_deinit(bufmgr);
+}
+
+int
+main(void)
+{
+	test_layout();
+
+	bench_lookups(16);
+	bench_lookups(NUM_BOS);
+
+	return 0;
+}
@@ -0,0 +1,194 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the map counts of the bos are only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define BO_SIZE		(64 * 1024)
+#define STRESS_BOS	16
+#define STRESS_LOOPS	5000
+#define BENCH_LOOPS	200000
+#define THREADS_MAX	8
+
+struct stress {
+	tbm_bo *bos;
+	int count;
+	int loops;
+	int id;
+	int yield;            /* let the others run while mapped */
+};
+
+/* map a bo, stamp the word of the thread, check it and unmap */
+static void *
+stress_map(void *data)
+{
+	struct stress *stress = data;
+	unsigned int seed = stress->id;
+	int i;
+
+	for (i = 0; i < stress->loops; i++) {
+		tbm_bo bo = stress->bos[rand_r(&seed) % stress->count];
+		uint32_t stamp = (stress->id << 24) | i;
+		volatile uint32_t *word;
+		tbm_bo_handle handle;
+
+		handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ | TBM_OPTION_WRITE);
+		CHECK(handle.ptr);
+
+		word = (volatile uint32_t *)handle.ptr + stress->id * 16;
+		*word = stamp;
+		if (stress->yield)
+			sched_yield();
+		CHECK(*word == stamp);
+
+		CHECK(tbm_bo_unmap(bo));
+	}
+
+	return NULL;
+}
+
+/* the threads map and unmap the same bos, the idle mappings being evicted
+ * meanwhile under a map budget. a bo is mapped once while it is not
+ * evicted and its map count goes back to 0.
+ */
+static void
+test_stress(const char *budget)
+{
+	tbm_bufmgr bufmgr;
+	struct stress stress[THREADS_MAX];
+	pthread_t threads[THREADS_MAX];
+	tbm_bo bos[STRESS_BOS];
+	tbm_vc4_stats stats;
+	unsigned long mmaps;
+	int i;
+
+	if (budget)
+		setenv("TBM_VC4_MAP_BUDGET", budget, 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_MAP_BUDGET");
+	CHECK(bufmgr);
+
+	for (i = 0; i < STRESS_BOS; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+	}
+
+	for (i = 0; i < THREADS_MAX; i++) {
+		stress[i].bos = bos;
+		stress[i].count = STRESS_BOS;
+		stress[i].loops = STRESS_LOOPS;
+		stress[i].id = i;
+		stress[i].yield = 1;
+		CHECK(pthread_create(&threads[i], NULL, stress_map, &stress[i]) == 0);
+	}
+	for (i = 0; i < THREADS_MAX; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < STRESS_BOS; i++)
+		CHECK(((tbm_bo_vc4)tbm_backend_get_bo_priv(bos[i]))->map_cnt == 0);
+
+	/* every mapping made is either accounted or evicted */
+	stats = test_stats(bufmgr);
+	mmaps = fake_drm_count(FAKE_MMAP_BO);
+	CHECK(stats.map_bytes == (mmaps - stats.map_evictions) * BO_SIZE);
+	CHECK(stats.remaps <= stats.map_evictions);
+	if (budget) {
+		CHECK(stats.map_evictions > 0);
+	} else {
+		CHECK(mmaps == STRESS_BOS);
+		CHECK(stats.map_evictions == 0);
+	}
+
+	for (i = 0; i < STRESS_BOS; i++)
+		tbm_bo_unref(bos[i]);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* map and unmap by several threads, on a bo each or all on one bo */
+static void
+bench_map(int threads, int shared)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	struct stress stress[THREADS_MAX];
+	pthread_t ids[THREADS_MAX];
+	tbm_bo bos[THREADS_MAX];
+	char name[64];
+	double start;
+	int i;
+
+	CHECK(bufmgr);
+
+	for (i = 0; i < threads; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+	}
+
+	start = test_now_us();
+	for (i = 0; i < threads; i++) {
+		stress[i].bos = shared ? bos : &bos[i];
+		stress[i].count = 1;
+		stress[i].loops = BENCH_LOOPS / threads;
+		stress[i].id = i;
+		stress[i].yield = 0;
+		CHECK(pthread_create(&ids[i], NULL, stress_map, &stress[i]) == 0);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	snprintf(name, sizeof(name), "map/unmap, %d threads, %s", threads,
+		 shared ? "one bo" : "a bo each");
+	BENCH(name, BENCH_LOOPS, test_now_us() - start);
+
+	for (i = 0; i < threads; i++)
+		tbm_bo_unref(bos[i]);
+
+	fake_tbm_deinit(bufmgr);
+}
+
+int
+main(void)
+{
+	test_stress(NULL);
+	test_stress("256K");
+
+	bench_map(1, 0);
+	bench_map(2, 0);
+	bench_map(4, 0);
+	bench_map(2, 1);
+	bench_map(4, 1);
+
+	return 0;
+}
@@ -0,0 +1,183 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the prewarm bos are only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define BO_SIZE	(256 * 1024)
+
+static tbm_bufmgr
+init_prewarm(const char *spec, const char *budget)
+{
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bufmgr bufmgr;
+
+	setenv("TBM_VC4_PREWARM", spec, 1);
+	if (budget)
+		setenv("TBM_VC4_MAP_BUDGET", budget, 1);
+	else
+		unsetenv("TBM_VC4_MAP_BUDGET");
+
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+
+	/* wait for the thread, the bos are collected by the next alloc */
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	CHECK(bufmgr_vc4->prewarm_count > 0);
+	while (__sync_fetch_and_add(&bufmgr_vc4->prewarm_ready, 0) <
+	       bufmgr_vc4->prewarm_count)
+		usleep(1000);
+
+	return bufmgr;
+}
+
+static void
+deinit_prewarm(tbm_bufmgr bufmgr)
+{
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+
+	unsetenv("TBM_VC4_PREWARM");
+	unsetenv("TBM_VC4_MAP_BUDGET");
+}
+
+static void
+test_willneed(void)
+{
+	tbm_bufmgr bufmgr = init_prewarm("4:256K", NULL);
+	tbm_vc4_stats stats;
+	tbm_bo bo;
+
+	/* the prewarmed bos are not handed to the kernel to purge */
+	fake_drm_reset_counts();
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(fake_drm_count(FAKE_CREATE_BO) == 0);
+	CHECK(fake_drm_count(FAKE_MADVISE) == 0);
+	CHECK(fake_drm_purge() == 0);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.prewarmed == 4);
+	CHECK(stats.cache_hits == 1);
+	CHECK(stats.cache_count == 3);
+	CHECK(stats.map_bytes == 4 * BO_SIZE);
+
+	/* a freed bo is */
+	tbm_bo_unref(bo);
+	CHECK(fake_drm_count(FAKE_MADVISE) == 1);
+
+	deinit_prewarm(bufmgr);
+}
+
+static void
+test_map_budget(void)
+{
+	tbm_bufmgr bufmgr = init_prewarm("8:256K", "512K");
+	tbm_vc4_stats stats;
+	tbm_bo bo;
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.prewarmed == 8);
+	CHECK(stats.map_bytes <= 512 * 1024);
+	CHECK(stats.alloc_bytes == 8 * BO_SIZE);
+
+	tbm_bo_unref(bo);
+	deinit_prewarm(bufmgr);
+}
+
+static void
+test_register_fails(void)
+{
+	tbm_bufmgr bufmgr = init_prewarm("4:256K", NULL);
+	tbm_bufmgr_vc4 bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+	struct _tbm_bo_vc4 other;
+	unsigned int gems[4];
+	tbm_vc4_stats stats;
+	tbm_bo bo;
+	int i;
+
+	/* another bo holds the gems of the prewarm bos */
+	CHECK(bufmgr_vc4->prewarm_count == 4);
+	for (i = 0; i < 4; i++) {
+		gems[i] = bufmgr_vc4->prewarm_bos[i]->gem;
+		CHECK(_registry_insert(&bufmgr_vc4->bos, gems[i], &other) == &other);
+	}
+
+	/* the bos are destroyed, the gems, mappings and stats go with them */
+	fake_drm_reset_counts();
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(fake_drm_count(FAKE_GEM_CLOSE) == 4);
+	CHECK(fake_drm_objects() == 1);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.prewarmed == 0);
+	CHECK(stats.cache_count == 0);
+	CHECK(stats.alloc_bytes == BO_SIZE);
+	CHECK(stats.map_bytes == 0);
+
+	for (i = 0; i < 4; i++)
+		_registry_delete(&bufmgr_vc4->bos, gems[i], &other);
+
+	tbm_bo_unref(bo);
+	deinit_prewarm(bufmgr);
+}
+
+/* a failed init gives the prewarmed bos back like the deinit */
+static void
+test_init_fails(void)
+{
+	setenv("TBM_VC4_PREWARM", "4:256K", 1);
+	fake_tbm_fail_init(1);
+	CHECK(fake_tbm_init(NULL, 0) == NULL);
+	unsetenv("TBM_VC4_PREWARM");
+
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_handles() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+int
+main(void)
+{
+	test_willneed();
+	test_map_budget();
+	test_register_fails();
+	test_init_fails();
+
+	return 0;
+}
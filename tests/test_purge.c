@@ -0,0 +1,251 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+/* the madvise of the imported bos is only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include "test_common.h"
+
+#define BO_SIZE	(256 * 1024)
+
+static tbm_bo
+alloc_filled(tbm_bufmgr bufmgr, int value)
+{
+	tbm_bo_handle handle;
+	tbm_bo bo;
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	CHECK(handle.ptr);
+	memset(handle.ptr, value, BO_SIZE);
+	tbm_bo_unmap(bo);
+
+	return bo;
+}
+
+static int
+filled(tbm_bo bo, int value)
+{
+	tbm_bo_handle handle;
+	unsigned char *p;
+	int i, ret = 1;
+
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ);
+	CHECK(handle.ptr);
+	for (p = handle.ptr, i = 0; i < BO_SIZE; i++)
+		ret &= p[i] == value;
+	tbm_bo_unmap(bo);
+
+	return ret;
+}
+
+static void
+test_retained(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo bo;
+
+	CHECK(bufmgr);
+
+	bo = alloc_filled(bufmgr, 0x11);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 1) == 1);
+	CHECK(test_stats(bufmgr).purgeable_marked == 1);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 0) == 1);
+	CHECK(filled(bo, 0x11));
+	CHECK(test_stats(bufmgr).purged == 0);
+
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+test_purged(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_vc4_label_stats label;
+	tbm_vc4_stats stats;
+	unsigned int gem;
+	tbm_bo bo, bo2;
+
+	CHECK(bufmgr);
+
+	bo = alloc_filled(bufmgr, 0x22);
+	gem = tbm_bo_get_handle(bo, TBM_DEVICE_DEFAULT).u32;
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 1) == 1);
+	CHECK(fake_drm_purge() == 1);
+
+	/* the bo gets a new object, the contents are lost */
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 0) == 0);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_DEFAULT).u32 != gem);
+	CHECK(filled(bo, 0));
+	CHECK(fake_drm_objects() == 1);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.purged == 1);
+	CHECK(stats.alloc_bytes == BO_SIZE);
+	CHECK(tbm_vc4_bufmgr_get_label_stats(bufmgr, TBM_VC4_LABEL_NONE, &label));
+	CHECK(label.count == 1);
+
+	/* the map of a purged bo restores it too */
+	bo2 = alloc_filled(bufmgr, 0x33);
+	CHECK(tbm_vc4_bo_set_purgeable(bo2, 1) == 1);
+	CHECK(fake_drm_purge() == 1);
+	CHECK(filled(bo2, 0));
+	CHECK(test_stats(bufmgr).purged == 2);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bo2);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+	CHECK(fake_drm_objects() == 0);
+}
+
+static void
+test_recreate_fails(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_vc4_stats stats;
+	tbm_bo bo;
+
+	CHECK(bufmgr);
+
+	bo = alloc_filled(bufmgr, 0x44);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 1) == 1);
+	CHECK(fake_drm_purge() == 1);
+
+	/* the bo keeps its purged object and stays accounted */
+	fake_drm_fail(FAKE_CREATE_BO, 2);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 0) == -1);
+	CHECK(tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ).ptr == NULL);
+	fake_drm_fail(FAKE_CREATE_BO, 0);
+
+	stats = test_stats(bufmgr);
+	CHECK(stats.alloc_bytes == BO_SIZE);
+	CHECK(stats.kernel_failures == 2);
+
+	/* the next use tries again */
+	CHECK(filled(bo, 0));
+
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+	CHECK(fake_drm_objects() == 0);
+}
+
+static void
+test_in_use(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo bo, bo2;
+	void *ptr;
+
+	CHECK(bufmgr);
+
+	/* the pages behind get_handle cannot go away */
+	bo = alloc_filled(bufmgr, 0x55);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_CPU).ptr);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 1) == -1);
+
+	bo2 = alloc_filled(bufmgr, 0x55);
+	CHECK(tbm_bo_get_handle(bo2, TBM_DEVICE_MM).s32 > 0);
+	CHECK(tbm_vc4_bo_set_purgeable(bo2, 1) == -1);
+	tbm_bo_unref(bo2);
+
+	bo2 = alloc_filled(bufmgr, 0x55);
+	ptr = tbm_vc4_bo_map_range(bo2, TBM_OPTION_READ, 4096, 4096);
+	CHECK(ptr);
+	CHECK(tbm_vc4_bo_set_purgeable(bo2, 1) == -1);
+	CHECK(tbm_vc4_bo_unmap_range(bo2, ptr));
+	CHECK(tbm_vc4_bo_set_purgeable(bo2, 1) == 1);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bo2);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+static void
+test_madvise_errors(void)
+{
+	fake_drm_config config = { .no_madvise = 1 };
+	tbm_bufmgr_vc4 bufmgr_vc4;
+	tbm_bufmgr bufmgr;
+	tbm_bo bo, bo2;
+	int fd;
+
+	/* an imported bo of another device fails alone */
+	bufmgr = fake_tbm_init(NULL, 0);
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	fd = fake_drm_foreign_dmabuf(BO_SIZE);
+	CHECK(fd >= 0);
+	bo = tbm_bo_import_fd(bufmgr, fd);
+	close(fd);
+	CHECK(bo);
+	CHECK(_bo_madvise(bufmgr_vc4, tbm_backend_get_bo_priv(bo), 0) == 1);
+	CHECK(bufmgr_vc4->use_madvise);
+
+	bo2 = alloc_filled(bufmgr, 0x66);
+	CHECK(tbm_vc4_bo_set_purgeable(bo2, 1) == 1);
+	CHECK(test_stats(bufmgr).purgeable_marked == 1);
+
+	tbm_bo_unref(bo);
+	tbm_bo_unref(bo2);
+	fake_tbm_deinit(bufmgr);
+
+	/* a kernel without the ioctl */
+	bufmgr = fake_tbm_init(&config, 0);
+	CHECK(bufmgr);
+	bufmgr_vc4 = tbm_backend_get_priv_from_bufmgr(bufmgr);
+
+	bo = alloc_filled(bufmgr, 0x77);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 1) == 1);
+	CHECK(!bufmgr_vc4->use_madvise);
+	CHECK(test_stats(bufmgr).purgeable_marked == 0);
+	CHECK(tbm_vc4_bo_set_purgeable(bo, 0) == 1);
+
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+}
+
+int
+main(void)
+{
+	test_retained();
+	test_purged();
+	test_recreate_fails();
+	test_in_use();
+	test_madvise_errors();
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the window of the cache ops is only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include <string.h>
+
+#include "test_common.h"
+
+#define BO_SIZE		(64 * 1024)
+
+static tbm_bo
+alloc_pattern(tbm_bufmgr bufmgr)
+{
+	tbm_bo_handle handle;
+	tbm_bo bo;
+	int i;
+
+	bo = tbm_bo_alloc(bufmgr, BO_SIZE, TBM_BO_DEFAULT);
+	CHECK(bo);
+
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	CHECK(handle.ptr);
+	for (i = 0; i < BO_SIZE / 4; i++)
+		((uint32_t *)handle.ptr)[i] = i;
+	tbm_bo_unmap(bo);
+
+	return bo;
+}
+
+/* a window gives the bytes at its offset, also on the kernels which map
+ * a bo from its start whatever the offset of the mmap
+ */
+static void
+test_offset(int mmap_whole)
+{
+	fake_drm_config config = {0, };
+	tbm_bufmgr bufmgr;
+	tbm_bo bo;
+	uint32_t *ptr;
+
+	config.mmap_whole = mmap_whole;
+	bufmgr = fake_tbm_init(&config, 0);
+	CHECK(bufmgr);
+
+	bo = alloc_pattern(bufmgr);
+
+	/* a mapping made by the window */
+	CHECK(tbm_vc4_bufmgr_trim(bufmgr));
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_READ, 8192 + 16, 256);
+	CHECK(ptr);
+	CHECK(ptr[0] == (8192 + 16) / 4);
+	CHECK(ptr[63] == (8192 + 16) / 4 + 63);
+	CHECK(tbm_vc4_bo_unmap_range(bo, ptr));
+
+	/* a window of the mapping already there */
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_READ, BO_SIZE - 4096, 4096);
+	CHECK(ptr);
+	CHECK(ptr[0] == (BO_SIZE - 4096) / 4);
+	CHECK(tbm_vc4_bo_unmap_range(bo, ptr));
+
+	tbm_bo_unref(bo);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the cache ops cover the window while it is the only map of the bo */
+static void
+test_window(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo_handle handle;
+	tbm_bo_vc4 bo_vc4;
+	void *ptr, *ptr2;
+	tbm_bo bo;
+
+	CHECK(bufmgr);
+
+	bo = alloc_pattern(bufmgr);
+	bo_vc4 = tbm_backend_get_bo_priv(bo);
+
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_WRITE, 4096, 4096);
+	CHECK(ptr);
+	CHECK(bo_vc4->win_ptr == ptr && bo_vc4->win_size == 4096);
+
+	/* a full map after the window */
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	CHECK(handle.ptr);
+	CHECK(bo_vc4->win_size == 0);
+	tbm_bo_unmap(bo);
+	CHECK(tbm_vc4_bo_unmap_range(bo, ptr));
+
+	/* a second window */
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_WRITE, 0, 4096);
+	CHECK(ptr);
+	CHECK(bo_vc4->win_size == 4096);
+	ptr2 = tbm_vc4_bo_map_range(bo, TBM_OPTION_WRITE, 8192, 4096);
+	CHECK(ptr2);
+	CHECK(bo_vc4->win_size == 0);
+	CHECK(tbm_vc4_bo_unmap_range(bo, ptr2));
+	CHECK(tbm_vc4_bo_unmap_range(bo, ptr));
+	CHECK(bo_vc4->map_cnt == 0);
+
+	/* a window after a full map */
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ);
+	CHECK(handle.ptr);
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_READ, 0, 4096);
+	CHECK(ptr == handle.ptr);
+	CHECK(bo_vc4->win_size == 0);
+	CHECK(tbm_vc4_bo_unmap_range(bo, ptr));
+	tbm_bo_unmap(bo);
+
+	/* the windows left mapped go with the bo */
+	CHECK(tbm_vc4_bo_map_range(bo, TBM_OPTION_READ, 0, 4096));
+	tbm_bo_unref(bo);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* an unmap without a map is refused, map_cnt does not wrap */
+static void
+test_unmap_floor(void)
+{
+	tbm_bufmgr bufmgr = fake_tbm_init(NULL, 0);
+	tbm_bo_handle handle;
+	tbm_bo_vc4 bo_vc4;
+	void *ptr;
+	tbm_bo bo;
+
+	CHECK(bufmgr);
+
+	bo = alloc_pattern(bufmgr);
+	bo_vc4 = tbm_backend_get_bo_priv(bo);
+
+	CHECK(!tbm_vc4_bo_unmap(bo));
+	CHECK(bo_vc4->map_cnt == 0);
+
+	handle = tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_READ);
+	CHECK(handle.ptr);
+	CHECK(bo_vc4->map_cnt == 1);
+	CHECK(tbm_vc4_bo_unmap(bo));
+	CHECK(!tbm_vc4_bo_unmap(bo));
+	CHECK(bo_vc4->map_cnt == 0);
+
+	/* the map of a range dropped by an unmap too many */
+	ptr = tbm_vc4_bo_map_range(bo, TBM_OPTION_READ, 0, 4096);
+	CHECK(ptr);
+	CHECK(tbm_vc4_bo_unmap(bo));
+	CHECK(!tbm_vc4_bo_unmap_range(bo, ptr));
+	CHECK(bo_vc4->map_cnt == 0);
+	CHECK(_list_empty(&bo_vc4->ranges));
+
+	/* the bo is still cached and freed */
+	tbm_bo_unref(bo);
+	CHECK(test_stats(bufmgr).cache_count == 1);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_errors() == 0);
+}
+
+int
+main(void)
+{
+	test_offset(0);
+	test_offset(1);
+	test_window();
+	test_unmap_floor();
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+/* the registry is only reached from the inside */
+#include "tbm_bufmgr_vc4.c"
+
+#include "test_common.h"
+
+/* the keys of the benchmarks, gem handles are small and dense, the
+ * inodes are spread.
+ */
+static uint64_t
+key_of(int i, int sparse)
+{
+	return sparse ? (uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL : (uint64_t)(i + 1);
+}
+
+static int
+count_value(void *value, void *data)
+{
+	(*(unsigned long *)data) += (uintptr_t)value;
+
+	return 1;
+}
+
+static void
+test_table(void)
+{
+	vc4_registry registry;
+	unsigned long sum = 0;
+	int i;
+
+	_registry_init(&registry);
+
+	for (i = 0; i < 10000; i++)
+		CHECK(_registry_insert(&registry, key_of(i, i & 1),
+				       (void *)(uintptr_t)(i + 1)) == (void *)(uintptr_t)(i + 1));
+	CHECK(_registry_count(&registry) == 10000);
+
+	/* the first value of a key stays */
+	CHECK(_registry_insert(&registry, key_of(5, 1), (void *)1) == (void *)6);
+
+	/* a delete needs the value, and keeps the entries probed after it */
+	_registry_delete(&registry, key_of(7, 1), (void *)1);
+	CHECK(_registry_lookup(&registry, key_of(7, 1)) == (void *)8);
+	for (i = 0; i < 10000; i += 3)
+		_registry_delete(&registry, key_of(i, i & 1), (void *)(uintptr_t)(i + 1));
+	for (i = 0; i < 10000; i++)
+		CHECK(_registry_lookup(&registry, key_of(i, i & 1)) ==
+		      (i % 3 ? (void *)(uintptr_t)(i + 1) : NULL));
+	CHECK(_registry_count(&registry) == 10000 - 3334);
+
+	_registry_foreach(&registry, count_value, &sum);
+	for (i = 0; i < 10000; i++)
+		if (i % 3)
+			sum -= i + 1;
+	CHECK(sum == 0);
+
+	_registry_fini(&registry);
+}
+
+static void
+bench_registry(int count, int sparse)
+{
+	vc4_registry registry;
+	char name[64];
+	double start;
+	int i;
+
+	_registry_init(&registry);
+
+	start = test_now_us();
+	for (i = 0; i < count; i++)
+		_registry_insert(&registry, key_of(i, sparse), (void *)(uintptr_t)(i + 1));
+	snprintf(name, sizeof(name), "registry insert, %d %s keys", count,
+		 sparse ? "sparse" : "dense");
+	BENCH(name, count, test_now_us() - start);
+
+	start = test_now_us();
+	for (i = 0; i < count; i++)
+		CHECK(_registry_lookup(&registry, key_of(i, sparse)));
+	snprintf(name, sizeof(name), "registry lookup, %d %s keys", count,
+		 sparse ? "sparse" : "dense");
+	BENCH(name, count, test_now_us() - start);
+
+	start = test_now_us();
+	for (i = 0; i < count; i++)
+		_registry_delete(&registry, key_of(i, sparse), (void *)(uintptr_t)(i + 1));
+	snprintf(name, sizeof(name), "registry delete, %d %s keys", count,
+		 sparse ? "sparse" : "dense");
+	BENCH(name, count, test_now_us() - start);
+
+	CHECK(_registry_count(&registry) == 0);
+
+	_registry_fini(&registry);
+}
+
+int
+main(void)
+{
+	test_table();
+
+	bench_registry(10000, 0);
+	bench_registry(10000, 1);
+	bench_registry(100000, 0);
+	bench_registry(100000, 1);
+
+	return 0;
+}
@@ -0,0 +1,255 @@
+/**************************************************************************
+
+libtbm_vc4
+
+Copyright 2017 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: SooChan Lim <sc1.lim@samsung.com>, Sangjin Lee <lsj119@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define PAGE		4096
+#define SLAB_PAGES	64
+
+static tbm_bufmgr
+init_slab(const char *threshold)
+{
+	tbm_bufmgr bufmgr;
+
+	if (threshold)
+		setenv("TBM_VC4_SLAB_THRESHOLD", threshold, 1);
+	bufmgr = fake_tbm_init(NULL, 0);
+	unsetenv("TBM_VC4_SLAB_THRESHOLD");
+	CHECK(bufmgr);
+
+	return bufmgr;
+}
+
+/* the small bos are carved one after the other out of one gem object, the
+ * big ones get their own
+ */
+static void
+test_carve(void)
+{
+	tbm_bufmgr bufmgr = init_slab("65536");
+	tbm_bo bos[4], big;
+	char *ptrs[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+		CHECK(tbm_vc4_bo_get_offset(bos[i]) == i * PAGE);
+		ptrs[i] = tbm_bo_get_handle(bos[i], TBM_DEVICE_CPU).ptr;
+		CHECK(ptrs[i]);
+		memset(ptrs[i], 'a' + i, PAGE);
+	}
+	CHECK(test_stats(bufmgr).slab_count == 1);
+	CHECK(test_stats(bufmgr).slab_bos == 4);
+	CHECK(fake_drm_objects() == 1);
+
+	/* the cpu handles point into the mapping of the slab */
+	for (i = 1; i < 4; i++)
+		CHECK(ptrs[i] - ptrs[0] == i * PAGE);
+	for (i = 0; i < 4; i++)
+		CHECK(ptrs[i][0] == 'a' + i && ptrs[i][PAGE - 1] == 'a' + i);
+
+	/* a bo spanning pages, and one at the threshold */
+	big = tbm_bo_alloc(bufmgr, 3 * PAGE - 100, TBM_BO_DEFAULT);
+	CHECK(big);
+	CHECK(tbm_vc4_bo_get_offset(big) == 4 * PAGE);
+	CHECK(tbm_bo_size(big) == 3 * PAGE);
+	tbm_bo_unref(big);
+
+	big = tbm_bo_alloc(bufmgr, 65536, TBM_BO_DEFAULT);
+	CHECK(big);
+	CHECK(tbm_vc4_bo_get_offset(big) == 0);
+	CHECK(fake_drm_objects() == 2);
+	CHECK(test_stats(bufmgr).slab_bos == 4);
+	tbm_bo_unref(big);
+
+	for (i = 0; i < 4; i++)
+		tbm_bo_unref(bos[i]);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the freed pages are found again by the next bo which fits in them, a
+ * full slab opens a new one
+ */
+static void
+test_reuse(void)
+{
+	tbm_bufmgr bufmgr = init_slab("65536");
+	tbm_bo bos[SLAB_PAGES], bo, more;
+	int i;
+
+	for (i = 0; i < SLAB_PAGES; i++) {
+		bos[i] = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+		CHECK(bos[i]);
+		CHECK(tbm_vc4_bo_get_offset(bos[i]) == i * PAGE);
+	}
+	CHECK(test_stats(bufmgr).slab_count == 1);
+
+	/* full */
+	more = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+	CHECK(more);
+	CHECK(tbm_vc4_bo_get_offset(more) == 0);
+	CHECK(test_stats(bufmgr).slab_count == 2);
+	CHECK(fake_drm_objects() == 2);
+	tbm_bo_unref(more);
+	CHECK(test_stats(bufmgr).slab_count == 1);
+
+	/* a hole of one page, then of two */
+	tbm_bo_unref(bos[5]);
+	tbm_bo_unref(bos[9]);
+	tbm_bo_unref(bos[10]);
+
+	bo = tbm_bo_alloc(bufmgr, 2 * PAGE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(tbm_vc4_bo_get_offset(bo) == 9 * PAGE);
+	bos[9] = bo;
+	bos[10] = NULL;
+
+	bo = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(tbm_vc4_bo_get_offset(bo) == 5 * PAGE);
+	bos[5] = bo;
+
+	CHECK(test_stats(bufmgr).slab_count == 1);
+	CHECK(test_stats(bufmgr).slab_bos == SLAB_PAGES - 1);
+	CHECK(fake_drm_objects() == 1);
+
+	for (i = 0; i < SLAB_PAGES; i++)
+		if (bos[i])
+			tbm_bo_unref(bos[i]);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the slab goes with its last bo, it is not kept in the bo cache */
+static void
+test_release(void)
+{
+	tbm_bufmgr bufmgr = init_slab("65536");
+	tbm_bo bo, bo2;
+
+	bo = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+	bo2 = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+	CHECK(bo && bo2);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_CPU).ptr);
+	CHECK(fake_drm_objects() == 1);
+
+	tbm_bo_unref(bo);
+	CHECK(test_stats(bufmgr).slab_count == 1);
+	CHECK(fake_drm_objects() == 1);
+
+	tbm_bo_unref(bo2);
+	CHECK(test_stats(bufmgr).slab_count == 0);
+	CHECK(test_stats(bufmgr).slab_bos == 0);
+	CHECK(test_stats(bufmgr).cache_count == 0);
+	CHECK(fake_drm_objects() == 0);
+	CHECK(fake_drm_handles() == 0);
+
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* only the cpu handle of a slab bo is its own, the others would be the
+ * ones of the whole slab
+ */
+static void
+test_refused(void)
+{
+	tbm_bufmgr bufmgr = init_slab("65536");
+	tbm_bo bo;
+
+	bo = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_DEFAULT).u32 == 0);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_2D).u32 == 0);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_3D).u32 == 0);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_MM).u32 == 0);
+	CHECK(tbm_bo_map(bo, TBM_DEVICE_2D, TBM_OPTION_READ).u32 == 0);
+	CHECK(tbm_bo_export(bo) == 0);
+	CHECK(tbm_bo_export_fd(bo) < 0);
+	CHECK(test_stats(bufmgr).dmabuf_count == 0);
+
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_CPU).ptr);
+	CHECK(tbm_bo_map(bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE).ptr);
+	tbm_bo_unmap(bo);
+
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+/* the slabs are off by default and the threshold is capped at a slab */
+static void
+test_threshold(void)
+{
+	tbm_bufmgr bufmgr = init_slab(NULL);
+	tbm_bo bo;
+
+	bo = tbm_bo_alloc(bufmgr, PAGE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(tbm_vc4_bo_get_offset(bo) == 0);
+	CHECK(tbm_bo_get_handle(bo, TBM_DEVICE_DEFAULT).u32 != 0);
+	CHECK(test_stats(bufmgr).slab_count == 0);
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+
+	bufmgr = init_slab("1048576");
+	bo = tbm_bo_alloc(bufmgr, SLAB_PAGES * PAGE - PAGE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(test_stats(bufmgr).slab_bos == 1);
+	tbm_bo_unref(bo);
+
+	bo = tbm_bo_alloc(bufmgr, SLAB_PAGES * PAGE, TBM_BO_DEFAULT);
+	CHECK(bo);
+	CHECK(test_stats(bufmgr).slab_bos == 0);
+	tbm_bo_unref(bo);
+	fake_tbm_deinit(bufmgr);
+	CHECK(fake_drm_errors() == 0);
+}
+
+int
+main(void)
+{
+	test_carve();
+	test_reuse();
+	test_release();
+	test_refused();
+	test_threshold();
+
+	return 0;
+}